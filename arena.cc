@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <cstddef>
+
+#include "arena.h"
+
+Arena::Arena(size_t initial_size)
+    : resource_(initial_size)
+    , allocated_(0) {
+}
+
+uint64_t
+Arena::allocated() {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return allocated_;
+}
+
+void*
+Arena::do_allocate(size_t nbytes, size_t alignment) {
+  // Byte buffers in the arena are viewed as wider types, so give every
+  // allocation the strictest fundamental alignment.
+  alignment = std::max(alignment, alignof(std::max_align_t));
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  allocated_ += nbytes;
+  return resource_.allocate(nbytes, alignment);
+}
+
+void
+Arena::do_deallocate(void*, size_t, size_t) {
+}
+
+bool
+Arena::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+std::pmr::memory_resource*
+scratch_resource() {
+  static const std::pmr::pool_options opts = {0, SCRATCH_MAX_POOLED_BYTES};
+  thread_local std::pmr::unsynchronized_pool_resource resource(opts);
+  return &resource;
+}
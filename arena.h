@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+
+// Size of an Arena's first block. Later blocks grow geometrically.
+#define ARENA_INITIAL_SIZE (64 * 1024)
+
+// Scratch buffers larger than this bypass the per-thread pools and are
+// returned to the heap as soon as they are freed.
+#define SCRATCH_MAX_POOLED_BYTES (1024 * 1024)
+
+// A monotonic arena that may be allocated from concurrently. Deallocation
+// is a no-op and everything is returned in one go when the arena is
+// destroyed, so it suits buffers that live exactly as long as their owner.
+struct Arena : public std::pmr::memory_resource {
+  Arena(size_t initial_size = ARENA_INITIAL_SIZE);
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Bytes handed out so far.
+  uint64_t allocated();
+
+ private:
+  void* do_allocate(size_t nbytes, size_t alignment) override;
+  void do_deallocate(void* ptr, size_t nbytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+  std::mutex mtx_;
+  std::pmr::monotonic_buffer_resource resource_;
+  uint64_t allocated_;
+};
+
+// A per-thread pooling resource for short lived buffers such as raw tile
+// bytes and intermediate decode output. Freed blocks are kept and handed
+// back out for later requests of a similar size, so steady state tile
+// reads don't go through malloc. Memory must be freed on the thread that
+// allocated it.
+std::pmr::memory_resource* scratch_resource();
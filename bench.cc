@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "datatype.h"
+#include "decompressor.h"
+#include "deserializer.h"
+#include "fragment_metadata.h"
+#include "reader.h"
+#include "schema.h"
+#include "stats_kernels.h"
+#include "thread_pool.h"
+#include "tile.h"
+
+// Microbenchmarks for the decode path. Everything runs on synthetic
+// generic tiles built here with zlib so results are comparable across
+// machines and decompressor backends. Real fragment metadata files given
+// on the command line are benchmarked as well.
+
+namespace {
+
+struct BenchOptions {
+  double min_time = 0.25;
+  const char* filter = nullptr;
+  size_t jobs = 0;
+};
+
+BenchOptions bench_opts;
+
+// Written by every benchmark so the work can't be optimized away.
+volatile uint64_t sink;
+
+std::vector<std::string> temp_files;
+
+double
+now() {
+  auto t = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration<double>(t).count();
+}
+
+// Run fn until min_time has passed and report throughput. Each call of fn
+// processes nbytes of data spread over ntiles tiles.
+void
+run(const char* name, const std::string& params, uint64_t nbytes, uint64_t ntiles, const std::function<void()>& fn) {
+  if (bench_opts.filter != nullptr && strstr(name, bench_opts.filter) == nullptr) {
+    return;
+  }
+
+  // Warm up caches, page faults and per-thread decoder state.
+  fn();
+
+  uint64_t iters = 0;
+  double start = now();
+  double elapsed = 0;
+  do {
+    fn();
+    iters++;
+    elapsed = now() - start;
+  } while (elapsed < bench_opts.min_time);
+
+  double mbps = (double)nbytes * iters / elapsed / (1024 * 1024);
+  printf("%-24s %-48s %10.1f", name, params.c_str(), mbps);
+  if (ntiles > 0) {
+    printf(" %12.1f\n", (double)ntiles * iters / elapsed);
+  } else {
+    printf(" %12s\n", "-");
+  }
+  fflush(stdout);
+}
+
+// Offsets-like payload: increasing uint64_t values with small varying
+// steps, which compresses about as well as real tile offsets do.
+std::vector<uint8_t>
+make_payload(size_t nbytes) {
+  std::vector<uint8_t> ret(nbytes);
+  uint64_t val = 0;
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i + sizeof(uint64_t) <= nbytes; i += sizeof(uint64_t)) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    val += 1000 + (state >> 54);
+    memcpy(&ret[i], &val, sizeof(val));
+  }
+  return ret;
+}
+
+template <class T>
+void
+put(std::vector<uint8_t>& buf, T val) {
+  auto pos = buf.size();
+  buf.resize(pos + sizeof(T));
+  memcpy(&buf[pos], &val, sizeof(T));
+}
+
+void
+put_bytes(std::vector<uint8_t>& buf, const uint8_t* data, size_t nbytes) {
+  buf.insert(buf.end(), data, data + nbytes);
+}
+
+std::string
+size_str(uint64_t nbytes) {
+  char buf[32];
+  if (nbytes >= 1024 * 1024 && nbytes % (1024 * 1024) == 0) {
+    snprintf(buf, sizeof(buf), "%lluM", (unsigned long long)(nbytes / (1024 * 1024)));
+  } else if (nbytes >= 1024 && nbytes % 1024 == 0) {
+    snprintf(buf, sizeof(buf), "%lluK", (unsigned long long)(nbytes / 1024));
+  } else {
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)nbytes);
+  }
+  return buf;
+}
+
+// How a synthetic tile is split and compressed.
+struct TileShape {
+  size_t chunk_size_;
+  size_t part_size_;
+  int level_;
+
+  // Store no pipeline so chunks go through tdb_decompress, like tiles
+  // written before pipelines were serialized in the header.
+  bool legacy_;
+
+  std::string str(size_t nbytes) const {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "tile=%s chunk=%s part=%s level=%d%s",
+        size_str(nbytes).c_str(), size_str(chunk_size_).c_str(),
+        size_str(part_size_).c_str(), level_, legacy_ ? " legacy" : "");
+    return buf;
+  }
+};
+
+struct SyntheticTile {
+  std::vector<uint8_t> bytes_;
+  size_t chunks_offset_;
+  size_t num_chunks_;
+};
+
+// Serialize data as a generic tile with a single gzip filter.
+SyntheticTile
+make_tile(const std::vector<uint8_t>& data, const TileShape& shape) {
+  std::vector<uint8_t> pipeline;
+  if (!shape.legacy_) {
+    put<uint32_t>(pipeline, shape.chunk_size_);
+    put<uint32_t>(pipeline, 1);
+    put<uint8_t>(pipeline, 1);  // GZIP
+    put<uint32_t>(pipeline, sizeof(uint8_t) + sizeof(int32_t));
+    put<uint8_t>(pipeline, 1);  // Compressor::GZIP
+    put<int32_t>(pipeline, shape.level_);
+  }
+
+  std::vector<uint8_t> chunks;
+  size_t num_chunks = (data.size() + shape.chunk_size_ - 1) / shape.chunk_size_;
+  put<uint64_t>(chunks, num_chunks);
+
+  std::vector<uint8_t> compressed;
+  for (size_t start = 0; start < data.size(); start += shape.chunk_size_) {
+    size_t chunk_nbytes = std::min(shape.chunk_size_, data.size() - start);
+
+    std::vector<uint8_t> metadata;
+    std::vector<uint8_t> filtered;
+    size_t num_parts = (chunk_nbytes + shape.part_size_ - 1) / shape.part_size_;
+    put<uint32_t>(metadata, 0);
+    put<uint32_t>(metadata, num_parts);
+
+    for (size_t part = 0; part < chunk_nbytes; part += shape.part_size_) {
+      size_t part_nbytes = std::min(shape.part_size_, chunk_nbytes - part);
+      uLongf compressed_nbytes = compressBound(part_nbytes);
+      compressed.resize(compressed_nbytes);
+      int rc = compress2(compressed.data(), &compressed_nbytes,
+          data.data() + start + part, part_nbytes, shape.level_);
+      if (rc != Z_OK) {
+        fprintf(stderr, "Failed to compress synthetic tile.\n");
+        exit(2);
+      }
+
+      put<uint32_t>(metadata, part_nbytes);
+      put<uint32_t>(metadata, compressed_nbytes);
+      put_bytes(filtered, compressed.data(), compressed_nbytes);
+    }
+
+    put<uint32_t>(chunks, chunk_nbytes);
+    put<uint32_t>(chunks, filtered.size());
+    put<uint32_t>(chunks, metadata.size());
+    put_bytes(chunks, metadata.data(), metadata.size());
+    put_bytes(chunks, filtered.data(), filtered.size());
+  }
+
+  SyntheticTile tile;
+  put<uint32_t>(tile.bytes_, 19);  // format version
+  put<uint64_t>(tile.bytes_, chunks.size());
+  put<uint64_t>(tile.bytes_, data.size());
+  put<uint8_t>(tile.bytes_, 4);  // CHAR
+  put<uint64_t>(tile.bytes_, 1);
+  put<uint8_t>(tile.bytes_, 0);  // no encryption
+  put<uint32_t>(tile.bytes_, pipeline.size());
+  put_bytes(tile.bytes_, pipeline.data(), pipeline.size());
+  tile.chunks_offset_ = tile.bytes_.size();
+  tile.num_chunks_ = num_chunks;
+  put_bytes(tile.bytes_, chunks.data(), chunks.size());
+  return tile;
+}
+
+std::string
+write_temp_file(const std::vector<uint8_t>& bytes) {
+  const char* dir = getenv("TMPDIR");
+  std::string path = std::string(dir != nullptr ? dir : "/tmp") + "/fmd_bench.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Error creating temporary file '%s'\n", path.c_str());
+    exit(2);
+  }
+
+  temp_files.push_back(path);
+  size_t written = 0;
+  while (written < bytes.size()) {
+    auto rc = write(fd, bytes.data() + written, bytes.size() - written);
+    if (rc <= 0) {
+      fprintf(stderr, "Error writing temporary file '%s'\n", path.c_str());
+      exit(2);
+    }
+    written += rc;
+  }
+
+  close(fd);
+  return path;
+}
+
+void
+bench_deserializer() {
+  auto buf = make_payload(8 * 1024 * 1024);
+  auto params = "buffer=" + size_str(buf.size());
+
+  run("deserializer_u8", params, buf.size(), 0, [&]() {
+    Deserializer dser(buf.data(), buf.size());
+    uint64_t sum = 0;
+    while (dser.remaining_bytes() > 0) {
+      sum += dser.read<uint8_t>();
+    }
+    sink = sum;
+  });
+
+  run("deserializer_u32", params, buf.size(), 0, [&]() {
+    Deserializer dser(buf.data(), buf.size());
+    uint64_t sum = 0;
+    while (dser.remaining_bytes() > 0) {
+      sum += dser.read<uint32_t>();
+    }
+    sink = sum;
+  });
+
+  run("deserializer_u64", params, buf.size(), 0, [&]() {
+    Deserializer dser(buf.data(), buf.size());
+    uint64_t sum = 0;
+    while (dser.remaining_bytes() > 0) {
+      sum += dser.read<uint64_t>();
+    }
+    sink = sum;
+  });
+}
+
+void
+bench_chunk_data() {
+  auto data = make_payload(4 * 1024 * 1024);
+  for (size_t chunk_size : {4 * 1024 * 1024, 64 * 1024, 4 * 1024}) {
+    TileShape shape = {chunk_size, chunk_size, 1, false};
+    auto tile = make_tile(data, shape);
+    auto chunks = tile.bytes_.data() + tile.chunks_offset_;
+    auto nbytes = tile.bytes_.size() - tile.chunks_offset_;
+
+    auto params = "chunks=" + std::to_string(tile.num_chunks_);
+    run("chunk_data_parse", params, nbytes, 1, [&]() {
+      ChunkData parsed(chunks, nbytes);
+      sink = parsed.orig_size;
+    });
+  }
+}
+
+const std::vector<TileShape>&
+decode_shapes() {
+  static const std::vector<TileShape> shapes = {
+    {64 * 1024, 64 * 1024, 1, true},
+    {64 * 1024, 64 * 1024, 6, true},
+    {64 * 1024, 64 * 1024, 9, true},
+    {64 * 1024, 4 * 1024, 6, true},
+    {1024 * 1024, 1024 * 1024, 6, true},
+    {64 * 1024, 64 * 1024, 6, false},
+  };
+  return shapes;
+}
+
+void
+bench_tdb_decompress() {
+  auto data = make_payload(4 * 1024 * 1024);
+  std::vector<uint8_t> out(data.size());
+
+  for (auto& shape : decode_shapes()) {
+    if (!shape.legacy_) {
+      continue;
+    }
+
+    auto tile = make_tile(data, shape);
+    auto nbytes = tile.bytes_.size() - tile.chunks_offset_;
+    ChunkData chunks(tile.bytes_.data() + tile.chunks_offset_, nbytes);
+
+    run("tdb_decompress", shape.str(data.size()), data.size(), 1, [&]() {
+      for (auto& chunk : chunks.filtered_chunks_) {
+        tdb_decompress(chunk, out.data() + chunk.unfiltered_data_offset_, chunk.unfiltered_data_size_);
+      }
+      sink = out[0];
+    });
+  }
+}
+
+void
+bench_read_tile(ThreadPool& pool) {
+  const size_t num_tiles = 16;
+  auto data = make_payload(1024 * 1024);
+
+  for (auto& shape : decode_shapes()) {
+    std::vector<uint8_t> file;
+    std::vector<uint64_t> offsets;
+    auto tile = make_tile(data, shape);
+    for (size_t i = 0; i < num_tiles; i++) {
+      offsets.push_back(file.size());
+      put_bytes(file, tile.bytes_.data(), tile.bytes_.size());
+    }
+
+    auto path = write_temp_file(file);
+    auto params = shape.str(data.size());
+
+    for (bool use_mmap : {false, true}) {
+      Reader reader(path.c_str(), use_mmap);
+      run(use_mmap ? "read_tile_mmap" : "read_tile", params, data.size() * num_tiles, num_tiles, [&]() {
+        for (auto offset : offsets) {
+          Tile tile = read_tile(reader, offset);
+          sink = tile.data_[0];
+        }
+      });
+    }
+  }
+
+  // Large multi-chunk tiles are split across the pool.
+  auto big = make_payload(16 * 1024 * 1024);
+  TileShape shape = {1024 * 1024, 64 * 1024, 6, false};
+  auto tile = make_tile(big, shape);
+  auto path = write_temp_file(tile.bytes_);
+  Reader reader(path.c_str(), true);
+  auto params = shape.str(big.size()) + " jobs=" + std::to_string(pool.size());
+  run("read_tile_parallel", params, big.size(), 1, [&]() {
+    Tile tile = read_tile(reader, 0, &pool);
+    sink = tile.data_[0];
+  });
+}
+
+// Build a fragment metadata file with nfields fields, num_tiles tiles per
+// field and the same section layout the footer parser expects.
+std::vector<uint8_t>
+make_fragment_metadata(size_t nfields, size_t num_tiles) {
+  TileShape shape = {64 * 1024, 64 * 1024, 6, false};
+  std::vector<uint8_t> file;
+  auto append_tile = [&](const std::vector<uint8_t>& data) {
+    uint64_t offset = file.size();
+    auto tile = make_tile(data, shape);
+    put_bytes(file, tile.bytes_.data(), tile.bytes_.size());
+    return offset;
+  };
+
+  auto uint64s = [&](uint64_t count) {
+    std::vector<uint8_t> data;
+    put<uint64_t>(data, count);
+    auto values = make_payload(count * sizeof(uint64_t));
+    put_bytes(data, values.data(), values.size());
+    return data;
+  };
+
+  auto min_max = [&]() {
+    std::vector<uint8_t> data;
+    put<uint64_t>(data, num_tiles * sizeof(uint64_t));
+    put<uint64_t>(data, 0);
+    auto values = make_payload(num_tiles * sizeof(uint64_t));
+    put_bytes(data, values.data(), values.size());
+    return data;
+  };
+
+  auto sums = [&]() {
+    std::vector<uint8_t> data;
+    put<uint64_t>(data, num_tiles * sizeof(uint64_t));
+    auto values = make_payload(num_tiles * sizeof(uint64_t));
+    put_bytes(data, values.data(), values.size());
+    return data;
+  };
+
+  uint64_t rtree = append_tile(make_payload(num_tiles * 32));
+  std::vector<std::vector<uint64_t>> offsets(8);
+  for (size_t section = 0; section < 8; section++) {
+    for (size_t i = 0; i < nfields; i++) {
+      if (section == 4 || section == 5) {
+        offsets[section].push_back(append_tile(min_max()));
+      } else if (section == 6) {
+        offsets[section].push_back(append_tile(sums()));
+      } else {
+        offsets[section].push_back(append_tile(uint64s(num_tiles)));
+      }
+    }
+  }
+
+  std::vector<uint8_t> stats;
+  for (size_t i = 0; i < nfields; i++) {
+    put<uint64_t>(stats, sizeof(uint64_t));
+    put<uint64_t>(stats, 0);
+    put<uint64_t>(stats, sizeof(uint64_t));
+    put<uint64_t>(stats, UINT64_MAX);
+    put<uint64_t>(stats, i);
+    put<uint64_t>(stats, 0);
+  }
+  uint64_t fragment_stats = append_tile(stats);
+  uint64_t processed_conditions = append_tile(std::vector<uint8_t>(sizeof(uint64_t)));
+
+  std::vector<uint8_t> footer;
+  std::string schema = "__bench_schema";
+  put<uint32_t>(footer, 19);
+  put<uint64_t>(footer, schema.size());
+  put_bytes(footer, reinterpret_cast<const uint8_t*>(schema.data()), schema.size());
+  put<uint8_t>(footer, 0);  // fragment type
+  put<uint8_t>(footer, 1);  // null non-empty domain
+  put<uint64_t>(footer, num_tiles);
+  put<uint64_t>(footer, 1);
+  put<uint8_t>(footer, 0);
+  put<uint8_t>(footer, 0);
+  for (size_t i = 0; i < 3 * nfields; i++) {
+    put<uint64_t>(footer, 0);
+  }
+  put<uint64_t>(footer, rtree);
+  for (auto& section : offsets) {
+    for (auto offset : section) {
+      put<uint64_t>(footer, offset);
+    }
+  }
+  put<uint64_t>(footer, fragment_stats);
+  put<uint64_t>(footer, processed_conditions);
+
+  put_bytes(file, footer.data(), footer.size());
+  put<uint64_t>(file, footer.size());
+  return file;
+}
+
+void
+bench_fragment_metadata_file(const char* name, const std::string& path, const std::string& params, SchemaResolver& resolver, ThreadPool& pool) {
+  Reader probe(path.c_str());
+  auto nbytes = probe.file_size_;
+
+  run(name, params + " serial", nbytes, 1, [&]() {
+    Reader reader(path.c_str(), true);
+    FragmentMetadata fmd(reader, resolver);
+    sink = fmd.nfields_;
+  });
+
+  run(name, params + " jobs=" + std::to_string(pool.size()), nbytes, 1, [&]() {
+    Reader reader(path.c_str(), true);
+    FragmentMetadata fmd(reader, resolver, &pool);
+    sink = fmd.nfields_;
+  });
+}
+
+void
+bench_fragment_metadata(const std::vector<std::string>& files, ThreadPool& pool) {
+  for (size_t num_tiles : {24, 10000}) {
+    const size_t nfields = DEFAULT_NUM_FIELDS;
+    auto path = write_temp_file(make_fragment_metadata(nfields, num_tiles));
+
+    SchemaResolver resolver;
+    resolver.nfields_ = nfields;
+    auto params = "fields=" + std::to_string(nfields) + " tiles=" + std::to_string(num_tiles);
+    bench_fragment_metadata_file("fragment_metadata", path, params, resolver, pool);
+  }
+
+  SchemaResolver resolver;
+  for (auto& file : files) {
+    bench_fragment_metadata_file("fragment_metadata_file", file, file, resolver, pool);
+  }
+}
+
+// Every stats kernel over one tile per datatype, with and without a
+// validity vector, to compare them against memory bandwidth.
+void
+bench_stats_kernels() {
+  const size_t nbytes = 1024 * 1024;
+  std::vector<uint8_t> data(nbytes);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (auto& byte : data) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    byte = state >> 56;
+  }
+
+  const struct {
+    uint8_t datatype_;
+    const char* name_;
+  } types[] = {
+    {DATATYPE_INT8, "int8"},
+    {DATATYPE_INT32, "int32"},
+    {DATATYPE_INT64, "int64"},
+    {DATATYPE_UINT64, "uint64"},
+    {DATATYPE_FLOAT32, "float32"},
+    {DATATYPE_FLOAT64, "float64"},
+  };
+
+  for (auto kernel : available_stats_kernels()) {
+    for (auto& type : types) {
+      uint64_t count = nbytes / datatype_size(type.datatype_);
+      std::vector<uint8_t> validity(count);
+      for (size_t i = 0; i < count; i++) {
+        validity[i] = i % 7 != 0;
+      }
+
+      for (bool nullable : {false, true}) {
+        auto params = std::string(kernel->name()) + " " + type.name_ + (nullable ? " nullable" : "");
+        run("stats_kernel", params, nbytes, 1, [&]() {
+          TileStats stats;
+          kernel->compute(type.datatype_, data.data(), count, nullable ? validity.data() : nullptr, stats);
+          sink = stats.null_count_;
+        });
+      }
+    }
+  }
+}
+
+void
+usage(const char* prog) {
+  fprintf(stderr, "usage: %s [--min-time SECONDS] [--filter NAME] [--jobs N] [--decompressor NAME] [FILE...]\n", prog);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Runs every benchmark whose name contains NAME. Each FILE is a fragment\n");
+  fprintf(stderr, "metadata file that is benchmarked in addition to the synthetic ones.\n");
+  exit(1);
+}
+
+}  // namespace
+
+int
+main(int argc, char* argv[])
+{
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      bench_opts.min_time = strtod(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      bench_opts.filter = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      bench_opts.jobs = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--decompressor") == 0 && i + 1 < argc) {
+      if (!set_decompressor(argv[++i])) {
+        fprintf(stderr, "Unknown or unavailable decompressor '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (argv[i][0] != '-') {
+      files.push_back(argv[i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  ThreadPool pool(bench_opts.jobs);
+
+  printf("Decompressor: %s\n", current_decompressor().name());
+  printf("%-24s %-48s %10s %12s\n", "benchmark", "params", "MB/s", "tiles/s");
+
+  bench_deserializer();
+  bench_chunk_data();
+  bench_tdb_decompress();
+  bench_stats_kernels();
+  bench_read_tile(pool);
+  bench_fragment_metadata(files, pool);
+
+  for (auto& path : temp_files) {
+    unlink(path.c_str());
+  }
+
+  return 0;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// TileDB Datatype values.
+const uint8_t DATATYPE_INT32 = 0;
+const uint8_t DATATYPE_INT64 = 1;
+const uint8_t DATATYPE_FLOAT32 = 2;
+const uint8_t DATATYPE_FLOAT64 = 3;
+const uint8_t DATATYPE_CHAR = 4;
+const uint8_t DATATYPE_INT8 = 5;
+const uint8_t DATATYPE_UINT8 = 6;
+const uint8_t DATATYPE_INT16 = 7;
+const uint8_t DATATYPE_UINT16 = 8;
+const uint8_t DATATYPE_UINT32 = 9;
+const uint8_t DATATYPE_UINT64 = 10;
+const uint8_t DATATYPE_STRING_ASCII = 11;
+const uint8_t DATATYPE_ANY = 17;
+const uint8_t DATATYPE_DATETIME_YEAR = 18;
+const uint8_t DATATYPE_TIME_AS = 39;
+
+// The cell_val_num TileDB uses for variable sized fields.
+const uint32_t VAR_NUM = UINT32_MAX;
+
+inline uint64_t
+datatype_size(uint8_t type) {
+  switch (type) {
+    case 0: case 2: case 9: case 14: case 16:
+      return 4;
+    case 1: case 3: case 10:
+      return 8;
+    case 7: case 8: case 13: case 15:
+      return 2;
+    default:
+      break;
+  }
+
+  if (type >= DATATYPE_DATETIME_YEAR && type <= DATATYPE_TIME_AS) {
+    return 8;
+  }
+
+  return 1;
+}
+
+inline bool
+datatype_is_datetime(uint8_t type) {
+  return type >= DATATYPE_DATETIME_YEAR && type <= DATATYPE_TIME_AS;
+}
+
+// Invoke f with a value of the C++ integer type matching datatype. Returns
+// false without calling f for non-integer types.
+template <class F>
+bool
+with_integer_type(uint8_t datatype, F&& f) {
+  switch (datatype) {
+    case DATATYPE_INT8: f(int8_t(0)); return true;
+    case DATATYPE_UINT8: f(uint8_t(0)); return true;
+    case DATATYPE_INT16: f(int16_t(0)); return true;
+    case DATATYPE_UINT16: f(uint16_t(0)); return true;
+    case DATATYPE_INT32: f(int32_t(0)); return true;
+    case DATATYPE_UINT32: f(uint32_t(0)); return true;
+    case DATATYPE_INT64: f(int64_t(0)); return true;
+    case DATATYPE_UINT64: f(uint64_t(0)); return true;
+    default: break;
+  }
+
+  if (datatype_is_datetime(datatype)) {
+    f(int64_t(0));
+    return true;
+  }
+
+  return false;
+}
+
+// Like with_integer_type but also calls f with float and double for the
+// floating point types.
+template <class F>
+bool
+with_numeric_type(uint8_t datatype, F&& f) {
+  if (datatype == DATATYPE_FLOAT32) {
+    f(float(0));
+    return true;
+  }
+
+  if (datatype == DATATYPE_FLOAT64) {
+    f(double(0));
+    return true;
+  }
+
+  return with_integer_type(datatype, f);
+}
+
+// Print a single value of the given fixed size datatype.
+inline void
+print_value(FILE* out, uint8_t datatype, const uint8_t* buf) {
+  if (datatype == DATATYPE_FLOAT32) {
+    float val;
+    memcpy(&val, buf, sizeof(val));
+    fprintf(out, "%f", val);
+    return;
+  }
+
+  if (datatype == DATATYPE_FLOAT64) {
+    double val;
+    memcpy(&val, buf, sizeof(val));
+    fprintf(out, "%f", val);
+    return;
+  }
+
+  bool is_int = with_integer_type(datatype, [&](auto zero) {
+    decltype(zero) val;
+    memcpy(&val, buf, sizeof(val));
+    if (std::is_signed<decltype(zero)>::value) {
+      fprintf(out, "%lld", (long long)val);
+    } else {
+      fprintf(out, "%llu", (unsigned long long)val);
+    }
+  });
+
+  if (!is_int) {
+    fprintf(out, "0x%02x", buf[0]);
+  }
+}
+
+// Types TileDB keeps sums for when the field has one value per cell.
+inline bool
+is_numeric(uint8_t datatype) {
+  return datatype == DATATYPE_FLOAT32
+      || datatype == DATATYPE_FLOAT64
+      || with_integer_type(datatype, [](auto) {});
+}
+
+// A value of a numeric datatype as text, with enough digits for floats
+// to round trip.
+inline std::string
+format_number(uint8_t datatype, const uint8_t* buf) {
+  char str[64];
+  if (datatype == DATATYPE_FLOAT32) {
+    float val;
+    memcpy(&val, buf, sizeof(val));
+    snprintf(str, sizeof(str), "%.9g", val);
+    return str;
+  }
+
+  if (datatype == DATATYPE_FLOAT64) {
+    double val;
+    memcpy(&val, buf, sizeof(val));
+    snprintf(str, sizeof(str), "%.17g", val);
+    return str;
+  }
+
+  with_integer_type(datatype, [&](auto zero) {
+    decltype(zero) val;
+    memcpy(&val, buf, sizeof(val));
+    if (std::is_signed<decltype(zero)>::value) {
+      snprintf(str, sizeof(str), "%lld", (long long)val);
+    } else {
+      snprintf(str, sizeof(str), "%llu", (unsigned long long)val);
+    }
+  });
+  return str;
+}
+
+// Sums are int64 for signed types, uint64 for unsigned and double for
+// floating point.
+inline std::string
+format_sum(uint8_t datatype, const uint8_t* buf) {
+  if (datatype == DATATYPE_FLOAT32 || datatype == DATATYPE_FLOAT64) {
+    return format_number(DATATYPE_FLOAT64, buf);
+  }
+
+  bool is_signed = false;
+  with_integer_type(datatype, [&](auto zero) {
+    is_signed = std::is_signed<decltype(zero)>::value;
+  });
+  return format_number(is_signed ? DATATYPE_INT64 : DATATYPE_UINT64, buf);
+}
+
+// A quoted string with non-printable bytes escaped as \xNN.
+inline std::string
+format_string(std::string_view val) {
+  std::string ret = "\"";
+  for (unsigned char c : val) {
+    if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\x%02x", c);
+      ret += esc;
+    } else {
+      ret += (char)c;
+    }
+  }
+  return ret + "\"";
+}
@@ -1,74 +1,194 @@
 
+#include <string.h>
 #include <zlib.h>
 
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include <atomic>
+#include <stdexcept>
+
 #include "decompressor.h"
-#include "deserializer.h"
+#include "filter_pipeline.h"
+
+namespace {
+
+std::atomic<uint64_t> num_inflate_inits{0};
+std::atomic<uint64_t> num_inflate_reuses{0};
+
+// A zlib inflate stream owned by a single thread. The stream (and its
+// window allocation) is created on first use and then recycled with
+// inflateReset for every later part, chunk, tile and file on that thread.
+struct InflateContext {
+  InflateContext()
+      : initialized_(false) {
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    strm_.avail_in = 0;
+    strm_.next_in = Z_NULL;
+  }
 
-void
-decompress_part(uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = Z_NULL;
-
-  if (inflateInit(&strm) != Z_OK) {
-    fprintf(stderr, "Failed to initialize decompression stream.\n");
-    exit(2);
+  ~InflateContext() {
+    if (initialized_) {
+      (void)inflateEnd(&strm_);
+    }
   }
 
-  strm.next_in = src;
-  strm.next_out = dst;
-  strm.avail_in = src_nbytes;
-  strm.avail_out = dst_nbytes;
+  z_stream* acquire() {
+    if (!initialized_) {
+      if (inflateInit(&strm_) != Z_OK) {
+        throw std::runtime_error("Failed to initialize decompression stream.");
+      }
+      initialized_ = true;
+      num_inflate_inits++;
+    } else {
+      if (inflateReset(&strm_) != Z_OK) {
+        throw std::runtime_error("Failed to reset decompression stream.");
+      }
+      num_inflate_reuses++;
+    }
 
-  if (inflate(&strm, Z_FINISH) != Z_STREAM_END) {
-    fprintf(stderr, "Failed to decompress buffer.\n");
-    exit(2);
+    return &strm_;
   }
 
-  (void)inflateEnd(&strm);
-}
+  z_stream strm_;
+  bool initialized_;
+};
 
+thread_local InflateContext inflate_context;
 
-void
-tdb_decompress(DiskLayout& layout, uint8_t* buf, size_t nbytes)
-{
-  Deserializer dser(layout.filtered_metadata_, layout.filtered_metadata_size_);
-  auto num_metadata_parts = dser.read<uint32_t>();
-  auto num_data_parts = dser.read<uint32_t>();
+struct ZlibDecompressor : public Decompressor {
+  const char* name() const override {
+    return "zlib";
+  }
 
-  //fprintf(stderr, "Decompression %d metadata parts, %d data parts.\n", num_metadata_parts, num_data_parts);
+  void decompress_part(
+      const uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) override {
+    z_stream* strm = inflate_context.acquire();
 
-  if (num_metadata_parts != 0) {
-    fprintf(stderr, "Found metadata parts in gzip decompressor.");
-    exit(2);
+    strm->next_in = const_cast<uint8_t*>(src);
+    strm->next_out = dst;
+    strm->avail_in = src_nbytes;
+    strm->avail_out = dst_nbytes;
+
+    if (inflate(strm, Z_FINISH) != Z_STREAM_END) {
+      throw std::runtime_error("Failed to decompress buffer.");
+    }
+
+    // A stream that ends early would leave the rest of dst unwritten.
+    if (strm->total_out != dst_nbytes) {
+      throw std::runtime_error("Failed to decompress buffer.");
+    }
+  }
+};
+
+#ifdef HAVE_LIBDEFLATE
+// libdeflate only decodes whole buffers, which is exactly what a gzip
+// filter part is. Its decompressor is allocated once per thread.
+struct LibdeflateContext {
+  LibdeflateContext()
+      : decompressor_(nullptr) {
   }
 
-  // Setup references to our buffers that can be moved as we work through
-  // decompressing the chunks.
-  uint8_t* curr_src = layout.filtered_data_;
-  uint8_t* curr_dst = buf;
+  ~LibdeflateContext() {
+    if (decompressor_ != nullptr) {
+      libdeflate_free_decompressor(decompressor_);
+    }
+  }
 
-  size_t src_bytes = layout.filtered_data_size_;
-  size_t dst_bytes = nbytes;
+  libdeflate_decompressor* acquire() {
+    if (decompressor_ == nullptr) {
+      decompressor_ = libdeflate_alloc_decompressor();
+      if (decompressor_ == nullptr) {
+        throw std::runtime_error("Failed to allocate libdeflate decompressor.");
+      }
+      num_inflate_inits++;
+    } else {
+      num_inflate_reuses++;
+    }
+
+    return decompressor_;
+  }
 
-  for (size_t i = 0; i < num_data_parts; i++) {
-    auto uncompressed_size = dser.read<uint32_t>();
-    auto compressed_size = dser.read<uint32_t>();
+  libdeflate_decompressor* decompressor_;
+};
 
-    if (compressed_size > src_bytes) {
-      fprintf(stderr, "Error decompression chunk, not enough input buffer.\n");
-      exit(2);
+thread_local LibdeflateContext libdeflate_context;
+
+struct LibdeflateDecompressor : public Decompressor {
+  const char* name() const override {
+    return "libdeflate";
+  }
+
+  void decompress_part(
+      const uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) override {
+    size_t actual = 0;
+    auto rc = libdeflate_zlib_decompress(
+        libdeflate_context.acquire(), src, src_nbytes, dst, dst_nbytes, &actual);
+
+    if (rc != LIBDEFLATE_SUCCESS || actual != dst_nbytes) {
+      throw std::runtime_error("Failed to decompress buffer.");
     }
+  }
+};
+#endif
+
+std::atomic<Decompressor*> selected_decompressor{nullptr};
+
+}  // namespace
+
+InflateStats
+inflate_stats() {
+  InflateStats stats;
+  stats.inits_ = num_inflate_inits;
+  stats.reuses_ = num_inflate_reuses;
+  return stats;
+}
+
+std::vector<Decompressor*>
+available_decompressors() {
+#ifdef HAVE_LIBDEFLATE
+  static LibdeflateDecompressor libdeflate;
+#endif
+  static ZlibDecompressor zlib;
+
+  return {
+#ifdef HAVE_LIBDEFLATE
+    &libdeflate,
+#endif
+    &zlib,
+  };
+}
 
-    if (uncompressed_size > dst_bytes) {
-      fprintf(stderr, "Error dcompression chunk, not enough output buffer.\n");
-      exit(2);
+bool
+set_decompressor(const char* name) {
+  for (auto backend : available_decompressors()) {
+    if (strcmp(backend->name(), name) == 0) {
+      selected_decompressor = backend;
+      return true;
     }
+  }
 
-    //fprintf(stderr, "Decompressing data chunk from %u to %u bytes.\n", compressed_size, uncompressed_size);
-    decompress_part(curr_src, compressed_size, curr_dst, uncompressed_size);
+  return false;
+}
+
+Decompressor&
+current_decompressor() {
+  auto backend = selected_decompressor.load();
+  if (backend == nullptr) {
+    backend = available_decompressors()[0];
+    selected_decompressor = backend;
   }
+
+  return *backend;
+}
+
+void
+tdb_decompress(DiskLayout& layout, uint8_t* buf, size_t nbytes)
+{
+  // Generic tiles are stored as single byte CHAR values.
+  FilterTileInfo tile = {4, 1};
+  FilterPipeline::gzip().unfilter_chunk(tile, layout, buf, nbytes);
 }
@@ -5,4 +5,39 @@
 
 #include "tile.h"
 
+// Counts of per-thread decompression contexts (zlib streams or libdeflate
+// decompressors) created versus recycled across all threads since startup.
+struct InflateStats {
+  uint64_t inits_;
+  uint64_t reuses_;
+};
+
+InflateStats inflate_stats();
+
+// A backend that inflates a single gzip filter data part. TileDB records
+// every part's uncompressed size so backends are handed an exactly sized
+// destination and may use one-shot buffer APIs.
+//
+// Backends are stateless singletons. Any decoder state they need is kept
+// per thread so decompress_part may be called concurrently.
+struct Decompressor {
+  virtual ~Decompressor() {}
+
+  virtual const char* name() const = 0;
+
+  virtual void decompress_part(
+      const uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) = 0;
+};
+
+// The backends compiled into this build, fastest first. The first entry
+// is the default.
+std::vector<Decompressor*> available_decompressors();
+
+// Select the backend used by tdb_decompress. Returns false if no backend
+// with that name was compiled in.
+bool set_decompressor(const char* name);
+
+Decompressor& current_decompressor();
+
+// Unfilter a chunk written with the historical single gzip stage pipeline.
 void tdb_decompress(DiskLayout& layout, uint8_t* buf, size_t nytes);
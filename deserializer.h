@@ -54,7 +54,9 @@ class Deserializer {
       throw std::logic_error("Reading data past end of serialized data size.");
     }
 
-    memcpy(data, ptr_, size);
+    if (size > 0) {
+      memcpy(data, ptr_, size);
+    }
     ptr_ += size;
     size_ -= size;
   }
@@ -0,0 +1,391 @@
+#include <string.h>
+
+#include <charconv>
+
+#include "emitter.h"
+
+namespace {
+
+// Identifies the binary format, written at the start of every fragment.
+const uint32_t BINARY_MAGIC = 0x31444d46;  // "FMD1"
+
+enum BinaryTag : uint8_t {
+  TAG_BEGIN_FRAGMENT = 1,
+  TAG_END_FRAGMENT,
+  TAG_BEGIN_RECORD,
+  TAG_END_RECORD,
+  TAG_BEGIN_OBJECT,
+  TAG_END_OBJECT,
+  TAG_BEGIN_ARRAY,
+  TAG_END_ARRAY,
+  TAG_NULL,
+  TAG_BOOL,
+  TAG_U64,
+  TAG_STR,
+  TAG_BYTES,
+  TAG_U64S,
+};
+
+// JSON and NDJSON share everything but how records are framed. JSON writes
+// one object per fragment with a member per section, collecting the
+// records of a per-field section into an array. NDJSON writes each record
+// as its own line tagged with the fragment path and section.
+struct JsonEmitter : public Emitter {
+  JsonEmitter(FILE* out, bool ndjson)
+      : Emitter(out)
+      , ndjson_(ndjson) {
+  }
+
+  void begin_fragment(const std::string& path) override {
+    path_ = path;
+    if (!ndjson_) {
+      buf_ += "{\"path\": ";
+      quote(path);
+      group_.clear();
+    }
+  }
+
+  void end_fragment() override {
+    if (!ndjson_) {
+      close_group();
+      buf_ += "\n}\n";
+    }
+    flush();
+  }
+
+  void begin_record(const char* section, int64_t field) override {
+    if (ndjson_) {
+      buf_ += "{\"path\": ";
+      quote(path_);
+      buf_ += ", \"section\": ";
+      quote(section);
+    } else if (field < 0) {
+      close_group();
+      buf_ += ",\n  ";
+      quote(section);
+      buf_ += ": {";
+    } else {
+      if (group_ != section) {
+        close_group();
+        buf_ += ",\n  ";
+        quote(section);
+        buf_ += ": [\n    {";
+        group_ = section;
+      } else {
+        buf_ += ",\n    {";
+      }
+    }
+
+    if (field >= 0) {
+      buf_ += ndjson_ ? ", \"field\": " : "\"field\": ";
+      number(field);
+    }
+
+    open_.push_back(RECORD);
+    first_.push_back(!ndjson_ && field < 0);
+  }
+
+  void end_record() override {
+    pop();
+    buf_ += ndjson_ ? "}\n" : "}";
+    maybe_flush();
+  }
+
+  void begin_object(const char* key) override {
+    member(key);
+    buf_ += '{';
+    open_.push_back(OBJECT);
+    first_.push_back(true);
+  }
+
+  void end_object() override {
+    pop();
+    buf_ += '}';
+  }
+
+  void begin_array(const char* key) override {
+    member(key);
+    buf_ += '[';
+    open_.push_back(ARRAY);
+    first_.push_back(true);
+  }
+
+  void end_array() override {
+    pop();
+    buf_ += ']';
+  }
+
+  void null(const char* key) override {
+    member(key);
+    buf_ += "null";
+  }
+
+  void boolean(const char* key, bool val) override {
+    member(key);
+    buf_ += val ? "true" : "false";
+  }
+
+  void u64(const char* key, uint64_t val) override {
+    member(key);
+    number(val);
+  }
+
+  void str(const char* key, const std::string& val) override {
+    member(key);
+    quote(val);
+  }
+
+  void bytes(const char* key, const uint8_t* data, size_t nbytes) override {
+    static const char* digits = "0123456789abcdef";
+    member(key);
+    buf_ += '"';
+    for (size_t i = 0; i < nbytes; i++) {
+      buf_ += digits[data[i] >> 4];
+      buf_ += digits[data[i] & 0xf];
+    }
+    buf_ += '"';
+  }
+
+  void u64s(const char* key, const uint64_t* data, size_t count) override {
+    member(key);
+    buf_ += '[';
+    for (size_t i = 0; i < count; i++) {
+      if (i > 0) {
+        buf_ += ", ";
+      }
+      number(data[i]);
+    }
+    buf_ += ']';
+  }
+
+ private:
+  void close_group() {
+    if (!group_.empty()) {
+      buf_ += "\n  ]";
+      group_.clear();
+    }
+  }
+
+  void pop() {
+    open_.pop_back();
+    first_.pop_back();
+  }
+
+  // Write the separator and key for a value in the innermost container.
+  void member(const char* key) {
+    if (!first_.back()) {
+      buf_ += ", ";
+    }
+    first_.back() = false;
+
+    if (open_.back() != ARRAY) {
+      quote(key);
+      buf_ += ": ";
+    }
+  }
+
+  template <class T>
+  void number(T val) {
+    char tmp[24];
+    auto res = std::to_chars(tmp, tmp + sizeof(tmp), val);
+    buf_.append(tmp, res.ptr);
+  }
+
+  void quote(const std::string& val) {
+    buf_ += '"';
+    for (unsigned char c : val) {
+      if (c == '"' || c == '\\') {
+        buf_ += '\\';
+        buf_ += c;
+      } else if (c < 0x20) {
+        char tmp[8];
+        snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+        buf_ += tmp;
+      } else {
+        buf_ += c;
+      }
+    }
+    buf_ += '"';
+  }
+
+  bool ndjson_;
+  std::string path_;
+  std::string group_;
+  std::vector<bool> first_;
+};
+
+// A compact tagged little endian format. Every item is a one byte tag
+// followed by its key (u32 length and bytes, empty inside arrays) and its
+// payload. Strings and byte blobs are a u64 length and the bytes, and
+// uint64_t arrays are a u64 count followed by the raw values so readers
+// can map them as columns without parsing.
+struct BinaryEmitter : public Emitter {
+  explicit BinaryEmitter(FILE* out)
+      : Emitter(out) {
+  }
+
+  void begin_fragment(const std::string& path) override {
+    put<uint8_t>(TAG_BEGIN_FRAGMENT);
+    put<uint32_t>(BINARY_MAGIC);
+    blob(path.data(), path.size());
+  }
+
+  void end_fragment() override {
+    put<uint8_t>(TAG_END_FRAGMENT);
+    flush();
+  }
+
+  void begin_record(const char* section, int64_t field) override {
+    put<uint8_t>(TAG_BEGIN_RECORD);
+    blob(section, strlen(section));
+    put<int64_t>(field);
+    open_.push_back(RECORD);
+  }
+
+  void end_record() override {
+    open_.pop_back();
+    put<uint8_t>(TAG_END_RECORD);
+    maybe_flush();
+  }
+
+  void begin_object(const char* key) override {
+    item(TAG_BEGIN_OBJECT, key);
+    open_.push_back(OBJECT);
+  }
+
+  void end_object() override {
+    open_.pop_back();
+    put<uint8_t>(TAG_END_OBJECT);
+  }
+
+  void begin_array(const char* key) override {
+    item(TAG_BEGIN_ARRAY, key);
+    open_.push_back(ARRAY);
+  }
+
+  void end_array() override {
+    open_.pop_back();
+    put<uint8_t>(TAG_END_ARRAY);
+  }
+
+  void null(const char* key) override {
+    item(TAG_NULL, key);
+  }
+
+  void boolean(const char* key, bool val) override {
+    item(TAG_BOOL, key);
+    put<uint8_t>(val);
+  }
+
+  void u64(const char* key, uint64_t val) override {
+    item(TAG_U64, key);
+    put<uint64_t>(val);
+  }
+
+  void str(const char* key, const std::string& val) override {
+    item(TAG_STR, key);
+    blob(val.data(), val.size());
+  }
+
+  void bytes(const char* key, const uint8_t* data, size_t nbytes) override {
+    item(TAG_BYTES, key);
+    blob(data, nbytes);
+  }
+
+  void u64s(const char* key, const uint64_t* data, size_t count) override {
+    item(TAG_U64S, key);
+    put<uint64_t>(count);
+    if (count > 0) {
+      buf_.append(reinterpret_cast<const char*>(data), count * sizeof(uint64_t));
+    }
+  }
+
+ private:
+  template <class T>
+  void put(T val) {
+    buf_.append(reinterpret_cast<const char*>(&val), sizeof(T));
+  }
+
+  void blob(const void* data, uint64_t nbytes) {
+    put<uint64_t>(nbytes);
+    if (nbytes > 0) {
+      buf_.append(static_cast<const char*>(data), nbytes);
+    }
+  }
+
+  void item(BinaryTag tag, const char* key) {
+    put<uint8_t>(tag);
+    if (open_.back() == ARRAY || key == nullptr) {
+      put<uint32_t>(0);
+      return;
+    }
+
+    uint32_t len = strlen(key);
+    put<uint32_t>(len);
+    buf_.append(key, len);
+  }
+};
+
+}  // namespace
+
+Emitter::Emitter(FILE* out)
+    : out_(out) {
+}
+
+Emitter::~Emitter() {
+  flush();
+}
+
+void
+Emitter::error(const std::string& msg) {
+  while (!open_.empty()) {
+    switch (open_.back()) {
+      case ARRAY:
+        end_array();
+        break;
+      case OBJECT:
+        end_object();
+        break;
+      case RECORD:
+        end_record();
+        break;
+    }
+  }
+
+  begin_record("error");
+  str("message", msg);
+  end_record();
+}
+
+void
+Emitter::flush() {
+  if (!buf_.empty()) {
+    fwrite(buf_.data(), 1, buf_.size(), out_);
+    buf_.clear();
+  }
+}
+
+void
+Emitter::maybe_flush() {
+  if (buf_.size() >= EMITTER_FLUSH_BYTES) {
+    flush();
+  }
+}
+
+const char*
+emitter_formats() {
+  return "json, ndjson, binary";
+}
+
+std::unique_ptr<Emitter>
+make_emitter(const char* format, FILE* out) {
+  if (strcmp(format, "json") == 0) {
+    return std::make_unique<JsonEmitter>(out, false);
+  } else if (strcmp(format, "ndjson") == 0) {
+    return std::make_unique<JsonEmitter>(out, true);
+  } else if (strcmp(format, "binary") == 0) {
+    return std::make_unique<BinaryEmitter>(out);
+  }
+
+  return nullptr;
+}
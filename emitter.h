@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Output accumulates in memory and is written with a single fwrite once a
+// record ends with at least this much buffered, or when a fragment ends.
+#define EMITTER_FLUSH_BYTES (64 * 1024)
+
+// Structured output for machine consumption. A fragment is emitted as a
+// sequence of records, one per section (or per field of a per-field
+// section), each holding keyed values. Sections are emitted as they are
+// loaded so large fragments stream out rather than being built whole.
+//
+// Keys are ignored (and may be nullptr) for values directly inside an
+// array.
+struct Emitter {
+  explicit Emitter(FILE* out);
+  virtual ~Emitter();
+
+  Emitter(const Emitter&) = delete;
+  Emitter& operator=(const Emitter&) = delete;
+
+  virtual void begin_fragment(const std::string& path) = 0;
+  virtual void end_fragment() = 0;
+
+  // field is the field index for per-field sections, or -1.
+  virtual void begin_record(const char* section, int64_t field = -1) = 0;
+  virtual void end_record() = 0;
+
+  virtual void begin_object(const char* key) = 0;
+  virtual void end_object() = 0;
+  virtual void begin_array(const char* key) = 0;
+  virtual void end_array() = 0;
+
+  virtual void null(const char* key) = 0;
+  virtual void boolean(const char* key, bool val) = 0;
+  virtual void u64(const char* key, uint64_t val) = 0;
+  virtual void str(const char* key, const std::string& val) = 0;
+  virtual void bytes(const char* key, const uint8_t* data, size_t nbytes) = 0;
+  virtual void u64s(const char* key, const uint64_t* data, size_t count) = 0;
+
+  // Close whatever is open in the current fragment and emit an "error"
+  // record holding msg. Used when dissecting fails partway through.
+  void error(const std::string& msg);
+
+  void flush();
+
+ protected:
+  enum Container { RECORD, OBJECT, ARRAY };
+
+  void maybe_flush();
+
+  FILE* out_;
+  std::string buf_;
+  std::vector<Container> open_;
+};
+
+// Output formats accepted by make_emitter.
+const char* emitter_formats();
+
+// Returns nullptr for an unknown format name.
+std::unique_ptr<Emitter> make_emitter(const char* format, FILE* out);
@@ -0,0 +1,811 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "datatype.h"
+#include "decompressor.h"
+#include "deserializer.h"
+#include "filter_pipeline.h"
+
+namespace {
+
+[[noreturn]] void
+filter_error(const char* msg, FilterType type) {
+  throw std::runtime_error(std::string("Error in ") + filter_type_name(type) + " filter: " + msg);
+}
+
+// Forward whatever metadata remains after a stage has read its own.
+void
+forward_metadata(Deserializer& dser, FilterData& output) {
+  output.metadata_size_ = dser.remaining_bytes();
+  output.metadata_ = dser.get_ptr<uint8_t>(output.metadata_size_);
+}
+
+template <class T>
+T
+load(const uint8_t* ptr) {
+  T ret;
+  memcpy(&ret, ptr, sizeof(T));
+  return ret;
+}
+
+template <class T>
+void
+store(uint8_t* ptr, T value) {
+  memcpy(ptr, &value, sizeof(T));
+}
+
+/* ********************************* */
+/*            Compressors            */
+/* ********************************* */
+
+void
+rle_decompress(
+    uint64_t value_size, const uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) {
+  // Each run is a value followed by a big endian 16 bit run length.
+  uint64_t run_size = value_size + 2;
+  if (src_nbytes % run_size != 0) {
+    filter_error("Invalid RLE input size.", FilterType::RLE);
+  }
+
+  uint8_t* curr = dst;
+  uint8_t* end = dst + dst_nbytes;
+  for (size_t i = 0; i < src_nbytes; i += run_size) {
+    const uint8_t* value = src + i;
+    uint64_t run_len = (uint64_t(value[value_size]) << 8) | value[value_size + 1];
+    if (uint64_t(end - curr) < run_len * value_size) {
+      filter_error("RLE output overflow.", FilterType::RLE);
+    }
+
+    if (value_size == 1) {
+      memset(curr, value[0], run_len);
+      curr += run_len;
+    } else {
+      for (uint64_t j = 0; j < run_len; j++) {
+        memcpy(curr, value, value_size);
+        curr += value_size;
+      }
+    }
+  }
+
+  if (curr != end) {
+    filter_error("RLE output size mismatch.", FilterType::RLE);
+  }
+}
+
+// Reads the MSB-first bit stream of 64 bit words written by TileDB's
+// double delta compressor.
+struct BitReader {
+  BitReader(const uint8_t* src, size_t nbytes)
+      : src_(src)
+      , nbytes_(nbytes)
+      , chunk_(0)
+      , bit_(-1) {
+  }
+
+  uint64_t read_bit() {
+    if (bit_ < 0) {
+      if (nbytes_ < sizeof(uint64_t)) {
+        filter_error("Truncated bit stream.", FilterType::DOUBLE_DELTA);
+      }
+      chunk_ = load<uint64_t>(src_);
+      src_ += sizeof(uint64_t);
+      nbytes_ -= sizeof(uint64_t);
+      bit_ = 63;
+    }
+
+    return (chunk_ >> bit_--) & 1;
+  }
+
+  const uint8_t* src_;
+  size_t nbytes_;
+  uint64_t chunk_;
+  int bit_;
+};
+
+template <class T>
+void
+double_delta_decompress(const uint8_t* src, size_t src_nbytes, uint8_t* dst, size_t dst_nbytes) {
+  Deserializer dser(src, src_nbytes);
+  auto bitsize = dser.read<uint8_t>();
+  auto num = dser.read<uint64_t>();
+
+  if (num * sizeof(T) != dst_nbytes) {
+    filter_error("Output size mismatch.", FilterType::DOUBLE_DELTA);
+  }
+
+  // Values that would not compress were stored verbatim.
+  if (bitsize >= sizeof(T) * 8 - 1) {
+    dser.read(dst, dst_nbytes);
+    return;
+  }
+
+  if (num == 0) {
+    return;
+  }
+
+  T prev = dser.read<T>();
+  store<T>(dst, prev);
+  if (num == 1) {
+    return;
+  }
+
+  T curr = dser.read<T>();
+  store<T>(dst + sizeof(T), curr);
+
+  int64_t prev_delta = int64_t(curr) - int64_t(prev);
+  prev = curr;
+
+  auto remaining = dser.remaining_bytes();
+  BitReader bits(dser.get_ptr<uint8_t>(remaining), remaining);
+  for (uint64_t i = 2; i < num; i++) {
+    uint64_t sign = bits.read_bit();
+    int64_t dd = 0;
+    for (unsigned int b = 0; b < bitsize; b++) {
+      dd = (dd << 1) | int64_t(bits.read_bit());
+    }
+
+    if (sign) {
+      dd = -dd;
+    }
+
+    int64_t delta = prev_delta + dd;
+    curr = T(int64_t(prev) + delta);
+    store<T>(dst + i * sizeof(T), curr);
+
+    prev = curr;
+    prev_delta = delta;
+  }
+}
+
+/* ********************************* */
+/*              Filters              */
+/* ********************************* */
+
+struct CompressionFilter : public Filter {
+  CompressionFilter(FilterType type, Deserializer& opts)
+      : Filter(type)
+      , compressor_(static_cast<Compressor>(opts.read<uint8_t>()))
+      , level_(opts.read<int32_t>())
+      , reinterpret_type_(DATATYPE_ANY) {
+    // Newer format versions append the datatype that delta style
+    // compressors reinterpret their input as.
+    if (opts.remaining_bytes() >= sizeof(uint8_t)) {
+      reinterpret_type_ = opts.read<uint8_t>();
+    }
+  }
+
+  void dump(FILE* out) const override {
+    fprintf(out, "        %s: compressor %u, level %d\n",
+        filter_type_name(type_), (unsigned)compressor_, level_);
+  }
+
+  void unfilter(
+      const FilterTileInfo& tile,
+      const FilterData& input,
+      FilterBuffers& buffers,
+      FilterData& output) const override {
+    Deserializer dser(input.metadata_, input.metadata_size_);
+    auto num_metadata_parts = dser.read<uint32_t>();
+    auto num_data_parts = dser.read<uint32_t>();
+
+    // Each part is described by its uncompressed and compressed sizes.
+    // Metadata parts (compressed metadata of earlier stages) come first.
+    Deserializer sizes = dser;
+    uint64_t metadata_nbytes = 0;
+    for (uint32_t i = 0; i < num_metadata_parts; i++) {
+      metadata_nbytes += sizes.read<uint32_t>();
+      sizes.read<uint32_t>();
+    }
+
+    uint64_t data_nbytes = 0;
+    for (uint32_t i = 0; i < num_data_parts; i++) {
+      data_nbytes += sizes.read<uint32_t>();
+      sizes.read<uint32_t>();
+    }
+
+    uint8_t* metadata = buffers.alloc_metadata(metadata_nbytes);
+    uint8_t* data = buffers.alloc_data(data_nbytes);
+
+    uint8_t datatype = reinterpret_type_ == DATATYPE_ANY ? tile.datatype_ : reinterpret_type_;
+
+    const uint8_t* src = input.data_;
+    size_t src_bytes = input.data_size_;
+    auto decompress_parts = [&](uint32_t num_parts, uint8_t* dst) {
+      for (uint32_t i = 0; i < num_parts; i++) {
+        auto uncompressed_size = dser.read<uint32_t>();
+        auto compressed_size = dser.read<uint32_t>();
+        if (compressed_size > src_bytes) {
+          filter_error("Not enough input buffer.", type_);
+        }
+
+        decompress_part(datatype, src, compressed_size, dst, uncompressed_size);
+
+        src += compressed_size;
+        src_bytes -= compressed_size;
+        dst += uncompressed_size;
+      }
+    };
+
+    decompress_parts(num_metadata_parts, metadata);
+    decompress_parts(num_data_parts, data);
+
+    output.metadata_ = metadata;
+    output.metadata_size_ = metadata_nbytes;
+    output.data_ = data;
+    output.data_size_ = data_nbytes;
+  }
+
+  void decompress_part(
+      uint8_t datatype,
+      const uint8_t* src,
+      size_t src_nbytes,
+      uint8_t* dst,
+      size_t dst_nbytes) const {
+    switch (compressor_) {
+      case Compressor::NONE:
+        if (src_nbytes != dst_nbytes) {
+          filter_error("Uncompressed part size mismatch.", type_);
+        }
+        memcpy(dst, src, dst_nbytes);
+        return;
+
+      case Compressor::GZIP:
+        current_decompressor().decompress_part(src, src_nbytes, dst, dst_nbytes);
+        return;
+
+#ifdef HAVE_ZSTD
+      case Compressor::ZSTD: {
+        static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(
+            ZSTD_createDCtx(), ZSTD_freeDCtx);
+        auto rc = ZSTD_decompressDCtx(ctx.get(), dst, dst_nbytes, src, src_nbytes);
+        if (ZSTD_isError(rc) || rc != dst_nbytes) {
+          filter_error("Failed to decompress buffer.", type_);
+        }
+        return;
+      }
+#endif
+
+#ifdef HAVE_LZ4
+      case Compressor::LZ4: {
+        auto rc = LZ4_decompress_safe(
+            reinterpret_cast<const char*>(src),
+            reinterpret_cast<char*>(dst),
+            src_nbytes,
+            dst_nbytes);
+        if (rc < 0 || size_t(rc) != dst_nbytes) {
+          filter_error("Failed to decompress buffer.", type_);
+        }
+        return;
+      }
+#endif
+
+#ifdef HAVE_BZIP2
+      case Compressor::BZIP2: {
+        unsigned int out_nbytes = dst_nbytes;
+        auto rc = BZ2_bzBuffToBuffDecompress(
+            reinterpret_cast<char*>(dst),
+            &out_nbytes,
+            const_cast<char*>(reinterpret_cast<const char*>(src)),
+            src_nbytes,
+            0,
+            0);
+        if (rc != BZ_OK || out_nbytes != dst_nbytes) {
+          filter_error("Failed to decompress buffer.", type_);
+        }
+        return;
+      }
+#endif
+
+      case Compressor::RLE:
+        rle_decompress(datatype_size(datatype), src, src_nbytes, dst, dst_nbytes);
+        return;
+
+      case Compressor::DOUBLE_DELTA: {
+        auto ok = with_integer_type(datatype, [&](auto tag) {
+          double_delta_decompress<decltype(tag)>(src, src_nbytes, dst, dst_nbytes);
+        });
+        // Unlike the other typed filters, double delta also accepts CHAR.
+        if (!ok && datatype == DATATYPE_CHAR) {
+          double_delta_decompress<int8_t>(src, src_nbytes, dst, dst_nbytes);
+          ok = true;
+        }
+        if (!ok) {
+          filter_error("Unsupported datatype for double delta.", type_);
+        }
+        return;
+      }
+
+      default:
+        filter_error("Compressor not supported by this build.", type_);
+    }
+  }
+
+  Compressor compressor_;
+  int32_t level_;
+  uint8_t reinterpret_type_;
+};
+
+struct ChecksumFilter : public Filter {
+  ChecksumFilter(FilterType type)
+      : Filter(type)
+      , hash_size_(type == FilterType::CHECKSUM_MD5 ? 16 : 32) {
+  }
+
+  void unfilter(
+      const FilterTileInfo&,
+      const FilterData& input,
+      FilterBuffers&,
+      FilterData& output) const override {
+    Deserializer dser(input.metadata_, input.metadata_size_);
+    auto num_metadata_checksums = dser.read<uint32_t>();
+    auto num_data_checksums = dser.read<uint32_t>();
+
+    struct Checksum {
+      uint64_t size_;
+      const uint8_t* hash_;
+    };
+
+    std::vector<Checksum> metadata_sums(num_metadata_checksums);
+    for (auto& sum : metadata_sums) {
+      sum.size_ = dser.read<uint64_t>();
+      sum.hash_ = dser.get_ptr<uint8_t>(hash_size_);
+    }
+
+    std::vector<Checksum> data_sums(num_data_checksums);
+    for (auto& sum : data_sums) {
+      sum.size_ = dser.read<uint64_t>();
+      sum.hash_ = dser.get_ptr<uint8_t>(hash_size_);
+    }
+
+    forward_metadata(dser, output);
+    output.data_ = input.data_;
+    output.data_size_ = input.data_size_;
+
+    verify(metadata_sums, output.metadata_, output.metadata_size_);
+    verify(data_sums, output.data_, output.data_size_);
+  }
+
+  template <class Checksums>
+  void verify(const Checksums& sums, const uint8_t* buf, size_t nbytes) const {
+#ifdef HAVE_OPENSSL
+    auto md = type_ == FilterType::CHECKSUM_MD5 ? EVP_md5() : EVP_sha256();
+    for (auto& sum : sums) {
+      if (sum.size_ > nbytes) {
+        filter_error("Checksummed part is larger than its buffer.", type_);
+      }
+
+      uint8_t digest[EVP_MAX_MD_SIZE];
+      unsigned int digest_size = 0;
+      if (EVP_Digest(buf, sum.size_, digest, &digest_size, md, nullptr) != 1
+          || digest_size != hash_size_
+          || memcmp(digest, sum.hash_, hash_size_) != 0) {
+        filter_error("Checksum mismatch.", type_);
+      }
+
+      buf += sum.size_;
+      nbytes -= sum.size_;
+    }
+#else
+    // Passing a checksum that was never compared would report a tile as
+    // good that may not be.
+    (void)buf;
+    (void)nbytes;
+    if (!sums.empty()) {
+      filter_error("Checksum verification not built in.", type_);
+    }
+#endif
+  }
+
+  uint32_t hash_size_;
+};
+
+struct ByteshuffleFilter : public Filter {
+  ByteshuffleFilter()
+      : Filter(FilterType::BYTESHUFFLE) {
+  }
+
+  void unfilter(
+      const FilterTileInfo& tile,
+      const FilterData& input,
+      FilterBuffers& buffers,
+      FilterData& output) const override {
+    Deserializer dser(input.metadata_, input.metadata_size_);
+    auto num_parts = dser.read<uint32_t>();
+    std::vector<uint32_t> part_sizes(num_parts);
+    for (auto& size : part_sizes) {
+      size = dser.read<uint32_t>();
+    }
+
+    forward_metadata(dser, output);
+
+    // Shuffling single byte values is the identity.
+    auto type_size = datatype_size(tile.datatype_);
+    if (type_size == 1) {
+      output.data_ = input.data_;
+      output.data_size_ = input.data_size_;
+      return;
+    }
+
+    uint8_t* data = buffers.alloc_data(input.data_size_);
+    const uint8_t* src = input.data_;
+    uint8_t* dst = data;
+    size_t src_bytes = input.data_size_;
+    for (auto size : part_sizes) {
+      if (size > src_bytes) {
+        filter_error("Not enough input buffer.", type_);
+      }
+
+      // Byte b of every value was stored contiguously. Trailing bytes
+      // that don't form a whole value are stored as is.
+      size_t nvalues = size / type_size;
+      for (size_t i = 0; i < nvalues; i++) {
+        for (size_t b = 0; b < type_size; b++) {
+          dst[i * type_size + b] = src[b * nvalues + i];
+        }
+      }
+      size_t tail = nvalues * type_size;
+      memcpy(dst + tail, src + tail, size - tail);
+
+      src += size;
+      dst += size;
+      src_bytes -= size;
+    }
+
+    output.data_ = data;
+    output.data_size_ = dst - data;
+  }
+};
+
+struct BitWidthReductionFilter : public Filter {
+  BitWidthReductionFilter(Deserializer& opts)
+      : Filter(FilterType::BIT_WIDTH_REDUCTION)
+      , max_window_size_(opts.read<uint32_t>()) {
+  }
+
+  void dump(FILE* out) const override {
+    fprintf(out, "        %s: max window size %u\n", filter_type_name(type_), max_window_size_);
+  }
+
+  void unfilter(
+      const FilterTileInfo& tile,
+      const FilterData& input,
+      FilterBuffers& buffers,
+      FilterData& output) const override {
+    // TileDB passes non-integer and single byte values through untouched.
+    bool applied = datatype_size(tile.datatype_) > 1
+        && with_integer_type(tile.datatype_, [&](auto tag) {
+          unfilter_typed<decltype(tag)>(input, buffers, output);
+        });
+
+    if (!applied) {
+      output = input;
+    }
+  }
+
+  template <class T>
+  void unfilter_typed(const FilterData& input, FilterBuffers& buffers, FilterData& output) const {
+    Deserializer dser(input.metadata_, input.metadata_size_);
+    auto orig_length = dser.read<uint32_t>();
+    auto num_windows = dser.read<uint32_t>();
+
+    uint8_t* data = buffers.alloc_data(orig_length);
+    uint8_t* dst = data;
+    uint8_t* end = data + orig_length;
+    const uint8_t* src = input.data_;
+    const uint8_t* src_end = input.data_ + input.data_size_;
+
+    for (uint32_t i = 0; i < num_windows; i++) {
+      auto offset = dser.read<T>();
+      auto bit_width = dser.read<uint8_t>();
+      auto window_nbytes = dser.read<uint32_t>();
+
+      if (window_nbytes > uint64_t(src_end - src)) {
+        filter_error("Not enough input buffer.", type_);
+      }
+
+      // Windows that didn't shrink were stored at full width.
+      if (bit_width == sizeof(T) * 8) {
+        if (window_nbytes > uint64_t(end - dst)) {
+          filter_error("Output overflow.", type_);
+        }
+        memcpy(dst, src, window_nbytes);
+        dst += window_nbytes;
+        src += window_nbytes;
+        continue;
+      }
+
+      uint32_t width = bit_width / 8;
+      if (width == 0 || width > sizeof(T) || window_nbytes % width != 0) {
+        filter_error("Invalid window bit width.", type_);
+      }
+
+      uint32_t nvalues = window_nbytes / width;
+      if (uint64_t(nvalues) * sizeof(T) > uint64_t(end - dst)) {
+        filter_error("Output overflow.", type_);
+      }
+
+      for (uint32_t j = 0; j < nvalues; j++) {
+        uint64_t value = 0;
+        memcpy(&value, src, width);
+        store<T>(dst, T(value + offset));
+        src += width;
+        dst += sizeof(T);
+      }
+    }
+
+    // Any bytes that didn't form a whole value follow the windows.
+    size_t tail = std::min<size_t>(end - dst, src_end - src);
+    memcpy(dst, src, tail);
+    dst += tail;
+
+    if (dst != end) {
+      filter_error("Output size mismatch.", type_);
+    }
+
+    forward_metadata(dser, output);
+    output.data_ = data;
+    output.data_size_ = orig_length;
+  }
+
+  uint32_t max_window_size_;
+};
+
+struct PositiveDeltaFilter : public Filter {
+  PositiveDeltaFilter(Deserializer& opts)
+      : Filter(FilterType::POSITIVE_DELTA)
+      , max_window_size_(opts.read<uint32_t>()) {
+  }
+
+  void dump(FILE* out) const override {
+    fprintf(out, "        %s: max window size %u\n", filter_type_name(type_), max_window_size_);
+  }
+
+  void unfilter(
+      const FilterTileInfo& tile,
+      const FilterData& input,
+      FilterBuffers& buffers,
+      FilterData& output) const override {
+    bool applied = with_integer_type(tile.datatype_, [&](auto tag) {
+      unfilter_typed<decltype(tag)>(input, buffers, output);
+    });
+
+    if (!applied) {
+      output = input;
+    }
+  }
+
+  template <class T>
+  void unfilter_typed(const FilterData& input, FilterBuffers& buffers, FilterData& output) const {
+    Deserializer dser(input.metadata_, input.metadata_size_);
+    auto num_windows = dser.read<uint32_t>();
+
+    uint8_t* data = buffers.alloc_data(input.data_size_);
+    const uint8_t* src = input.data_;
+    uint8_t* dst = data;
+    size_t remaining = input.data_size_;
+
+    for (uint32_t i = 0; i < num_windows; i++) {
+      T prev = dser.read<T>();
+      auto window_nbytes = dser.read<uint32_t>();
+      if (window_nbytes > remaining) {
+        filter_error("Not enough input buffer.", type_);
+      }
+
+      uint32_t nvalues = window_nbytes / sizeof(T);
+      for (uint32_t j = 0; j < nvalues; j++) {
+        using U = std::make_unsigned_t<T>;
+        prev = T(U(prev) + U(load<T>(src + j * sizeof(T))));
+        store<T>(dst + j * sizeof(T), prev);
+      }
+
+      src += window_nbytes;
+      dst += window_nbytes;
+      remaining -= window_nbytes;
+    }
+
+    memcpy(dst, src, remaining);
+
+    forward_metadata(dser, output);
+    output.data_ = data;
+    output.data_size_ = input.data_size_;
+  }
+
+  uint32_t max_window_size_;
+};
+
+// Filters this dissector can show but not reverse. The pipeline still
+// parses so headers can be dumped; unfiltering a tile that uses one fails.
+struct UnsupportedFilter : public Filter {
+  UnsupportedFilter(FilterType type)
+      : Filter(type) {
+  }
+
+  void unfilter(
+      const FilterTileInfo&,
+      const FilterData&,
+      FilterBuffers&,
+      FilterData&) const override {
+    filter_error("Filter is not supported.", type_);
+  }
+};
+
+std::shared_ptr<Filter>
+make_filter(FilterType type, Deserializer& opts) {
+  switch (type) {
+    case FilterType::GZIP:
+    case FilterType::ZSTD:
+    case FilterType::LZ4:
+    case FilterType::RLE:
+    case FilterType::BZIP2:
+    case FilterType::DOUBLE_DELTA:
+    case FilterType::DICTIONARY:
+    case FilterType::DELTA:
+      return std::make_shared<CompressionFilter>(type, opts);
+    case FilterType::CHECKSUM_MD5:
+    case FilterType::CHECKSUM_SHA256:
+      return std::make_shared<ChecksumFilter>(type);
+    case FilterType::BYTESHUFFLE:
+      return std::make_shared<ByteshuffleFilter>();
+    case FilterType::BIT_WIDTH_REDUCTION:
+      return std::make_shared<BitWidthReductionFilter>(opts);
+    case FilterType::POSITIVE_DELTA:
+      return std::make_shared<PositiveDeltaFilter>(opts);
+    default:
+      return std::make_shared<UnsupportedFilter>(type);
+  }
+}
+
+// Per thread, per stage output buffers reused across chunks and tiles.
+thread_local std::vector<FilterBuffers> stage_buffers;
+
+}  // namespace
+
+uint8_t*
+FilterBuffers::alloc_metadata(size_t nbytes) {
+  metadata_.resize(nbytes);
+  return metadata_.data();
+}
+
+uint8_t*
+FilterBuffers::alloc_data(size_t nbytes) {
+  if (dst_ != nullptr && nbytes == dst_size_) {
+    return dst_;
+  }
+
+  data_.resize(nbytes);
+  return data_.data();
+}
+
+void
+Filter::dump(FILE* out) const {
+  fprintf(out, "        %s\n", filter_type_name(type_));
+}
+
+FilterPipeline::FilterPipeline(const uint8_t* buf, size_t nbytes) {
+  Deserializer dser(buf, nbytes);
+  max_chunk_size_ = dser.read<uint32_t>();
+  auto num_filters = dser.read<uint32_t>();
+
+  for (uint32_t i = 0; i < num_filters; i++) {
+    auto type = static_cast<FilterType>(dser.read<uint8_t>());
+    auto opts_size = dser.read<uint32_t>();
+
+    // Options are parsed from their own slice so unknown trailing fields
+    // from newer format versions are skipped rather than misread.
+    Deserializer opts(dser.get_ptr<uint8_t>(opts_size), opts_size);
+    filters_.push_back(make_filter(type, opts));
+  }
+}
+
+const FilterPipeline&
+FilterPipeline::gzip() {
+  static const FilterPipeline pipeline = []() {
+    // max_chunk_size 64KiB, a single gzip compression filter at level -1.
+    const uint8_t serialized[] = {
+      0x00, 0x00, 0x01, 0x00,
+      0x01, 0x00, 0x00, 0x00,
+      0x01, 0x05, 0x00, 0x00, 0x00,
+      0x01, 0xff, 0xff, 0xff, 0xff,
+    };
+    return FilterPipeline(serialized, sizeof(serialized));
+  }();
+
+  return pipeline;
+}
+
+void
+FilterPipeline::unfilter_chunk(
+    const FilterTileInfo& tile,
+    const DiskLayout& chunk,
+    uint8_t* dst,
+    size_t nbytes) const {
+  if (stage_buffers.size() < filters_.size()) {
+    stage_buffers.resize(filters_.size());
+  }
+
+  FilterData data;
+  data.metadata_ = chunk.filtered_metadata_;
+  data.metadata_size_ = chunk.filtered_metadata_size_;
+  data.data_ = chunk.filtered_data_;
+  data.data_size_ = chunk.filtered_data_size_;
+
+  for (size_t i = filters_.size(); i-- > 0;) {
+    auto& buffers = stage_buffers[i];
+    buffers.dst_ = (i == 0) ? dst : nullptr;
+    buffers.dst_size_ = (i == 0) ? nbytes : 0;
+
+    FilterData output;
+    filters_[i]->unfilter(tile, data, buffers, output);
+    data = output;
+
+    buffers.dst_ = nullptr;
+    buffers.dst_size_ = 0;
+  }
+
+  if (data.data_size_ != nbytes) {
+    throw std::runtime_error(
+        "Error unfiltering chunk: expected " + std::to_string(nbytes) + " bytes, got "
+        + std::to_string(data.data_size_) + ".");
+  }
+
+  if (nbytes != 0 && data.data_ != dst) {
+    memcpy(dst, data.data_, nbytes);
+  }
+}
+
+void
+FilterPipeline::dump(FILE* out) const {
+  fprintf(out, "    Filter Pipeline: max chunk size %u, %zu filters\n", max_chunk_size_, filters_.size());
+  for (auto& filter : filters_) {
+    filter->dump(out);
+  }
+}
+
+const char*
+filter_type_name(FilterType type) {
+  switch (type) {
+    case FilterType::NONE: return "NONE";
+    case FilterType::GZIP: return "GZIP";
+    case FilterType::ZSTD: return "ZSTD";
+    case FilterType::LZ4: return "LZ4";
+    case FilterType::RLE: return "RLE";
+    case FilterType::BZIP2: return "BZIP2";
+    case FilterType::DOUBLE_DELTA: return "DOUBLE_DELTA";
+    case FilterType::BIT_WIDTH_REDUCTION: return "BIT_WIDTH_REDUCTION";
+    case FilterType::BITSHUFFLE: return "BITSHUFFLE";
+    case FilterType::BYTESHUFFLE: return "BYTESHUFFLE";
+    case FilterType::POSITIVE_DELTA: return "POSITIVE_DELTA";
+    case FilterType::ENCRYPTION_AES256GCM: return "ENCRYPTION_AES256GCM";
+    case FilterType::CHECKSUM_MD5: return "CHECKSUM_MD5";
+    case FilterType::CHECKSUM_SHA256: return "CHECKSUM_SHA256";
+    case FilterType::DICTIONARY: return "DICTIONARY";
+    case FilterType::SCALE_FLOAT: return "SCALE_FLOAT";
+    case FilterType::XOR: return "XOR";
+    case FilterType::DEPRECATED: return "DEPRECATED";
+    case FilterType::WEBP: return "WEBP";
+    case FilterType::DELTA: return "DELTA";
+  }
+
+  return "UNKNOWN";
+}
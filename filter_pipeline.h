@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "tile.h"
+
+// Filter identifiers as serialized by TileDB.
+enum class FilterType : uint8_t {
+  NONE = 0,
+  GZIP = 1,
+  ZSTD = 2,
+  LZ4 = 3,
+  RLE = 4,
+  BZIP2 = 5,
+  DOUBLE_DELTA = 6,
+  BIT_WIDTH_REDUCTION = 7,
+  BITSHUFFLE = 8,
+  BYTESHUFFLE = 9,
+  POSITIVE_DELTA = 10,
+  ENCRYPTION_AES256GCM = 11,
+  CHECKSUM_MD5 = 12,
+  CHECKSUM_SHA256 = 13,
+  DICTIONARY = 14,
+  SCALE_FLOAT = 15,
+  XOR = 16,
+  DEPRECATED = 17,
+  WEBP = 18,
+  DELTA = 19,
+};
+
+// Compressor identifiers stored in a compression filter's options.
+enum class Compressor : uint8_t {
+  NONE = 0,
+  GZIP = 1,
+  ZSTD = 2,
+  LZ4 = 3,
+  RLE = 4,
+  BZIP2 = 5,
+  DOUBLE_DELTA = 6,
+  DICTIONARY = 7,
+  DELTA = 8,
+};
+
+// The properties of the tile being unfiltered that typed filters need.
+struct FilterTileInfo {
+  uint8_t datatype_;
+  uint64_t cell_size_;
+};
+
+// A view of the metadata and data handed from one filter stage to the
+// next. Views point into the chunk, into a stage's FilterBuffers or into
+// the destination tile.
+struct FilterData {
+  const uint8_t* metadata_;
+  size_t metadata_size_;
+  const uint8_t* data_;
+  size_t data_size_;
+};
+
+// Output storage for one stage of the pipeline. Buffers are kept per
+// thread and reused across chunks and tiles. For the last stage, a data
+// allocation that exactly matches the destination is served from the
+// destination itself so the common single-compressor case never copies.
+struct FilterBuffers {
+  FilterBuffers()
+      : dst_(nullptr)
+      , dst_size_(0) {
+  }
+
+  uint8_t* alloc_metadata(size_t nbytes);
+  uint8_t* alloc_data(size_t nbytes);
+
+  std::vector<uint8_t> metadata_;
+  std::vector<uint8_t> data_;
+  uint8_t* dst_;
+  size_t dst_size_;
+};
+
+// One stage of a filter pipeline. Stages only implement the reverse
+// direction: each reads its own metadata off the front of input.metadata_
+// and produces the input the previous stage wrote.
+struct Filter {
+  Filter(FilterType type)
+      : type_(type) {
+  }
+
+  virtual ~Filter() {}
+
+  virtual void unfilter(
+      const FilterTileInfo& tile,
+      const FilterData& input,
+      FilterBuffers& buffers,
+      FilterData& output) const = 0;
+
+  virtual void dump(FILE* out) const;
+
+  FilterType type_;
+};
+
+struct FilterPipeline {
+  FilterPipeline()
+      : max_chunk_size_(0) {
+  }
+
+  // Deserialize the pipeline stored in a generic tile header.
+  FilterPipeline(const uint8_t* buf, size_t nbytes);
+
+  // The single gzip stage that generic tiles have historically used.
+  static const FilterPipeline& gzip();
+
+  // Run every stage in reverse over one chunk, leaving exactly nbytes of
+  // unfiltered data in dst.
+  void unfilter_chunk(
+      const FilterTileInfo& tile,
+      const DiskLayout& chunk,
+      uint8_t* dst,
+      size_t nbytes) const;
+
+  void dump(FILE* out = stderr) const;
+
+  uint32_t max_chunk_size_;
+  std::vector<std::shared_ptr<Filter>> filters_;
+};
+
+const char* filter_type_name(FilterType type);
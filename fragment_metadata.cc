@@ -0,0 +1,1025 @@
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "datatype.h"
+#include "deserializer.h"
+#include "emitter.h"
+#include "fragment_metadata.h"
+#include "instrument.h"
+#include "metadata_cache.h"
+#include "rtree.h"
+#include "thread_pool.h"
+
+void
+GenericTileOffsets::resize(size_t nfields) {
+  tile_offsets_.resize(nfields);
+  tile_var_offsets_.resize(nfields);
+  tile_var_sizes_.resize(nfields);
+  tile_validity_offsets_.resize(nfields);
+  tile_min_offsets_.resize(nfields);
+  tile_max_offsets_.resize(nfields);
+  tile_sum_offsets_.resize(nfields);
+  tile_null_count_offsets_.resize(nfields);
+}
+
+// Bytes between the non-empty domain and the per field sizes: the sparse
+// tile num, last tile cell num, has timestamps and has delete meta.
+#define FOOTER_COUNTS_SIZE (2 * sizeof(uint64_t) + 2 * sizeof(uint8_t))
+
+// Bytes of footer following FOOTER_COUNTS_SIZE for a fragment with nfields
+// fields: three file sizes and eight generic tile offsets per field, and
+// the rtree, fragment stats and processed conditions offsets.
+static uint64_t
+footer_fields_size(size_t nfields) {
+  return (3 * nfields + 8 * nfields + 3) * sizeof(uint64_t);
+}
+
+Footer::Footer(Reader& reader, SchemaResolver& resolver)
+{
+  PhaseTimer timer(PHASE_FOOTER);
+  fragment_metadata_file_size_ = reader.file_size_;
+  if (reader.file_size_ < sizeof(uint64_t)) {
+    throw std::logic_error("File is too small to hold a footer.");
+  }
+
+  // Guess that the footer fits in the last few KiB and read them in one
+  // go, keeping any sections that come along with it.
+  reader.read_tail(tail_read_size());
+
+  std::pmr::vector<uint8_t> scratch(scratch_resource());
+  auto size_buf = reader.view(sizeof(uint64_t), reader.file_size_ - 8, scratch);
+  footer_size_ = Deserializer(size_buf, sizeof(uint64_t)).read<uint64_t>();
+  if (footer_size_ > reader.file_size_ - sizeof(uint64_t)) {
+    throw std::logic_error(
+        "Footer size " + std::to_string(footer_size_) + " is larger than the file ("
+        + std::to_string(reader.file_size_) + " bytes).");
+  }
+  footer_offset_ = reader.file_size_ - footer_size_ - 8;
+
+  auto footer_blob = reader.view(footer_size_, footer_offset_, scratch);
+  footer_hash_ = hash_bytes(footer_blob, footer_size_);
+
+  Deserializer dser(footer_blob, footer_size_);
+  version_ = dser.read<uint32_t>();
+
+  uint64_t schema_name_size = dser.read<uint64_t>();
+  array_schema_.resize(schema_name_size);
+  dser.read(&array_schema_[0], schema_name_size);
+
+  fragment_type_ = dser.read<uint8_t>();
+
+  schema_ = resolver.resolve(reader.filename_, array_schema_);
+  if (schema_) {
+    nfields_source_ = "schema";
+  } else if (resolver.nfields_ > 0) {
+    nfields_ = resolver.nfields_;
+    nfields_source_ = "--nfields";
+  } else {
+    nfields_ = DEFAULT_NUM_FIELDS;
+    nfields_source_ = "assumed";
+  }
+
+  null_non_empty_domain_ = dser.read<uint8_t>();
+  if (null_non_empty_domain_ == 0) {
+    uint64_t ned_size = 0;
+    if (schema_) {
+      // Fixed size dimensions store [start, end]. Var sized dimensions
+      // store the range size and start size followed by the range.
+      Deserializer ned_dser = dser;
+      for (auto& dim : schema_->dims_) {
+        if (dim.var_sized()) {
+          auto range_size = ned_dser.read<uint64_t>();
+          ned_dser.read<uint64_t>();
+          ned_dser.get_ptr<uint8_t>(range_size);
+        } else {
+          ned_dser.get_ptr<uint8_t>(2 * dim.cell_size());
+        }
+      }
+      ned_size = dser.remaining_bytes() - ned_dser.remaining_bytes();
+    } else {
+      uint64_t remaining = dser.remaining_bytes();
+      uint64_t tail_size = FOOTER_COUNTS_SIZE + footer_fields_size(nfields_);
+      if (remaining < tail_size) {
+        throw std::logic_error(
+            "Footer is too small for " + std::to_string(nfields_) + " fields.");
+      }
+      ned_size = remaining - tail_size;
+    }
+
+    non_empty_domain_.resize(ned_size);
+    dser.read(non_empty_domain_.data(), ned_size);
+  }
+
+  sparse_tile_num_ = dser.read<uint64_t>();
+  last_tile_cell_num_ = dser.read<uint64_t>();
+  has_timestamps_ = dser.read<uint8_t>();
+  has_delete_meta_ = dser.read<uint8_t>();
+
+  if (schema_) {
+    fields_ = schema_->fields(has_timestamps_, has_delete_meta_);
+    nfields_ = fields_.size();
+  }
+
+  if (dser.remaining_bytes() != footer_fields_size(nfields_)) {
+    throw std::logic_error(
+        "Footer size does not match a fragment with " + std::to_string(nfields_) + " fields.");
+  }
+
+  file_sizes_.resize(nfields_);
+  file_var_sizes_.resize(nfields_);
+  file_validity_sizes_.resize(nfields_);
+  gt_offsets_.resize(nfields_);
+
+  auto nbytes = nfields_ * sizeof(uint64_t);
+  dser.read(file_sizes_.data(), nbytes);
+  dser.read(file_var_sizes_.data(), nbytes);
+  dser.read(file_validity_sizes_.data(), nbytes);
+
+  gt_offsets_.rtree_ = dser.read<uint64_t>();
+  dser.read(gt_offsets_.tile_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_var_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_var_sizes_.data(), nbytes);
+  dser.read(gt_offsets_.tile_validity_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_min_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_max_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_sum_offsets_.data(), nbytes);
+  dser.read(gt_offsets_.tile_null_count_offsets_.data(), nbytes);
+  gt_offsets_.fragment_min_max_sum_null_count_offset_ = dser.read<uint64_t>();
+  gt_offsets_.processed_conditions_offsets_ = dser.read<uint64_t>();
+}
+
+void
+Footer::dump_non_empty_domain(FILE* out) {
+  if (null_non_empty_domain_ != 0) {
+    fprintf(out, "        (null)\n");
+    return;
+  }
+
+  if (!schema_) {
+    // Without a schema the dimension types are unknown. Print doubles
+    // when they fit, which is the common floating point coordinate case.
+    if (non_empty_domain_.size() % sizeof(double) == 0) {
+      for (size_t i = 0; i < non_empty_domain_.size(); i += sizeof(double)) {
+        double val;
+        memcpy(&val, &non_empty_domain_[i], sizeof(val));
+        fprintf(out, "        %f\n", val);
+      }
+    } else {
+      fprintf(out, "        %zu bytes\n", non_empty_domain_.size());
+    }
+    return;
+  }
+
+  Deserializer dser(non_empty_domain_.data(), non_empty_domain_.size());
+  for (auto& dim : schema_->dims_) {
+    if (dim.var_sized()) {
+      auto range_size = dser.read<uint64_t>();
+      auto start_size = dser.read<uint64_t>();
+      auto range = dser.get_ptr<char>(range_size);
+      fprintf(out, "        %s: [%.*s, %.*s]\n", dim.name_.c_str(),
+          (int)start_size, range, (int)(range_size - start_size), range + start_size);
+      continue;
+    }
+
+    auto range = dser.get_ptr<uint8_t>(2 * dim.cell_size());
+    fprintf(out, "        %s: [", dim.name_.c_str());
+    print_value(out, dim.datatype_, range);
+    fprintf(out, ", ");
+    print_value(out, dim.datatype_, range + dim.cell_size());
+    fprintf(out, "]\n");
+  }
+}
+
+void
+Footer::dump(FILE* out) {
+  fprintf(out, "File size: %llu\n", fragment_metadata_file_size_);
+  fprintf(out, "Footer:\n");
+  fprintf(out, "    Size: %llu\n", footer_size_);
+  fprintf(out, "    Offset: %llu\n", footer_offset_);
+  fprintf(out, "    Version: %u\n", version_);
+  fprintf(out, "    Schema: %s\n", array_schema_.c_str());
+  fprintf(out, "    Type: %u\n", fragment_type_);
+  fprintf(out, "    Non-Empty Domain:\n");
+  dump_non_empty_domain(out);
+  fprintf(out, "    Sparse Tile Num: %llu\n", sparse_tile_num_);
+  fprintf(out, "    Last Tile Cell Num: %llu\n", last_tile_cell_num_);
+  fprintf(out, "    Has Timestamps: %u\n", has_timestamps_);
+  fprintf(out, "    Has Delete Meta: %u\n", has_delete_meta_);
+  fprintf(out, "    Fields: %zu (%s)\n", nfields_, nfields_source_);
+  for (size_t i = 0; i < fields_.size(); i++) {
+    auto& field = fields_[i];
+    fprintf(out, "        %zu: %s, type %u, ", i, field.name_.c_str(), field.datatype_);
+    if (field.var_sized()) {
+      fprintf(out, "var");
+    } else {
+      fprintf(out, "%u values", field.cell_val_num_);
+    }
+    fprintf(out, "%s\n", field.nullable_ ? ", nullable" : "");
+  }
+  fprintf(out, "    File Sizes:\n");
+  for (size_t i = 0; i < file_sizes_.size(); i++) {
+    fprintf(out, "        %lu: %llu\n", i, file_sizes_[i]);
+  }
+  fprintf(out, "    File Var Sizes:\n");
+  for (size_t i = 0; i < file_var_sizes_.size(); i++) {
+    fprintf(out, "        %lu: %llu\n", i, file_var_sizes_[i]);
+  }
+  fprintf(out, "    File Validity Sizes:\n");
+  for (size_t i = 0; i < file_validity_sizes_.size(); i++) {
+    fprintf(out, "        %lu: %llu\n", i, file_validity_sizes_[i]);
+  }
+  fprintf(out, "    Genric Tile Offsets:\n");
+  fprintf(out, "        RTree: %llu\n", gt_offsets_.rtree_);
+  fprintf(out, "        Tile Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_offsets_[i]);
+  }
+  fprintf(out, "        Tile Var Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_var_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_var_offsets_[i]);
+  }
+  fprintf(out, "        Tile Var Sizes:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_var_sizes_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_var_sizes_[i]);
+  }
+  fprintf(out, "        Tile Validity Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_validity_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_validity_offsets_[i]);
+  }
+  fprintf(out, "        Tile Min Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_min_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_min_offsets_[i]);
+  }
+  fprintf(out, "        Tile Max Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_max_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_max_offsets_[i]);
+  }
+  fprintf(out, "        Tile Sum Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_sum_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_sum_offsets_[i]);
+  }
+  fprintf(out, "        Tile Null Count Offsets:\n");
+  for (size_t i = 0; i < gt_offsets_.tile_null_count_offsets_.size(); i++) {
+    fprintf(out, "            %lu: %llu\n", i, gt_offsets_.tile_null_count_offsets_[i]);
+  }
+  fprintf(out, "        Fragment Min/Max/Sum/Null Count Offset: %llu\n", gt_offsets_.fragment_min_max_sum_null_count_offset_);
+  fprintf(out, "        Processed Conditions Offsets: %llu\n", gt_offsets_.processed_conditions_offsets_);
+}
+
+FragmentMetadata::FragmentMetadata(Reader& reader, SchemaResolver& resolver, ThreadPool* pool, bool lazy, uint64_t tile_budget, const char* cache_dir)
+    : reader_(reader)
+    , pool_(pool)
+    , tile_budget_(tile_budget)
+    , footer_(reader, resolver)
+    , nfields_(footer_.nfields_)
+    , rtree_tile_(&arena_)
+    , tile_offsets_(nfields_, &arena_)
+    , tile_var_offsets_(nfields_, &arena_)
+    , tile_var_sizes_(nfields_, &arena_)
+    , tile_validity_offsets_(nfields_, &arena_)
+    , tile_min_(nfields_, &arena_)
+    , tile_max_(nfields_, &arena_)
+    , tile_sum_(nfields_, &arena_)
+    , tile_null_count_(nfields_, &arena_)
+    , fragment_stats_tile_(&arena_)
+    , fragment_min_(nfields_, &arena_)
+    , fragment_max_(nfields_, &arena_)
+    , fragment_sum_(nfields_, &arena_)
+    , fragment_null_count_(nfields_, &arena_)
+    , processed_conditions_tile_(&arena_)
+    , tile_offsets_loaded_(nfields_)
+    , tile_var_offsets_loaded_(nfields_)
+    , tile_var_sizes_loaded_(nfields_)
+    , tile_validity_offsets_loaded_(nfields_)
+    , tile_min_loaded_(nfields_)
+    , tile_max_loaded_(nfields_)
+    , tile_sum_loaded_(nfields_)
+    , tile_null_count_loaded_(nfields_) {
+  if (cache_dir != nullptr) {
+    cache_ = std::make_unique<MetadataCache>(cache_dir, reader, footer_);
+  }
+
+  if (!lazy) {
+    load_all();
+
+    // Only complete loads are cached so a hit never has to fall back to
+    // the fragment.
+    if (cache_ && !cache_->valid()) {
+      save_cache(cache_dir);
+    }
+  }
+}
+
+FragmentMetadata::~FragmentMetadata() {
+}
+
+// Every section goes through here, so a current cache entry replaces the
+// read and unfilter. The tile's bytes are still recorded as read so the
+// coverage report matches an uncached run.
+Tile
+FragmentMetadata::load_tile(Reader& reader, uint64_t offset) {
+  if (cache_) {
+    auto entry = cache_->find(offset);
+    if (entry != nullptr) {
+      reader.mark_read(entry->disk_size_, offset);
+      return cache_->load(*entry, &arena_);
+    }
+  }
+
+  return read_tile(reader, offset, pool_, &arena_, tile_budget_);
+}
+
+std::vector<std::pair<uint64_t, const Tile*>>
+FragmentMetadata::sections() const {
+  std::vector<std::pair<uint64_t, const Tile*>> tiles;
+  auto& gt = footer_.gt_offsets_;
+
+  tiles.emplace_back(gt.rtree_, &rtree_tile_);
+  for (size_t i = 0; i < nfields_; i++) {
+    tiles.emplace_back(gt.tile_offsets_[i], &tile_offsets_[i]);
+    tiles.emplace_back(gt.tile_var_offsets_[i], &tile_var_offsets_[i]);
+    tiles.emplace_back(gt.tile_var_sizes_[i], &tile_var_sizes_[i]);
+    tiles.emplace_back(gt.tile_validity_offsets_[i], &tile_validity_offsets_[i]);
+    tiles.emplace_back(gt.tile_min_offsets_[i], &tile_min_[i]);
+    tiles.emplace_back(gt.tile_max_offsets_[i], &tile_max_[i]);
+    tiles.emplace_back(gt.tile_sum_offsets_[i], &tile_sum_[i]);
+    tiles.emplace_back(gt.tile_null_count_offsets_[i], &tile_null_count_[i]);
+  }
+  tiles.emplace_back(gt.fragment_min_max_sum_null_count_offset_, &fragment_stats_tile_);
+  tiles.emplace_back(gt.processed_conditions_offsets_, &processed_conditions_tile_);
+  return tiles;
+}
+
+// A section's length isn't known until its header is read, so each is
+// taken to run up to the next section in the file, or to the footer for
+// the last one. Those extents are coalesced into the reads to prefetch,
+// and the decoders then slice their header, pipeline and chunks out of
+// memory. Sections larger than the tile budget are left to be read a chunk
+// at a time, and those already read with the footer's tail are skipped.
+std::vector<std::pair<uint64_t, uint64_t>>
+FragmentMetadata::plan_reads(const std::vector<uint64_t>& offsets) {
+  if (cache_ && cache_->valid()) {
+    return {};
+  }
+
+  std::vector<uint64_t> bounds;
+  for (auto& section : sections()) {
+    bounds.push_back(section.first);
+  }
+  bounds.push_back(footer_.footer_offset_);
+  std::sort(bounds.begin(), bounds.end());
+
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (auto offset : offsets) {
+    auto next = std::upper_bound(bounds.begin(), bounds.end(), offset);
+    if (next == bounds.end() || *next - offset > std::min<uint64_t>(tile_budget_, COALESCE_MAX_READ)) {
+      continue;
+    }
+    if (offset >= reader_.tail_offset()) {
+      continue;
+    }
+    ranges.emplace_back(offset, *next);
+  }
+
+  return coalesce_ranges(std::move(ranges));
+}
+
+void
+FragmentMetadata::save_cache(const char* cache_dir) {
+  MetadataCache::save(cache_dir, reader_, footer_, sections());
+}
+
+const Tile&
+FragmentMetadata::rtree() {
+  std::call_once(rtree_loaded_, [&]() {
+    PhaseTimer timer(PHASE_LOAD_RTREE);
+    rtree_tile_ = load_tile(reader_, footer_.gt_offsets_.rtree_);
+  });
+  return rtree_tile_;
+}
+
+// View a tile holding a uint64_t count followed by that many values.
+static Span<uint64_t>
+uint64s_view(const Tile& tile) {
+  return tile.values<uint64_t>(sizeof(uint64_t), tile.value<uint64_t>(0));
+}
+
+// View the fixed (var == false) or var sized part of a min or max tile.
+static Span<uint8_t>
+min_max_view(const Tile& tile, bool var) {
+  auto data_size = tile.value<uint64_t>(0);
+  auto var_data_size = tile.value<uint64_t>(sizeof(uint64_t));
+  auto data_offset = 2 * sizeof(uint64_t);
+  if (var) {
+    return tile.values<uint8_t>(data_offset + data_size, var_data_size);
+  }
+
+  return tile.values<uint8_t>(data_offset, data_size);
+}
+
+Span<uint64_t>
+FragmentMetadata::tile_offsets(size_t idx) {
+  std::call_once(tile_offsets_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_OFFSETS);
+    load_offsets(reader_, footer_.gt_offsets_.tile_offsets_[idx], tile_offsets_[idx]);
+  });
+  return uint64s_view(tile_offsets_[idx]);
+}
+
+Span<uint64_t>
+FragmentMetadata::tile_var_offsets(size_t idx) {
+  std::call_once(tile_var_offsets_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_VAR_OFFSETS);
+    load_offsets(reader_, footer_.gt_offsets_.tile_var_offsets_[idx], tile_var_offsets_[idx]);
+  });
+  return uint64s_view(tile_var_offsets_[idx]);
+}
+
+Span<uint64_t>
+FragmentMetadata::tile_var_sizes(size_t idx) {
+  std::call_once(tile_var_sizes_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_VAR_SIZES);
+    load_offsets(reader_, footer_.gt_offsets_.tile_var_sizes_[idx], tile_var_sizes_[idx]);
+  });
+  return uint64s_view(tile_var_sizes_[idx]);
+}
+
+Span<uint64_t>
+FragmentMetadata::tile_validity_offsets(size_t idx) {
+  std::call_once(tile_validity_offsets_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_VALIDITY_OFFSETS);
+    load_offsets(reader_, footer_.gt_offsets_.tile_validity_offsets_[idx], tile_validity_offsets_[idx]);
+  });
+  return uint64s_view(tile_validity_offsets_[idx]);
+}
+
+void
+FragmentMetadata::ensure_tile_min(size_t idx) {
+  std::call_once(tile_min_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_MIN);
+    load_values(reader_, footer_.gt_offsets_.tile_min_offsets_[idx], tile_min_[idx]);
+  });
+}
+
+Span<uint8_t>
+FragmentMetadata::tile_min(size_t idx) {
+  ensure_tile_min(idx);
+  return min_max_view(tile_min_[idx], false);
+}
+
+Span<uint8_t>
+FragmentMetadata::tile_min_var(size_t idx) {
+  ensure_tile_min(idx);
+  return min_max_view(tile_min_[idx], true);
+}
+
+void
+FragmentMetadata::ensure_tile_max(size_t idx) {
+  std::call_once(tile_max_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_MAX);
+    load_values(reader_, footer_.gt_offsets_.tile_max_offsets_[idx], tile_max_[idx]);
+  });
+}
+
+Span<uint8_t>
+FragmentMetadata::tile_max(size_t idx) {
+  ensure_tile_max(idx);
+  return min_max_view(tile_max_[idx], false);
+}
+
+Span<uint8_t>
+FragmentMetadata::tile_max_var(size_t idx) {
+  ensure_tile_max(idx);
+  return min_max_view(tile_max_[idx], true);
+}
+
+Span<uint8_t>
+FragmentMetadata::tile_sum(size_t idx) {
+  std::call_once(tile_sum_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_SUM);
+    load_sums(reader_, footer_.gt_offsets_.tile_sum_offsets_[idx], tile_sum_[idx]);
+  });
+  auto& tile = tile_sum_[idx];
+  return tile.values<uint8_t>(sizeof(uint64_t), tile.value<uint64_t>(0));
+}
+
+Span<uint64_t>
+FragmentMetadata::tile_null_count(size_t idx) {
+  std::call_once(tile_null_count_loaded_[idx], [&]() {
+    PhaseTimer timer(PHASE_LOAD_TILE_NULL_COUNT);
+    load_offsets(reader_, footer_.gt_offsets_.tile_null_count_offsets_[idx], tile_null_count_[idx]);
+  });
+  return uint64s_view(tile_null_count_[idx]);
+}
+
+void
+FragmentMetadata::ensure_fragment_stats() {
+  std::call_once(fragment_stats_loaded_, [&]() {
+    PhaseTimer timer(PHASE_LOAD_FRAGMENT_STATS);
+    load_fragment_min_max_sum_null_count(reader_, footer_.gt_offsets_.fragment_min_max_sum_null_count_offset_);
+  });
+}
+
+Span<uint8_t>
+FragmentMetadata::fragment_min(size_t idx) {
+  ensure_fragment_stats();
+  return fragment_min_[idx];
+}
+
+Span<uint8_t>
+FragmentMetadata::fragment_max(size_t idx) {
+  ensure_fragment_stats();
+  return fragment_max_[idx];
+}
+
+uint64_t
+FragmentMetadata::fragment_sum(size_t idx) {
+  ensure_fragment_stats();
+  return fragment_sum_[idx];
+}
+
+uint64_t
+FragmentMetadata::fragment_null_count(size_t idx) {
+  ensure_fragment_stats();
+  return fragment_null_count_[idx];
+}
+
+const Tile&
+FragmentMetadata::processed_conditions() {
+  std::call_once(processed_conditions_loaded_, [&]() {
+    PhaseTimer timer(PHASE_LOAD_PROCESSED_CONDITIONS);
+    processed_conditions_tile_ = load_tile(reader_, footer_.gt_offsets_.processed_conditions_offsets_);
+  });
+  return processed_conditions_tile_;
+}
+
+void
+FragmentMetadata::load_all() {
+  // Every generic tile's location is known from the footer and each one
+  // is written to its own preallocated slot, so they can all be loaded
+  // concurrently when a pool is available. Sections that were already
+  // loaded through an accessor are skipped by their once flag, and once
+  // everything is loaded later calls return without spawning anything.
+  std::call_once(all_loaded_, [&]() {
+    TaskGroup group;
+    auto spawn = [&](std::function<void()> task) {
+      if (pool_ == nullptr) {
+        task();
+      } else {
+        pool_->submit(group, std::move(task));
+      }
+    };
+
+    // Each section's load, keyed by its offset.
+    std::vector<std::pair<uint64_t, std::function<void()>>> loads;
+    auto& gt = footer_.gt_offsets_;
+    loads.emplace_back(gt.rtree_, [&]() { rtree(); });
+    for (size_t i = 0; i < nfields_; i++) {
+      loads.emplace_back(gt.tile_offsets_[i], [&, i]() { tile_offsets(i); });
+      loads.emplace_back(gt.tile_var_offsets_[i], [&, i]() { tile_var_offsets(i); });
+      loads.emplace_back(gt.tile_var_sizes_[i], [&, i]() { tile_var_sizes(i); });
+      loads.emplace_back(gt.tile_validity_offsets_[i], [&, i]() { tile_validity_offsets(i); });
+      loads.emplace_back(gt.tile_min_offsets_[i], [&, i]() { ensure_tile_min(i); });
+      loads.emplace_back(gt.tile_max_offsets_[i], [&, i]() { ensure_tile_max(i); });
+      loads.emplace_back(gt.tile_sum_offsets_[i], [&, i]() { tile_sum(i); });
+      loads.emplace_back(gt.tile_null_count_offsets_[i], [&, i]() { tile_null_count(i); });
+    }
+    loads.emplace_back(gt.fragment_min_max_sum_null_count_offset_, [&]() { ensure_fragment_stats(); });
+    loads.emplace_back(gt.processed_conditions_offsets_, [&]() { processed_conditions(); });
+
+    std::vector<uint64_t> offsets;
+    for (auto& load : loads) {
+      offsets.push_back(load.first);
+    }
+    auto ranges = plan_reads(offsets);
+
+    // Sections inside a prefetched range are loaded as soon as that range
+    // arrives, so decompression overlaps the reads still in flight. The
+    // rest are read on their own once prefetch has set up its ranges.
+    std::vector<std::vector<size_t>> range_loads(ranges.size());
+    std::vector<size_t> unplanned;
+    for (size_t i = 0; i < loads.size(); i++) {
+      auto offset = loads[i].first;
+      auto range = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(offset, UINT64_MAX));
+      if (range != ranges.begin() && offset < std::prev(range)->second) {
+        range_loads[std::prev(range) - ranges.begin()].push_back(i);
+      } else {
+        unplanned.push_back(i);
+      }
+    }
+
+    // The spawned loads refer to the locals here, so a failed read still
+    // waits for them before the error is passed on.
+    try {
+      reader_.prefetch(ranges, pool_, [&](size_t idx) {
+        for (auto i : range_loads[idx]) {
+          spawn(loads[i].second);
+        }
+      });
+
+      for (auto i : unplanned) {
+        spawn(loads[i].second);
+      }
+    } catch (...) {
+      if (pool_ != nullptr) {
+        try {
+          pool_->wait(group);
+        } catch (...) {
+        }
+      }
+      reader_.clear_prefetch();
+      throw;
+    }
+
+    if (pool_ != nullptr) {
+      try {
+        pool_->wait(group);
+      } catch (...) {
+        reader_.clear_prefetch();
+        throw;
+      }
+    }
+
+    reader_.clear_prefetch();
+    loaded_all_ = true;
+  });
+}
+
+void
+FragmentMetadata::load_field(size_t idx) {
+  if (loaded_all_) {
+    return;
+  }
+
+  auto& gt = footer_.gt_offsets_;
+  reader_.prefetch(plan_reads({
+      gt.tile_offsets_[idx],
+      gt.tile_var_offsets_[idx],
+      gt.tile_var_sizes_[idx],
+      gt.tile_validity_offsets_[idx],
+      gt.tile_min_offsets_[idx],
+      gt.tile_max_offsets_[idx],
+      gt.tile_sum_offsets_[idx],
+      gt.tile_null_count_offsets_[idx]}), pool_);
+
+  tile_offsets(idx);
+  tile_var_offsets(idx);
+  tile_var_sizes(idx);
+  tile_validity_offsets(idx);
+  ensure_tile_min(idx);
+  ensure_tile_max(idx);
+  tile_sum(idx);
+  tile_null_count(idx);
+
+  reader_.clear_prefetch();
+}
+
+// Each loader checks the tile's layout before publishing it so the views
+// handed out by the accessors never need to fail.
+void
+FragmentMetadata::load_offsets(Reader& reader, uint64_t offset, Tile& dst) {
+  Tile tile = load_tile(reader, offset);
+  uint64s_view(tile);
+  dst = std::move(tile);
+}
+
+void
+FragmentMetadata::load_values(Reader& reader, uint64_t offset, Tile& dst) {
+  Tile tile = load_tile(reader, offset);
+  min_max_view(tile, false);
+  min_max_view(tile, true);
+  dst = std::move(tile);
+}
+
+void
+FragmentMetadata::load_sums(Reader& reader, uint64_t offset, Tile& dst) {
+  Tile tile = load_tile(reader, offset);
+  tile.values<uint8_t>(sizeof(uint64_t), tile.value<uint64_t>(0));
+  dst = std::move(tile);
+}
+
+void
+FragmentMetadata::load_fragment_min_max_sum_null_count(Reader& reader, uint64_t offset) {
+  fragment_stats_tile_ = load_tile(reader, offset);
+  auto& tile = fragment_stats_tile_;
+
+  uint64_t pos = 0;
+  for (unsigned int i = 0; i < nfields_; i++) {
+    auto min_size = tile.value<uint64_t>(pos);
+    fragment_min_[i] = tile.values<uint8_t>(pos + sizeof(uint64_t), min_size);
+    pos += sizeof(uint64_t) + min_size;
+
+    auto max_size = tile.value<uint64_t>(pos);
+    fragment_max_[i] = tile.values<uint8_t>(pos + sizeof(uint64_t), max_size);
+    pos += sizeof(uint64_t) + max_size;
+
+    fragment_sum_[i] = tile.value<uint64_t>(pos);
+    fragment_null_count_[i] = tile.value<uint64_t>(pos + sizeof(uint64_t));
+    pos += 2 * sizeof(uint64_t);
+  }
+}
+
+void
+FragmentMetadata::dump(FILE* out) {
+  load_all();
+
+  footer_.dump(out);
+
+  fprintf(out, "RTree Tile:\n");
+  rtree_tile_.dump(out);
+
+  // MBRs can only be decoded knowing the dimension types.
+  if (footer_.schema_ && !rtree_tile_.empty()) {
+    RTree(rtree_tile_, footer_.schema_->dims_).dump(out);
+  }
+
+  fprintf(out, "Tile Offsets:\n");
+  for (size_t i = 0; i < tile_offsets_.size(); i++) {
+    fprintf(out, "    %zu: %zu offsets\n", i, tile_offsets(i).size());
+    for (auto& offset : tile_offsets(i)) {
+      fprintf(out, "        %llu\n", offset);
+    }
+  }
+
+  fprintf(out, "Tile Var Offsets:\n");
+  for (size_t i = 0; i < tile_var_offsets_.size(); i++) {
+    fprintf(out, "    %zu: %zu offsets\n", i, tile_var_offsets(i).size());
+    for (auto& offset : tile_var_offsets(i)) {
+      fprintf(out, "        %llu\n", offset);
+    }
+  }
+
+  fprintf(out, "Tile Var Sizes:\n");
+  for (size_t i = 0; i < tile_var_sizes_.size(); i++) {
+    fprintf(out, "    %zu: %zu sizes\n", i, tile_var_sizes(i).size());
+    for (auto& size : tile_var_sizes(i)) {
+      fprintf(out, "        %llu\n", size);
+    }
+  }
+
+  fprintf(out, "Tile Validity Offsets:\n");
+  for (size_t i = 0; i < tile_validity_offsets_.size(); i++) {
+    fprintf(out, "    %zu: %zu offsets\n", i, tile_validity_offsets(i).size());
+    for (auto& offset : tile_validity_offsets(i)) {
+      fprintf(out, "        %llu\n", offset);
+    }
+  }
+
+  fprintf(out, "Tile Min Values:\n");
+  for (size_t i = 0; i < tile_min_.size(); i++) {
+    fprintf(out, "    %zu: %zu data bytes, %zu var data bytes\n", i, tile_min(i).size(), tile_min_var(i).size());
+  }
+
+  fprintf(out, "Tile Max Values:\n");
+  for (size_t i = 0; i < tile_max_.size(); i++) {
+    fprintf(out, "    %zu: %zu data bytes, %zu var data bytes\n", i, tile_max(i).size(), tile_max_var(i).size());
+  }
+
+  fprintf(out, "Tile Sums:\n");
+  for (size_t i = 0; i < tile_sum_.size(); i++) {
+    fprintf(out, "    %zu: %zu sum bytes\n", i, tile_sum(i).size());
+  }
+
+  fprintf(out, "Tile Null Counts:\n");
+  for (size_t i = 0; i < tile_null_count_.size(); i++) {
+    fprintf(out, "    %zu: %lu null counts\n", i, tile_null_count(i).size());
+    for (auto& null_count : tile_null_count(i)) {
+      fprintf(out, "        %llu\n", null_count);
+    }
+  }
+
+  fprintf(out, "Fragment Min Value:\n");
+  for (size_t i = 0; i < fragment_min_.size(); i++) {
+    fprintf(out, "    %zu: %zu bytes\n", i, fragment_min_.size());
+  }
+
+  fprintf(out, "Fragment Max Value:\n");
+  for (size_t i = 0; i < fragment_max_.size(); i++) {
+    fprintf(out, "    %zu: %zu bytes\n", i, fragment_max_.size());
+  }
+
+  fprintf(out, "Fragment Sums:\n");
+  for (size_t i = 0; i < fragment_sum_.size(); i++) {
+    fprintf(out, "    %zu: %llu\n", i, fragment_sum_[i]);
+  }
+
+  fprintf(out, "Fragment Null Counts:\n");
+  for (size_t i = 0; i < fragment_null_count_.size(); i++) {
+    fprintf(out, "    %zu: %llu\n", i, fragment_null_count_[i]);
+  }
+}
+
+void
+FragmentMetadata::dump_field(size_t idx, FILE* out) {
+  load_field(idx);
+
+  fprintf(out, "Field %zu:\n", idx);
+  if (idx < footer_.fields_.size()) {
+    fprintf(out, "    Name: %s\n", footer_.fields_[idx].name_.c_str());
+  }
+
+  fprintf(out, "    Tile Offsets: %zu offsets\n", tile_offsets(idx).size());
+  for (auto& offset : tile_offsets(idx)) {
+    fprintf(out, "        %llu\n", offset);
+  }
+
+  fprintf(out, "    Tile Var Offsets: %zu offsets\n", tile_var_offsets(idx).size());
+  for (auto& offset : tile_var_offsets(idx)) {
+    fprintf(out, "        %llu\n", offset);
+  }
+
+  fprintf(out, "    Tile Var Sizes: %zu sizes\n", tile_var_sizes(idx).size());
+  for (auto& size : tile_var_sizes(idx)) {
+    fprintf(out, "        %llu\n", size);
+  }
+
+  fprintf(out, "    Tile Validity Offsets: %zu offsets\n", tile_validity_offsets(idx).size());
+  for (auto& offset : tile_validity_offsets(idx)) {
+    fprintf(out, "        %llu\n", offset);
+  }
+
+  fprintf(out, "    Tile Min Values: %zu data bytes, %zu var data bytes\n", tile_min(idx).size(), tile_min_var(idx).size());
+  fprintf(out, "    Tile Max Values: %zu data bytes, %zu var data bytes\n", tile_max(idx).size(), tile_max_var(idx).size());
+  fprintf(out, "    Tile Sums: %zu sum bytes\n", tile_sum(idx).size());
+
+  fprintf(out, "    Tile Null Counts: %zu null counts\n", tile_null_count(idx).size());
+  for (auto& null_count : tile_null_count(idx)) {
+    fprintf(out, "        %llu\n", null_count);
+  }
+
+  fprintf(out, "    Fragment Min Value: %zu bytes\n", fragment_min(idx).size());
+  fprintf(out, "    Fragment Max Value: %zu bytes\n", fragment_max(idx).size());
+  fprintf(out, "    Fragment Sum: %llu\n", fragment_sum(idx));
+  fprintf(out, "    Fragment Null Count: %llu\n", fragment_null_count(idx));
+}
+
+void
+Footer::emit(Emitter& out) {
+  out.begin_record("footer");
+  out.u64("file_size", fragment_metadata_file_size_);
+  out.u64("size", footer_size_);
+  out.u64("offset", footer_offset_);
+  out.u64("version", version_);
+  out.str("schema", array_schema_);
+  out.u64("type", fragment_type_);
+  if (null_non_empty_domain_ != 0) {
+    out.null("non_empty_domain");
+  } else {
+    out.bytes("non_empty_domain", non_empty_domain_.data(), non_empty_domain_.size());
+  }
+  out.u64("sparse_tile_num", sparse_tile_num_);
+  out.u64("last_tile_cell_num", last_tile_cell_num_);
+  out.boolean("has_timestamps", has_timestamps_ != 0);
+  out.boolean("has_delete_meta", has_delete_meta_ != 0);
+  out.u64("nfields", nfields_);
+  out.str("nfields_source", nfields_source_);
+
+  out.begin_array("fields");
+  for (auto& field : fields_) {
+    out.begin_object(nullptr);
+    out.str("name", field.name_);
+    out.u64("datatype", field.datatype_);
+    if (field.var_sized()) {
+      out.null("cell_val_num");
+    } else {
+      out.u64("cell_val_num", field.cell_val_num_);
+    }
+    out.boolean("nullable", field.nullable_);
+    out.end_object();
+  }
+  out.end_array();
+
+  out.u64s("file_sizes", file_sizes_.data(), file_sizes_.size());
+  out.u64s("file_var_sizes", file_var_sizes_.data(), file_var_sizes_.size());
+  out.u64s("file_validity_sizes", file_validity_sizes_.data(), file_validity_sizes_.size());
+
+  auto& gt = gt_offsets_;
+  out.begin_object("generic_tile_offsets");
+  out.u64("rtree", gt.rtree_);
+  out.u64s("tile_offsets", gt.tile_offsets_.data(), gt.tile_offsets_.size());
+  out.u64s("tile_var_offsets", gt.tile_var_offsets_.data(), gt.tile_var_offsets_.size());
+  out.u64s("tile_var_sizes", gt.tile_var_sizes_.data(), gt.tile_var_sizes_.size());
+  out.u64s("tile_validity_offsets", gt.tile_validity_offsets_.data(), gt.tile_validity_offsets_.size());
+  out.u64s("tile_min_offsets", gt.tile_min_offsets_.data(), gt.tile_min_offsets_.size());
+  out.u64s("tile_max_offsets", gt.tile_max_offsets_.data(), gt.tile_max_offsets_.size());
+  out.u64s("tile_sum_offsets", gt.tile_sum_offsets_.data(), gt.tile_sum_offsets_.size());
+  out.u64s("tile_null_count_offsets", gt.tile_null_count_offsets_.data(), gt.tile_null_count_offsets_.size());
+  out.u64("fragment_min_max_sum_null_count", gt.fragment_min_max_sum_null_count_offset_);
+  out.u64("processed_conditions", gt.processed_conditions_offsets_);
+  out.end_object();
+  out.end_record();
+}
+
+static void
+emit_tile(Emitter& out, const char* section, const Tile& tile) {
+  out.begin_record(section);
+  out.u64("version", tile.version_);
+  out.u64("datatype", tile.datatype_);
+  out.u64("cell_size", tile.cell_size_);
+  out.bytes("data", tile.data(), tile.size());
+  out.end_record();
+}
+
+// The per-field sections, each written as one record per field.
+static const char* FIELD_SECTIONS[] = {
+  "tile_offsets",
+  "tile_var_offsets",
+  "tile_var_sizes",
+  "tile_validity_offsets",
+  "tile_min",
+  "tile_max",
+  "tile_sum",
+  "tile_null_count",
+  "fragment_stats",
+};
+
+static void
+emit_field_section(FragmentMetadata& fmd, Emitter& out, size_t section, size_t idx) {
+  out.begin_record(FIELD_SECTIONS[section], idx);
+  switch (section) {
+    case 0: {
+      auto vals = fmd.tile_offsets(idx);
+      out.u64s("values", vals.data(), vals.size());
+      break;
+    }
+    case 1: {
+      auto vals = fmd.tile_var_offsets(idx);
+      out.u64s("values", vals.data(), vals.size());
+      break;
+    }
+    case 2: {
+      auto vals = fmd.tile_var_sizes(idx);
+      out.u64s("values", vals.data(), vals.size());
+      break;
+    }
+    case 3: {
+      auto vals = fmd.tile_validity_offsets(idx);
+      out.u64s("values", vals.data(), vals.size());
+      break;
+    }
+    case 4: {
+      auto data = fmd.tile_min(idx);
+      auto var_data = fmd.tile_min_var(idx);
+      out.bytes("data", data.data(), data.size());
+      out.bytes("var_data", var_data.data(), var_data.size());
+      break;
+    }
+    case 5: {
+      auto data = fmd.tile_max(idx);
+      auto var_data = fmd.tile_max_var(idx);
+      out.bytes("data", data.data(), data.size());
+      out.bytes("var_data", var_data.data(), var_data.size());
+      break;
+    }
+    case 6: {
+      auto data = fmd.tile_sum(idx);
+      out.bytes("data", data.data(), data.size());
+      break;
+    }
+    case 7: {
+      auto vals = fmd.tile_null_count(idx);
+      out.u64s("values", vals.data(), vals.size());
+      break;
+    }
+    case 8: {
+      auto min = fmd.fragment_min(idx);
+      auto max = fmd.fragment_max(idx);
+      out.bytes("min", min.data(), min.size());
+      out.bytes("max", max.data(), max.size());
+      out.u64("sum", fmd.fragment_sum(idx));
+      out.u64("null_count", fmd.fragment_null_count(idx));
+      break;
+    }
+  }
+  out.end_record();
+}
+
+void
+FragmentMetadata::emit(Emitter& out) {
+  footer_.emit(out);
+  emit_tile(out, "rtree", rtree());
+  if (footer_.schema_ && !rtree_tile_.empty()) {
+    RTree(rtree_tile_, footer_.schema_->dims_).emit(out);
+  }
+
+  for (size_t section = 0; section < std::size(FIELD_SECTIONS); section++) {
+    for (size_t i = 0; i < nfields_; i++) {
+      emit_field_section(*this, out, section, i);
+    }
+  }
+
+  emit_tile(out, "processed_conditions", processed_conditions());
+}
+
+void
+FragmentMetadata::emit_field(size_t idx, Emitter& out) {
+  load_field(idx);
+  for (size_t section = 0; section < std::size(FIELD_SECTIONS); section++) {
+    emit_field_section(*this, out, section, idx);
+  }
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "reader.h"
+#include "schema.h"
+#include "tile.h"
+
+struct Emitter;
+struct MetadataCache;
+struct ThreadPool;
+
+// Field count assumed when neither a schema nor --nfields is available.
+// This matches the array the tool was originally written against.
+#define DEFAULT_NUM_FIELDS 15
+
+struct GenericTileOffsets {
+  void resize(size_t nfields);
+
+  uint64_t rtree_ = 0;
+  std::vector<uint64_t> tile_offsets_;
+  std::vector<uint64_t> tile_var_offsets_;
+  std::vector<uint64_t> tile_var_sizes_;
+  std::vector<uint64_t> tile_validity_offsets_;
+  std::vector<uint64_t> tile_min_offsets_;
+  std::vector<uint64_t> tile_max_offsets_;
+  std::vector<uint64_t> tile_sum_offsets_;
+  std::vector<uint64_t> tile_null_count_offsets_;
+  uint64_t fragment_min_max_sum_null_count_offset_;
+  uint64_t processed_conditions_offsets_;
+};
+
+// The footer's layout depends on the number of fields and on the
+// dimension types, so both are taken from the array schema when the
+// resolver can find one. Without a schema the field count comes from
+// --nfields (or DEFAULT_NUM_FIELDS) and the non-empty domain is whatever
+// lies between the fixed size parts of the footer.
+struct Footer {
+  Footer(Reader& reader, SchemaResolver& resolver);
+
+  void dump(FILE* out = stderr);
+  void dump_non_empty_domain(FILE* out);
+  void emit(Emitter& out);
+
+  uint64_t fragment_metadata_file_size_;
+  uint64_t footer_size_;
+  uint64_t footer_offset_;
+  uint64_t footer_hash_;
+  uint32_t version_;
+  std::string array_schema_;
+  uint8_t fragment_type_;
+  uint8_t null_non_empty_domain_;
+  std::vector<uint8_t> non_empty_domain_;
+  uint64_t sparse_tile_num_;
+  uint64_t last_tile_cell_num_;
+  uint8_t has_timestamps_;
+  uint8_t has_delete_meta_;
+
+  std::shared_ptr<const ArraySchema> schema_;
+  std::vector<FieldInfo> fields_;
+  size_t nfields_;
+  const char* nfields_source_;
+
+  std::vector<uint64_t> file_sizes_;
+  std::vector<uint64_t> file_var_sizes_;
+  std::vector<uint64_t> file_validity_sizes_;
+
+  GenericTileOffsets gt_offsets_;
+};
+
+// The decoded contents of a fragment metadata file.
+//
+// Only the Footer is parsed up front when lazy is true. Every other section
+// is read and decompressed on first use through its accessor and cached
+// from then on. Accessors are safe to call concurrently, except for
+// load_field (see below); distinct sections load in parallel while callers
+// racing on the same section wait for a single load. When lazy is false
+// the constructor prefetches every section (in parallel when given a
+// pool). The Reader and pool must outlive this object.
+//
+// Sections are views into their decoded generic tiles rather than copies.
+// The tiles are allocated from a per-fragment arena and freed all at once
+// with it. Tiles larger than tile_budget are unfiltered a chunk at a time
+// so their filtered bytes are never held whole.
+//
+// With a cache_dir, sections are loaded from the fragment's entry in a
+// MetadataCache when it is current. A complete load that found no
+// current entry writes one.
+struct FragmentMetadata {
+  FragmentMetadata(
+      Reader& reader,
+      SchemaResolver& resolver,
+      ThreadPool* pool = nullptr,
+      bool lazy = false,
+      uint64_t tile_budget = DEFAULT_TILE_BUDGET,
+      const char* cache_dir = nullptr);
+  ~FragmentMetadata();
+
+  const Tile& rtree();
+  Span<uint64_t> tile_offsets(size_t idx);
+  Span<uint64_t> tile_var_offsets(size_t idx);
+  Span<uint64_t> tile_var_sizes(size_t idx);
+  Span<uint64_t> tile_validity_offsets(size_t idx);
+  Span<uint8_t> tile_min(size_t idx);
+  Span<uint8_t> tile_min_var(size_t idx);
+  Span<uint8_t> tile_max(size_t idx);
+  Span<uint8_t> tile_max_var(size_t idx);
+  Span<uint8_t> tile_sum(size_t idx);
+  Span<uint64_t> tile_null_count(size_t idx);
+  Span<uint8_t> fragment_min(size_t idx);
+  Span<uint8_t> fragment_max(size_t idx);
+  uint64_t fragment_sum(size_t idx);
+  uint64_t fragment_null_count(size_t idx);
+  const Tile& processed_conditions();
+
+  void load_all();
+
+  // Load every section of field idx, reading them with as few reads as
+  // possible. Does nothing once load_all has run. It sets up the Reader's
+  // prefetched ranges, so it must not run concurrently with any other
+  // accessor or load_field call.
+  void load_field(size_t idx);
+
+  // Every section tile keyed by its offset in the file, in footer order.
+  // Only meaningful once the sections are loaded.
+  std::vector<std::pair<uint64_t, const Tile*>> sections() const;
+
+  void load_offsets(Reader& reader, uint64_t offset, Tile& dst);
+  void load_values(Reader& reader, uint64_t offset, Tile& dst);
+  void load_sums(Reader& reader, uint64_t offset, Tile& dst);
+  void load_fragment_min_max_sum_null_count(Reader& reader, uint64_t offset);
+
+  void dump(FILE* out = stderr);
+  void dump_field(size_t idx, FILE* out = stderr);
+
+  // Structured equivalents of dump and dump_field. Sections are loaded as
+  // they are emitted when they weren't already.
+  void emit(Emitter& out);
+  void emit_field(size_t idx, Emitter& out);
+
+  Reader& reader_;
+  ThreadPool* pool_;
+  uint64_t tile_budget_;
+  Arena arena_;
+  Footer footer_;
+  size_t nfields_;
+
+  // Tiles loaded from the cache view its mapping, so it's declared ahead
+  // of them to be destroyed after them.
+  std::unique_ptr<MetadataCache> cache_;
+
+  // Offset, var size, validity offset and null count tiles hold a count
+  // and that many uint64_t values. Min and max tiles hold the fixed and
+  // var data sizes followed by the data. Sum tiles hold a size and sums.
+  Tile rtree_tile_;
+  std::pmr::vector<Tile> tile_offsets_;
+  std::pmr::vector<Tile> tile_var_offsets_;
+  std::pmr::vector<Tile> tile_var_sizes_;
+  std::pmr::vector<Tile> tile_validity_offsets_;
+  std::pmr::vector<Tile> tile_min_;
+  std::pmr::vector<Tile> tile_max_;
+  std::pmr::vector<Tile> tile_sum_;
+  std::pmr::vector<Tile> tile_null_count_;
+
+  Tile fragment_stats_tile_;
+  std::pmr::vector<Span<uint8_t>> fragment_min_;
+  std::pmr::vector<Span<uint8_t>> fragment_max_;
+  std::pmr::vector<uint64_t> fragment_sum_;
+  std::pmr::vector<uint64_t> fragment_null_count_;
+
+  Tile processed_conditions_tile_;
+
+ private:
+  Tile load_tile(Reader& reader, uint64_t offset);
+  std::vector<std::pair<uint64_t, uint64_t>> plan_reads(const std::vector<uint64_t>& offsets);
+  void save_cache(const char* cache_dir);
+
+  void ensure_tile_min(size_t idx);
+  void ensure_tile_max(size_t idx);
+  void ensure_fragment_stats();
+
+  std::once_flag rtree_loaded_;
+  std::vector<std::once_flag> tile_offsets_loaded_;
+  std::vector<std::once_flag> tile_var_offsets_loaded_;
+  std::vector<std::once_flag> tile_var_sizes_loaded_;
+  std::vector<std::once_flag> tile_validity_offsets_loaded_;
+  std::vector<std::once_flag> tile_min_loaded_;
+  std::vector<std::once_flag> tile_max_loaded_;
+  std::vector<std::once_flag> tile_sum_loaded_;
+  std::vector<std::once_flag> tile_null_count_loaded_;
+  std::once_flag fragment_stats_loaded_;
+  std::once_flag processed_conditions_loaded_;
+  std::once_flag all_loaded_;
+  std::atomic<bool> loaded_all_{false};
+};
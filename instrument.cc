@@ -0,0 +1,169 @@
+#include <time.h>
+
+#include <atomic>
+
+#include "instrument.h"
+
+namespace {
+
+struct AtomicPhaseStats {
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<uint64_t> wall_ns_{0};
+  std::atomic<uint64_t> cpu_ns_{0};
+  std::atomic<uint64_t> bytes_in_{0};
+  std::atomic<uint64_t> bytes_out_{0};
+  std::atomic<uint64_t> syscalls_{0};
+};
+
+AtomicPhaseStats phases[NUM_PHASES];
+
+// Only written before any worker threads exist.
+bool enabled = false;
+
+const char* names[NUM_PHASES] = {
+  "read",
+  "header",
+  "chunk_list",
+  "decompress",
+  "cache",
+  "footer",
+  "load_rtree",
+  "load_tile_offsets",
+  "load_tile_var_offsets",
+  "load_tile_var_sizes",
+  "load_tile_validity_offsets",
+  "load_tile_min",
+  "load_tile_max",
+  "load_tile_sum",
+  "load_tile_null_count",
+  "load_fragment_stats",
+  "load_processed_conditions",
+  "verify",
+};
+
+uint64_t
+clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+void
+instrument_enable() {
+  enabled = true;
+}
+
+bool
+instrument_enabled() {
+  return enabled;
+}
+
+const char*
+phase_name(Phase phase) {
+  return names[phase];
+}
+
+PhaseStats
+phase_stats(Phase phase) {
+  auto& src = phases[phase];
+  PhaseStats stats;
+  stats.calls_ = src.calls_.load(std::memory_order_relaxed);
+  stats.wall_ns_ = src.wall_ns_.load(std::memory_order_relaxed);
+  stats.cpu_ns_ = src.cpu_ns_.load(std::memory_order_relaxed);
+  stats.bytes_in_ = src.bytes_in_.load(std::memory_order_relaxed);
+  stats.bytes_out_ = src.bytes_out_.load(std::memory_order_relaxed);
+  stats.syscalls_ = src.syscalls_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+PhaseTimer::PhaseTimer(Phase phase)
+    : phase_(phase)
+    , enabled_(enabled)
+    , wall_start_(0)
+    , cpu_start_(0)
+    , bytes_in_(0)
+    , bytes_out_(0)
+    , syscalls_(0) {
+  if (enabled_) {
+    wall_start_ = clock_ns(CLOCK_MONOTONIC);
+    cpu_start_ = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!enabled_) {
+    return;
+  }
+
+  auto cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_;
+  auto wall = clock_ns(CLOCK_MONOTONIC) - wall_start_;
+
+  auto& dst = phases[phase_];
+  dst.calls_.fetch_add(1, std::memory_order_relaxed);
+  dst.wall_ns_.fetch_add(wall, std::memory_order_relaxed);
+  dst.cpu_ns_.fetch_add(cpu, std::memory_order_relaxed);
+  dst.bytes_in_.fetch_add(bytes_in_, std::memory_order_relaxed);
+  dst.bytes_out_.fetch_add(bytes_out_, std::memory_order_relaxed);
+  dst.syscalls_.fetch_add(syscalls_, std::memory_order_relaxed);
+}
+
+void
+PhaseTimer::add_bytes(uint64_t bytes_in, uint64_t bytes_out) {
+  bytes_in_ += bytes_in;
+  bytes_out_ += bytes_out;
+}
+
+void
+PhaseTimer::add_syscall() {
+  syscalls_++;
+}
+
+void
+dump_phase_table(FILE* out) {
+  fprintf(out, "%-28s %10s %12s %12s %14s %14s %7s %10s\n",
+      "Phase", "Calls", "Wall ms", "CPU ms", "Bytes In", "Bytes Out", "Ratio", "Syscalls");
+  for (int i = 0; i < NUM_PHASES; i++) {
+    auto stats = phase_stats((Phase)i);
+    if (stats.calls_ == 0) {
+      continue;
+    }
+
+    fprintf(out, "%-28s %10llu %12.3f %12.3f %14llu %14llu",
+        names[i], (unsigned long long)stats.calls_, stats.wall_ns_ / 1e6,
+        stats.cpu_ns_ / 1e6, (unsigned long long)stats.bytes_in_,
+        (unsigned long long)stats.bytes_out_);
+    if (stats.bytes_in_ > 0 && stats.bytes_out_ > 0) {
+      fprintf(out, " %7.2f", (double)stats.bytes_out_ / stats.bytes_in_);
+    } else {
+      fprintf(out, " %7s", "-");
+    }
+    fprintf(out, " %10llu\n", (unsigned long long)stats.syscalls_);
+  }
+}
+
+void
+dump_phase_json(FILE* out) {
+  fprintf(out, "[");
+  bool first = true;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    auto stats = phase_stats((Phase)i);
+    if (stats.calls_ == 0) {
+      continue;
+    }
+
+    fprintf(out, "%s\n    {\"phase\": \"%s\", \"calls\": %llu, \"wall_ns\": %llu, \"cpu_ns\": %llu, "
+        "\"bytes_in\": %llu, \"bytes_out\": %llu, \"syscalls\": %llu",
+        first ? "" : ",", names[i], (unsigned long long)stats.calls_,
+        (unsigned long long)stats.wall_ns_, (unsigned long long)stats.cpu_ns_,
+        (unsigned long long)stats.bytes_in_, (unsigned long long)stats.bytes_out_,
+        (unsigned long long)stats.syscalls_);
+    if (stats.bytes_in_ > 0 && stats.bytes_out_ > 0) {
+      fprintf(out, ", \"ratio\": %.4f", (double)stats.bytes_out_ / stats.bytes_in_);
+    }
+    fprintf(out, "}");
+    first = false;
+  }
+  fprintf(out, "%s]", first ? "" : "\n  ");
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+
+// Phases of dissecting a fragment that are timed when instrumentation is
+// enabled. Phases nest, so the time of a section load includes the reads,
+// header parses and decompression it does.
+enum Phase {
+  PHASE_READ,
+  PHASE_HEADER,
+  PHASE_CHUNK_LIST,
+  PHASE_DECOMPRESS,
+  PHASE_CACHE,
+  PHASE_FOOTER,
+  PHASE_LOAD_RTREE,
+  PHASE_LOAD_TILE_OFFSETS,
+  PHASE_LOAD_TILE_VAR_OFFSETS,
+  PHASE_LOAD_TILE_VAR_SIZES,
+  PHASE_LOAD_TILE_VALIDITY_OFFSETS,
+  PHASE_LOAD_TILE_MIN,
+  PHASE_LOAD_TILE_MAX,
+  PHASE_LOAD_TILE_SUM,
+  PHASE_LOAD_TILE_NULL_COUNT,
+  PHASE_LOAD_FRAGMENT_STATS,
+  PHASE_LOAD_PROCESSED_CONDITIONS,
+  PHASE_VERIFY,
+  NUM_PHASES
+};
+
+// Totals for one phase across all threads. Wall and CPU time are summed
+// over every call, so concurrent calls can add up to more than the
+// elapsed time. bytes_in_ and bytes_out_ are what the phase consumed and
+// produced, e.g. compressed and decompressed bytes for PHASE_DECOMPRESS.
+struct PhaseStats {
+  uint64_t calls_;
+  uint64_t wall_ns_;
+  uint64_t cpu_ns_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t syscalls_;
+};
+
+// Instrumentation is off until this is called, which must happen before
+// any other threads are started.
+void instrument_enable();
+
+bool instrument_enabled();
+
+const char* phase_name(Phase phase);
+
+PhaseStats phase_stats(Phase phase);
+
+// Times one call of a phase from construction to destruction. Does
+// nothing when instrumentation is disabled.
+struct PhaseTimer {
+  explicit PhaseTimer(Phase phase);
+  ~PhaseTimer();
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+  void add_bytes(uint64_t bytes_in, uint64_t bytes_out);
+  void add_syscall();
+
+ private:
+  Phase phase_;
+  bool enabled_;
+  uint64_t wall_start_;
+  uint64_t cpu_start_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+  uint64_t syscalls_;
+};
+
+void dump_phase_table(FILE* out);
+
+// Write the phase totals as a JSON array of objects.
+void dump_phase_json(FILE* out);
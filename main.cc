@@ -1,449 +1,654 @@
 
+#include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-#include "deserializer.h"
+#include "decompressor.h"
+#include "emitter.h"
+#include "fragment_metadata.h"
+#include "object_store.h"
+#include "read_backend.h"
+#include "instrument.h"
 #include "reader.h"
+#include "rollup.h"
+#include "rtree.h"
+#include "schema.h"
+#include "stats_kernels.h"
+#include "thread_pool.h"
 #include "tile.h"
-
-// Hard coded values from the array schema
-#define NUM_FIELDS 15
-
-struct GenericTileOffsets {
-  GenericTileOffsets(size_t nfields);
-
-  uint64_t rtree_ = 0;
-  std::vector<uint64_t> tile_offsets_;
-  std::vector<uint64_t> tile_var_offsets_;
-  std::vector<uint64_t> tile_var_sizes_;
-  std::vector<uint64_t> tile_validity_offsets_;
-  std::vector<uint64_t> tile_min_offsets_;
-  std::vector<uint64_t> tile_max_offsets_;
-  std::vector<uint64_t> tile_sum_offsets_;
-  std::vector<uint64_t> tile_null_count_offsets_;
-  uint64_t fragment_min_max_sum_null_count_offset_;
-  uint64_t processed_conditions_offsets_;
-};
-
-struct Footer {
-  Footer(Reader& reader, size_t nfields);
-
-  void load_tile_offsets(Reader& reader, uint64_t offset, std::vector<uint64_t>& dst);
-
-  void dump();
-
-  uint64_t fragment_metadata_file_size_;
-  uint64_t footer_size_;
-  uint64_t footer_offset_;
-  uint32_t version_;
-  std::string array_schema_;
-  uint8_t fragment_type_;
-  uint8_t null_non_empty_domain_;
-  double non_empty_domain_[4];
-  uint64_t sparse_tile_num_;
-  uint64_t last_tile_cell_num_;
-  uint8_t has_timestamps_;
-  uint8_t has_delete_meta_;
-
-  std::vector<uint64_t> file_sizes_;
-  std::vector<uint64_t> file_var_sizes_;
-  std::vector<uint64_t> file_validity_sizes_;
-
-  GenericTileOffsets gt_offsets_;
-};
-
-struct FragmentMetadata {
-  FragmentMetadata(Reader& reader, size_t nfields);
-
-  void load_offsets(Reader& reader, uint64_t offset, std::vector<uint64_t>& dst);
-  void load_values(Reader& reader, uint64_t offset, std::vector<uint8_t>& data, std::vector<uint8_t>& var_data);
-  void load_sums(Reader& reader, uint64_t offset, std::vector<uint8_t>& sums);
-  void load_null_counts(Reader& reader, uint64_t offset, std::vector<uint64_t>& null_counts);
-  void load_fragment_min_max_sum_null_count(Reader& reader, uint64_t offset);
-
-  void dump();
-
-  size_t nfields_;
-  Footer footer_;
-
-  Tile rtree_tile_;
-  std::vector<std::vector<uint64_t>> tile_offsets_;
-  std::vector<std::vector<uint64_t>> tile_var_offsets_;
-  std::vector<std::vector<uint64_t>> tile_var_sizes_;
-  std::vector<std::vector<uint64_t>> tile_validity_offsets_;
-
-  std::vector<std::vector<uint8_t>> tile_min_;
-  std::vector<std::vector<uint8_t>> tile_min_var_;
-  std::vector<std::vector<uint8_t>> tile_max_;
-  std::vector<std::vector<uint8_t>> tile_max_var_;
-  std::vector<std::vector<uint8_t>> tile_sum_;
-  std::vector<std::vector<uint64_t>> tile_null_count_;
-
-  std::vector<std::vector<uint8_t>> fragment_min_;
-  std::vector<std::vector<uint8_t>> fragment_max_;
-  std::vector<uint64_t> fragment_sum_;
-  std::vector<uint64_t> fragment_null_count_;
-
-  Tile processed_conditions_tile_;
+#include "verify.h"
+#include "writer.h"
+
+// File name searched for when a directory is given on the command line.
+#define FRAGMENT_METADATA_NAME "__fragment_metadata.tdb"
+
+struct Options {
+  bool use_mmap = false;
+  size_t jobs = 0;
+  bool has_field = false;
+  size_t field = 0;
+  bool stats = false;
+  const char* stats_json = nullptr;
+  const char* format = nullptr;
+  const char* cache_dir = nullptr;
+  bool verify = false;
+  bool rollup = false;
+  bool footer_only = false;
+  const char* query = nullptr;
+  const char* rewrite = nullptr;
+  bool has_level = false;
+  WriteOptions write;
+  uint64_t tile_budget = DEFAULT_TILE_BUDGET;
 };
 
-GenericTileOffsets::GenericTileOffsets(size_t nfields)
-    : tile_offsets_(nfields)
-    , tile_var_offsets_(nfields)
-    , tile_var_sizes_(nfields)
-    , tile_validity_offsets_(nfields)
-    , tile_min_offsets_(nfields)
-    , tile_max_offsets_(nfields)
-    , tile_sum_offsets_(nfields)
-    , tile_null_count_offsets_(nfields) {
+static double
+process_cpu_seconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
 }
 
-Footer::Footer(Reader& reader, size_t nfields)
-  : file_sizes_(nfields)
-  , file_var_sizes_(nfields)
-  , file_validity_sizes_(nfields)
-  , gt_offsets_(nfields)
+static void
+show_stats(const Options& opts, std::chrono::steady_clock::time_point start)
 {
-  reader.read(&footer_size_, 8, reader.file_size_ - 8);
-  footer_offset_ = reader.file_size_ - footer_size_ - 8;
-
-  std::vector<uint8_t> footer_blob(footer_size_);
-  reader.read(footer_blob.data(), footer_size_, footer_offset_);
+  auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  auto cpu = process_cpu_seconds();
+  auto inflate = inflate_stats();
+  auto blocks = block_cache_stats();
+
+  if (opts.stats) {
+    fprintf(stderr, "Decompressor: %s\n", current_decompressor().name());
+    fprintf(stderr, "Read backend: %s\n", current_read_backend().name());
+    fprintf(stderr, "Inflate contexts: %llu initialized, %llu reused\n",
+        (unsigned long long)inflate.inits_, (unsigned long long)inflate.reuses_);
+    if (blocks.gets_ > 0 || blocks.hits_ > 0) {
+      fprintf(stderr, "Remote blocks: %llu GETs, %llu bytes fetched, %llu hits, %llu misses, %llu evicted\n",
+          (unsigned long long)blocks.gets_, (unsigned long long)blocks.bytes_fetched_,
+          (unsigned long long)blocks.hits_, (unsigned long long)blocks.misses_,
+          (unsigned long long)blocks.evictions_);
+    }
+    fprintf(stderr, "Elapsed: %.3f s wall, %.3f s CPU\n", wall, cpu);
+    dump_phase_table(stderr);
+  }
 
-  Deserializer dser(footer_blob.data(), footer_blob.size());
-  version_ = dser.read<uint32_t>();
+  if (opts.stats_json == nullptr) {
+    return;
+  }
 
-  uint64_t schema_name_size = dser.read<uint64_t>();
-  array_schema_.resize(schema_name_size);
-  dser.read(&array_schema_[0], schema_name_size);
+  FILE* out = strcmp(opts.stats_json, "-") == 0 ? stdout : fopen(opts.stats_json, "w");
+  if (out == nullptr) {
+    fprintf(stderr, "Error opening '%s': %s\n", opts.stats_json, strerror(errno));
+    exit(2);
+  }
 
-  fragment_type_ = dser.read<uint8_t>();
+  fprintf(out, "{\n");
+  fprintf(out, "  \"decompressor\": \"%s\",\n", current_decompressor().name());
+  fprintf(out, "  \"read_backend\": \"%s\",\n", current_read_backend().name());
+  fprintf(out, "  \"inflate_contexts\": {\"initialized\": %llu, \"reused\": %llu},\n",
+      (unsigned long long)inflate.inits_, (unsigned long long)inflate.reuses_);
+  fprintf(out, "  \"remote_blocks\": {\"gets\": %llu, \"bytes_fetched\": %llu, \"hits\": %llu, "
+      "\"misses\": %llu, \"evicted\": %llu},\n",
+      (unsigned long long)blocks.gets_, (unsigned long long)blocks.bytes_fetched_,
+      (unsigned long long)blocks.hits_, (unsigned long long)blocks.misses_,
+      (unsigned long long)blocks.evictions_);
+  fprintf(out, "  \"wall_seconds\": %.6f,\n", wall);
+  fprintf(out, "  \"cpu_seconds\": %.6f,\n", cpu);
+  fprintf(out, "  \"phases\": ");
+  dump_phase_json(out);
+  fprintf(out, "\n}\n");
 
-  null_non_empty_domain_ = dser.read<uint8_t>();
-  if (null_non_empty_domain_ == 0) {
-    for (size_t i = 0; i < 4; i++) {
-      non_empty_domain_[i] = dser.read<double>();
-    }
+  if (out != stdout) {
+    fclose(out);
   }
-
-  sparse_tile_num_ = dser.read<uint64_t>();
-  last_tile_cell_num_ = dser.read<uint64_t>();
-  has_timestamps_ = dser.read<uint8_t>();
-  has_delete_meta_ = dser.read<uint8_t>();
-
-  dser.read(&file_sizes_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&file_var_sizes_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&file_validity_sizes_[0], NUM_FIELDS * sizeof(uint64_t));
-
-  gt_offsets_.rtree_ = dser.read<uint64_t>();
-  dser.read(&gt_offsets_.tile_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_var_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_var_sizes_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_validity_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_min_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_max_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_sum_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  dser.read(&gt_offsets_.tile_null_count_offsets_[0], NUM_FIELDS * sizeof(uint64_t));
-  gt_offsets_.fragment_min_max_sum_null_count_offset_ = dser.read<uint64_t>();
-  gt_offsets_.processed_conditions_offsets_ = dser.read<uint64_t>();
 }
 
-void
-Footer::dump() {
-  fprintf(stderr, "File size: %llu\n", fragment_metadata_file_size_);
-  fprintf(stderr, "Footer:\n");
-  fprintf(stderr, "    Size: %llu\n", footer_size_);
-  fprintf(stderr, "    Offset: %llu\n", footer_offset_);
-  fprintf(stderr, "    Version: %u\n", version_);
-  fprintf(stderr, "    Schema: %s\n", array_schema_.c_str());
-  fprintf(stderr, "    Type: %u\n", fragment_type_);
-  fprintf(stderr, "    Non-Empty Domain:\n");
-  for (size_t i = 0; i < 4; i++) {
-    fprintf(stderr, "        %f\n", non_empty_domain_[i]);
-  }
-  fprintf(stderr, "    Sparse Tile Num: %llu\n", sparse_tile_num_);
-  fprintf(stderr, "    Last Tile Cell Num: %llu\n", last_tile_cell_num_);
-  fprintf(stderr, "    Has Timestamps: %u\n", has_timestamps_);
-  fprintf(stderr, "    Has Delete Meta: %u\n", has_delete_meta_);
-  fprintf(stderr, "    File Sizes:\n");
-  for (size_t i = 0; i < file_sizes_.size(); i++) {
-    fprintf(stderr, "        %lu: %llu\n", i, file_sizes_[i]);
-  }
-  fprintf(stderr, "    File Var Sizes:\n");
-  for (size_t i = 0; i < file_var_sizes_.size(); i++) {
-    fprintf(stderr, "        %lu: %llu\n", i, file_var_sizes_[i]);
-  }
-  fprintf(stderr, "    File Validity Sizes:\n");
-  for (size_t i = 0; i < file_validity_sizes_.size(); i++) {
-    fprintf(stderr, "        %lu: %llu\n", i, file_validity_sizes_[i]);
-  }
-  fprintf(stderr, "    Genric Tile Offsets:\n");
-  fprintf(stderr, "        RTree: %llu\n", gt_offsets_.rtree_);
-  fprintf(stderr, "        Tile Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Var Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_var_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_var_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Var Sizes:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_var_sizes_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_var_sizes_[i]);
-  }
-  fprintf(stderr, "        Tile Validity Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_validity_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_validity_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Min Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_min_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_min_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Max Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_max_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_max_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Sum Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_sum_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_sum_offsets_[i]);
-  }
-  fprintf(stderr, "        Tile Null Count Offsets:\n");
-  for (size_t i = 0; i < gt_offsets_.tile_null_count_offsets_.size(); i++) {
-    fprintf(stderr, "            %lu: %llu\n", i, gt_offsets_.tile_null_count_offsets_[i]);
-  }
-  fprintf(stderr, "        Fragment Min/Max/Sum/Null Count Offset: %llu\n", gt_offsets_.fragment_min_max_sum_null_count_offset_);
-  fprintf(stderr, "        Processed Conditions Offsets: %llu\n", gt_offsets_.processed_conditions_offsets_);
+static void
+usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [--mmap] [--jobs N] [--field N] [--stats] [--stats-json FILE] [--decompressor NAME] [--io NAME]\n", prog);
+  fprintf(stderr, "       [--tile-budget BYTES] [--format FORMAT] [--cache DIR] [--verify] [--stats-kernel NAME] [--rollup]\n");
+  fprintf(stderr, "       [--query NAME=START:END,...] [--rewrite OUT [--codec NAME] [--level N] [--chunk-size BYTES]]\n");
+  fprintf(stderr, "       [--footer-only] [--tail-read BYTES] [--block-cache BYTES] [--mock-latency MS]\n");
+  fprintf(stderr, "       [--mock-fail-every N] [--schema FILE | --nfields N] [--files-from LIST] PATH...\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "--decompressor selects the inflate backend, one of:");
+  for (auto backend : available_decompressors()) {
+    fprintf(stderr, " %s", backend->name());
+  }
+  fprintf(stderr, " (default: %s)\n", available_decompressors()[0]->name());
+  fprintf(stderr, "--io selects how a fragment's tiles are read ahead of decoding, one of:");
+  for (auto backend : available_read_backends()) {
+    fprintf(stderr, " %s", backend->name());
+  }
+  fprintf(stderr, " (default: %s)\n", available_read_backends()[0]->name());
+  fprintf(stderr, "--stats prints decoder statistics and per-phase timings after the report.\n");
+  fprintf(stderr, "--format writes the report to stdout as text (default), %s.\n", emitter_formats());
+  fprintf(stderr, "--stats-json FILE writes the same statistics as JSON to FILE, or - for stdout.\n");
+  fprintf(stderr, "--tile-budget BYTES reads tiles larger than BYTES one chunk at a time\n");
+  fprintf(stderr, "instead of whole (default: %d).\n", DEFAULT_TILE_BUDGET);
+  fprintf(stderr, "--cache DIR keeps decoded sections in DIR and reuses them while the file\n");
+  fprintf(stderr, "is unchanged.\n");
+  fprintf(stderr, "--verify recomputes each tile's min, max, sum and null count from the\n");
+  fprintf(stderr, "fragment's data files and reports any that differ from the metadata.\n");
+  fprintf(stderr, "--stats-kernel selects the kernel --verify uses, one of:");
+  for (auto kernel : available_stats_kernels()) {
+    fprintf(stderr, " %s", kernel->name());
+  }
+  fprintf(stderr, " (default: %s)\n", available_stats_kernels()[0]->name());
+  fprintf(stderr, "--rollup merges the fragment min, max, sum and null count and the non-empty\n");
+  fprintf(stderr, "domain of every fragment into array-wide statistics and a fragment table,\n");
+  fprintf(stderr, "reading only each fragment's footer and fragment statistics.\n");
+  fprintf(stderr, "--query lists the tiles whose R-tree MBR intersects the given range. Dimensions\n");
+  fprintf(stderr, "not named are unrestricted and an empty START or END leaves that side open.\n");
+  fprintf(stderr, "--rewrite OUT writes a single fragment's metadata back out to OUT, recompressed\n");
+  fprintf(stderr, "with --codec (one of: %s, default gzip) at --level in --chunk-size\n", available_codecs());
+  fprintf(stderr, "chunks (default: %d). OUT may be the fragment itself.\n", DEFAULT_WRITE_CHUNK_SIZE);
+  fprintf(stderr, "--block-cache BYTES caps the blocks of remote objects kept in memory (default: %d).\n",
+      DEFAULT_BLOCK_CACHE_SIZE);
+  fprintf(stderr, "--mock-latency MS delays every mock:// request by MS milliseconds.\n");
+  fprintf(stderr, "--mock-fail-every N fails every Nth mock:// request so it's retried.\n");
+  fprintf(stderr, "--footer-only prints just each fragment's footer and generic tile offsets.\n");
+  fprintf(stderr, "--tail-read BYTES reads that much of the end of each file along with the\n");
+  fprintf(stderr, "footer, keeping any tiles inside it (default: %d, 0 reads just the footer).\n", DEFAULT_TAIL_READ);
+  fprintf(stderr, "--field N only loads and prints the footer and field N's sections.\n");
+  fprintf(stderr, "--schema FILE reads field counts and types from an array schema file.\n");
+  fprintf(stderr, "--nfields N skips schema lookup and assumes N fields per fragment.\n");
+  fprintf(stderr, "By default the schema named in each footer is looked up in the array's\n");
+  fprintf(stderr, "__schema directory, falling back to %d fields if it isn't found.\n", DEFAULT_NUM_FIELDS);
+  fprintf(stderr, "Each PATH may be a fragment metadata file, a directory that is\n");
+  fprintf(stderr, "searched recursively for %s files, a glob, or an http://,\n", FRAGMENT_METADATA_NAME);
+  fprintf(stderr, "s3:// or mock:// URL of one file, which is read with ranged GETs.\n");
+  fprintf(stderr, "LIST is a file with one path per line, or - for stdin.\n");
+  exit(1);
 }
 
-FragmentMetadata::FragmentMetadata(Reader& reader, size_t nfields)
-    : nfields_(nfields)
-    , footer_(reader, nfields)
-    , tile_offsets_(nfields)
-    , tile_var_offsets_(nfields)
-    , tile_var_sizes_(nfields)
-    , tile_validity_offsets_(nfields)
-    , tile_min_(nfields)
-    , tile_min_var_(nfields)
-    , tile_max_(nfields)
-    , tile_max_var_(nfields)
-    , tile_sum_(nfields)
-    , tile_null_count_(nfields)
-    , fragment_min_(nfields)
-    , fragment_max_(nfields)
-    , fragment_sum_(nfields)
-    , fragment_null_count_(nfields) {
-
-  rtree_tile_ = read_tile(reader, footer_.gt_offsets_.rtree_);
-
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_offsets_.size(); i++) {
-    load_offsets(reader, footer_.gt_offsets_.tile_offsets_[i], tile_offsets_[i]);
-  }
-
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_var_offsets_.size(); i++) {
-    load_offsets(reader, footer_.gt_offsets_.tile_var_offsets_[i], tile_var_offsets_[i]);
+static void
+expand_path(const std::string& path, std::vector<std::string>& files)
+{
+  if (is_remote_path(path)) {
+    files.push_back(path);
+    return;
   }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_var_sizes_.size(); i++) {
-    load_offsets(reader, footer_.gt_offsets_.tile_var_sizes_[i], tile_var_sizes_[i]);
-  }
+  if (path.find_first_of("*?[") != std::string::npos) {
+    glob_t matches;
+    int rc = glob(path.c_str(), 0, nullptr, &matches);
+    if (rc == GLOB_NOMATCH) {
+      fprintf(stderr, "No files match '%s'\n", path.c_str());
+      exit(2);
+    } else if (rc != 0) {
+      fprintf(stderr, "Error expanding glob '%s'\n", path.c_str());
+      exit(2);
+    }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_validity_offsets_.size(); i++) {
-    load_offsets(reader, footer_.gt_offsets_.tile_validity_offsets_[i], tile_validity_offsets_[i]);
-  }
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+      expand_path(matches.gl_pathv[i], files);
+    }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_min_offsets_.size(); i++) {
-    load_values(reader, footer_.gt_offsets_.tile_min_offsets_[i], tile_min_[i], tile_min_var_[i]);
+    globfree(&matches);
+    return;
   }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_max_offsets_.size(); i++) {
-    load_values(reader, footer_.gt_offsets_.tile_max_offsets_[i], tile_max_[i], tile_max_var_[i]);
+  std::error_code ec;
+  if (!std::filesystem::is_directory(path, ec)) {
+    files.push_back(path);
+    return;
   }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_sum_offsets_.size(); i++) {
-    load_sums(reader, footer_.gt_offsets_.tile_sum_offsets_[i], tile_sum_[i]);
+  auto opts = std::filesystem::directory_options::skip_permission_denied;
+  for (auto& entry : std::filesystem::recursive_directory_iterator(path, opts, ec)) {
+    if (entry.is_regular_file(ec) && entry.path().filename() == FRAGMENT_METADATA_NAME) {
+      files.push_back(entry.path().string());
+    }
   }
 
-  for (size_t i = 0; i < footer_.gt_offsets_.tile_null_count_offsets_.size(); i++) {
-    load_null_counts(reader, footer_.gt_offsets_.tile_null_count_offsets_[i], tile_null_count_[i]);
+  if (ec) {
+    fprintf(stderr, "Error scanning '%s': %s\n", path.c_str(), ec.message().c_str());
+    exit(2);
   }
-
-  load_fragment_min_max_sum_null_count(reader, footer_.gt_offsets_.fragment_min_max_sum_null_count_offset_);
-  processed_conditions_tile_ = read_tile(reader, footer_.gt_offsets_.processed_conditions_offsets_);
 }
 
-void
-FragmentMetadata::load_offsets(Reader& reader, uint64_t offset, std::vector<uint64_t>& dst) {
-  Tile tile = read_tile(reader, offset);
-  Deserializer dser(tile.data_.data(), tile.data_.size());
+static void
+read_file_list(const char* list, std::vector<std::string>& paths)
+{
+  FILE* fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+  if (fp == nullptr) {
+    fprintf(stderr, "Error opening '%s': %s\n", list, strerror(errno));
+    exit(2);
+  }
+
+  char* line = nullptr;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
 
-  auto num_offsets = dser.read<uint64_t>();
-  if (num_offsets == 0) {
-    return;
+    if (len > 0) {
+      paths.emplace_back(line, len);
+    }
   }
 
-  auto size = num_offsets * sizeof(uint64_t);
-  dst.resize(num_offsets);
-  dser.read(&dst[0], size);
+  free(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
 }
 
-void
-FragmentMetadata::load_values(Reader& reader, uint64_t offset, std::vector<uint8_t>& data, std::vector<uint8_t>& var_data) {
-  Tile tile = read_tile(reader, offset);
-  Deserializer dser(tile.data_.data(), tile.data_.size());
-
-  auto data_size = dser.read<uint64_t>();
-  auto var_data_size = dser.read<uint64_t>();
-
-  data.resize(data_size);
-  dser.read(&data[0], data_size);
-
-  if (var_data_size) {
-    var_data.resize(var_data_size);
-    dser.read(&var_data[0], var_data_size);
+static RTree
+decode_rtree(FragmentMetadata& fmd)
+{
+  if (!fmd.footer_.schema_) {
+    throw std::logic_error("--query needs the array schema to decode the R-tree.");
   }
+  return RTree(fmd.rtree(), fmd.footer_.schema_->dims_);
 }
 
-void
-FragmentMetadata::load_sums(Reader& reader, uint64_t offset, std::vector<uint8_t>& sums) {
-  Tile tile = read_tile(reader, offset);
-  Deserializer dser(tile.data_.data(), tile.data_.size());
-
-  auto size = dser.read<uint64_t>();
-  sums.resize(size);
-  dser.read(&sums[0], size);
+static void
+dump_query(FragmentMetadata& fmd, const char* query, FILE* out)
+{
+  auto rtree = decode_rtree(fmd);
+  auto tiles = rtree.query(rtree.parse_query(query));
+  fprintf(out, "RTree Query: %s\n", query);
+  fprintf(out, "    Tiles: %zu of %llu\n", tiles.size(), (unsigned long long)rtree.num_tiles());
+  for (auto tile : tiles) {
+    fprintf(out, "        %llu\n", (unsigned long long)tile);
+  }
 }
 
-void
-FragmentMetadata::load_null_counts(Reader& reader, uint64_t offset, std::vector<uint64_t>& null_counts) {
-  Tile tile = read_tile(reader, offset);
-  Deserializer dser(tile.data_.data(), tile.data_.size());
-
-  auto num_counts = dser.read<uint64_t>();
-  null_counts.resize(num_counts);
-
-  auto size = num_counts * sizeof(uint64_t);
-  dser.read(&null_counts[0], size);
+static void
+emit_query(FragmentMetadata& fmd, const char* query, Emitter& out)
+{
+  auto rtree = decode_rtree(fmd);
+  auto tiles = rtree.query(rtree.parse_query(query));
+  out.begin_record("rtree_query");
+  out.str("query", query);
+  out.u64("num_tiles", rtree.num_tiles());
+  out.u64s("tiles", tiles.data(), tiles.size());
+  out.end_record();
 }
 
-void
-FragmentMetadata::load_fragment_min_max_sum_null_count(Reader& reader, uint64_t offset) {
-  Tile tile = read_tile(reader, offset);
-  Deserializer dser(tile.data_.data(), tile.data_.size());
+// Returns true if verification found a problem.
+static bool
+report(const std::string& path, const Options& opts, SchemaResolver& resolver, ThreadPool& pool, FILE* out)
+{
+  Reader reader(path.c_str(), opts.use_mmap);
+  if (opts.footer_only) {
+    Footer footer(reader, resolver);
+    footer.dump(out);
+    return false;
+  }
 
-  for (unsigned int i = 0; i < nfields_; i++) {
-    auto min_size = dser.read<uint64_t>();
-    fragment_min_[i].resize(min_size);
-    dser.read(fragment_min_[i].data(), min_size);
+  FragmentMetadata fmd(reader, resolver, &pool, opts.has_field, opts.tile_budget, opts.cache_dir);
 
-    auto max_size = dser.read<uint64_t>();
-    fragment_max_[i].resize(max_size);
-    dser.read(fragment_max_[i].data(), max_size);
+  if (opts.has_field) {
+    fmd.footer_.dump(out);
+    if (opts.field >= fmd.nfields_) {
+      throw std::out_of_range(
+          "Invalid field " + std::to_string(opts.field) + ", the fragment has "
+          + std::to_string(fmd.nfields_) + " fields.");
+    }
+    fmd.dump_field(opts.field, out);
+  } else {
+    fmd.dump(out);
+  }
 
-    fragment_sum_[i] = dser.read<uint64_t>();
-    fragment_null_count_[i] = dser.read<uint64_t>();
+  bool failed = false;
+  if (opts.verify) {
+    Verification verification(fmd, &pool, opts.use_mmap, opts.has_field ? (int64_t)opts.field : -1);
+    verification.dump(out);
+    failed = verification.failed();
   }
-}
 
-void
-FragmentMetadata::dump() {
-  footer_.dump();
+  if (opts.query != nullptr) {
+    dump_query(fmd, opts.query, out);
+  }
 
-  fprintf(stderr, "RTree Tile:\n");
-  rtree_tile_.dump();
+  reader.show_read_report(out);
+  return failed;
+}
 
-  fprintf(stderr, "Tile Offsets:\n");
-  for (size_t i = 0; i < tile_offsets_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu offsets\n", i, tile_offsets_[i].size());
-    for (auto& offset : tile_offsets_[i]) {
-      fprintf(stderr, "        %llu\n", offset);
+// The structured equivalent of report. Failures are emitted as an error
+// record rather than thrown, and true is returned.
+static bool
+emit_report(const std::string& path, const Options& opts, SchemaResolver& resolver, ThreadPool& pool, Emitter& out)
+{
+  bool failed = false;
+
+  out.begin_fragment(path);
+  try {
+    Reader reader(path.c_str(), opts.use_mmap);
+    if (opts.footer_only) {
+      Footer footer(reader, resolver);
+      footer.emit(out);
+    } else {
+      FragmentMetadata fmd(reader, resolver, &pool, opts.has_field, opts.tile_budget, opts.cache_dir);
+      if (opts.has_field) {
+        fmd.footer_.emit(out);
+        if (opts.field >= fmd.nfields_) {
+          throw std::out_of_range(
+              "Invalid field " + std::to_string(opts.field) + ", the fragment has "
+              + std::to_string(fmd.nfields_) + " fields.");
+        }
+        fmd.emit_field(opts.field, out);
+      } else {
+        fmd.emit(out);
+      }
+
+      if (opts.verify) {
+        Verification verification(fmd, &pool, opts.use_mmap, opts.has_field ? (int64_t)opts.field : -1);
+        verification.emit(out);
+        failed = verification.failed();
+      }
+
+      if (opts.query != nullptr) {
+        emit_query(fmd, opts.query, out);
+      }
+
+      reader.emit_read_report(out);
     }
+  } catch (std::exception& exc) {
+    out.error(exc.what());
+    failed = true;
   }
+  out.end_fragment();
+
+  return failed;
+}
 
-  fprintf(stderr, "Tile Var Offsets:\n");
-  for (size_t i = 0; i < tile_var_offsets_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu offsets\n", i, tile_var_offsets_[i].size());
-    for (auto& offset : tile_var_offsets_[i]) {
-      fprintf(stderr, "        %llu\n", offset);
+// Dissect a single fragment into an in-memory report. Each call owns its
+// own Reader so this is safe to run concurrently on any number of files.
+static std::string
+dissect(const std::string& path, const Options& opts, SchemaResolver& resolver, ThreadPool& pool, bool& failed)
+{
+  char* buf = nullptr;
+  size_t size = 0;
+  FILE* out = open_memstream(&buf, &size);
+
+  if (opts.format != nullptr) {
+    auto emitter = make_emitter(opts.format, out);
+    failed = emit_report(path, opts, resolver, pool, *emitter);
+  } else {
+    try {
+      failed = report(path, opts, resolver, pool, out);
+    } catch (std::exception& exc) {
+      fprintf(out, "Error dissecting '%s': %s\n", path.c_str(), exc.what());
+      failed = true;
     }
   }
 
-  fprintf(stderr, "Tile Var Sizes:\n");
-  for (size_t i = 0; i < tile_var_sizes_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu sizes\n", i, tile_var_sizes_[i].size());
-    for (auto& size : tile_var_sizes_[i]) {
-      fprintf(stderr, "        %llu\n", size);
+  fclose(out);
+  std::string ret(buf, size);
+  free(buf);
+  return ret;
+}
+
+int
+main(int argc, char* argv[])
+{
+  auto start = std::chrono::steady_clock::now();
+  Options opts;
+  SchemaResolver resolver;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mmap") == 0) {
+      opts.use_mmap = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      opts.stats = true;
+    } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+      opts.stats_json = argv[++i];
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      opts.format = argv[++i];
+      if (strcmp(opts.format, "text") == 0) {
+        opts.format = nullptr;
+      } else if (!make_emitter(opts.format, stdout)) {
+        fprintf(stderr, "Unknown output format '%s'\n", opts.format);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--decompressor") == 0 && i + 1 < argc) {
+      if (!set_decompressor(argv[++i])) {
+        fprintf(stderr, "Unknown or unavailable decompressor '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      if (!set_read_backend(argv[++i])) {
+        fprintf(stderr, "Unknown or unavailable read backend '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--stats-kernel") == 0 && i + 1 < argc) {
+      if (!set_stats_kernel(argv[++i])) {
+        fprintf(stderr, "Unknown or unsupported stats kernel '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      opts.verify = true;
+    } else if (strcmp(argv[i], "--rollup") == 0) {
+      opts.rollup = true;
+    } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+      opts.query = argv[++i];
+    } else if (strcmp(argv[i], "--rewrite") == 0 && i + 1 < argc) {
+      opts.rewrite = argv[++i];
+    } else if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc) {
+      if (!parse_codec(argv[++i], opts.write.compressor_)) {
+        fprintf(stderr, "Unknown or unavailable codec '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+      opts.has_level = true;
+      opts.write.level_ = strtol(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+      auto chunk_size = strtoull(argv[++i], nullptr, 10);
+      if (chunk_size == 0 || chunk_size > UINT32_MAX / 2) {
+        usage(argv[0]);
+      }
+      opts.write.chunk_size_ = chunk_size;
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      opts.jobs = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      opts.cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--footer-only") == 0) {
+      opts.footer_only = true;
+    } else if (strcmp(argv[i], "--tail-read") == 0 && i + 1 < argc) {
+      set_tail_read_size(strtoull(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--block-cache") == 0 && i + 1 < argc) {
+      set_block_cache_size(strtoull(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--mock-latency") == 0 && i + 1 < argc) {
+      set_mock_latency(strtoul(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--mock-fail-every") == 0 && i + 1 < argc) {
+      set_mock_failures(strtoul(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--tile-budget") == 0 && i + 1 < argc) {
+      opts.tile_budget = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--field") == 0 && i + 1 < argc) {
+      opts.has_field = true;
+      opts.field = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--schema") == 0 && i + 1 < argc) {
+      resolver.schema_path_ = argv[++i];
+    } else if (strcmp(argv[i], "--nfields") == 0 && i + 1 < argc) {
+      resolver.nfields_ = strtoul(argv[++i], nullptr, 10);
+      if (resolver.nfields_ == 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--files-from") == 0 && i + 1 < argc) {
+      read_file_list(argv[++i], paths);
+    } else if (argv[i][0] != '-') {
+      paths.push_back(argv[i]);
+    } else {
+      usage(argv[0]);
     }
   }
 
-  fprintf(stderr, "Tile Validity Offsets:\n");
-  for (size_t i = 0; i < tile_validity_offsets_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu offsets\n", i, tile_validity_offsets_[i].size());
-    for (auto& offset : tile_validity_offsets_[i]) {
-      fprintf(stderr, "        %llu\n", offset);
-    }
+  if (paths.empty() || (opts.rollup && (opts.verify || opts.has_field))) {
+    usage(argv[0]);
   }
 
-  fprintf(stderr, "Tile Min Values:\n");
-  for (size_t i = 0; i < tile_min_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu data bytes, %zu var data bytes\n", i, tile_min_[i].size(), tile_min_var_[i].size());
+  if (opts.rewrite != nullptr && (opts.rollup || opts.verify || opts.has_field || opts.query != nullptr)) {
+    usage(argv[0]);
   }
 
-  fprintf(stderr, "Tile Max Values:\n");
-  for (size_t i = 0; i < tile_max_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu data bytes, %zu var data bytes\n", i, tile_max_[i].size(), tile_max_var_[i].size());
+  if (opts.footer_only && (opts.rollup || opts.verify || opts.has_field || opts.query != nullptr || opts.rewrite != nullptr)) {
+    usage(argv[0]);
   }
 
-  fprintf(stderr, "Tile Sums:\n");
-  for (size_t i = 0; i < tile_sum_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu sum bytes\n", i, tile_sum_[i].size());
+  if (opts.rewrite != nullptr && is_remote_path(opts.rewrite)) {
+    fprintf(stderr, "--rewrite can only write local files\n");
+    exit(1);
   }
 
-  fprintf(stderr, "Tile Null Counts:\n");
-  for (size_t i = 0; i < tile_null_count_.size(); i++) {
-    fprintf(stderr, "    %zu: %lu null counts\n", i, tile_null_count_[i].size());
-    for (auto& null_count : tile_null_count_[i]) {
-      fprintf(stderr, "        %llu\n", null_count);
-    }
+  if (!opts.has_level) {
+    opts.write.level_ = default_level(opts.write.compressor_);
   }
 
-  fprintf(stderr, "Fragment Min Value:\n");
-  for (size_t i = 0; i < fragment_min_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu bytes\n", i, fragment_min_.size());
+  if (opts.stats || opts.stats_json != nullptr) {
+    instrument_enable();
   }
 
-  fprintf(stderr, "Fragment Max Value:\n");
-  for (size_t i = 0; i < fragment_max_.size(); i++) {
-    fprintf(stderr, "    %zu: %zu bytes\n", i, fragment_max_.size());
+  std::vector<std::string> files;
+  for (auto& path : paths) {
+    expand_path(path, files);
   }
 
-  fprintf(stderr, "Fragment Sums:\n");
-  for (size_t i = 0; i < fragment_sum_.size(); i++) {
-    fprintf(stderr, "    %zu: %llu\n", i, fragment_sum_[i]);
+  // Text reports are written a value at a time, so don't let each one
+  // become its own write.
+  setvbuf(stderr, nullptr, _IOFBF, EMITTER_FLUSH_BYTES);
+
+  // Sort and dedupe so the merged report is identical regardless of how
+  // the inputs were spelled or which worker finished first.
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+
+  if (opts.rollup) {
+    ThreadPool pool(opts.jobs);
+    Rollup rollup(files, resolver, pool, opts.use_mmap, opts.cache_dir);
+    if (opts.format != nullptr) {
+      auto emitter = make_emitter(opts.format, stdout);
+      emitter->begin_fragment(paths.size() == 1 ? paths[0] : "");
+      rollup.emit(*emitter);
+      emitter->end_fragment();
+    } else {
+      rollup.dump(stderr);
+    }
+    show_stats(opts, start);
+    return rollup.failed() ? 2 : 0;
   }
 
-  fprintf(stderr, "Fragment Null Counts:\n");
-  for (size_t i = 0; i < fragment_null_count_.size(); i++) {
-    fprintf(stderr, "    %zu: %llu\n", i, fragment_null_count_[i]);
+  if (opts.rewrite != nullptr) {
+    if (files.size() != 1) {
+      fprintf(stderr, "--rewrite takes exactly one fragment metadata file, got %zu.\n", files.size());
+      exit(2);
+    }
+
+    ThreadPool pool(opts.jobs);
+    try {
+      Reader reader(files[0].c_str(), opts.use_mmap);
+      FragmentMetadata fmd(reader, resolver, &pool, false, opts.tile_budget);
+      Rewrite rewrite(fmd, opts.rewrite, opts.write, &pool);
+      if (opts.format != nullptr) {
+        auto emitter = make_emitter(opts.format, stdout);
+        emitter->begin_fragment(files[0]);
+        rewrite.emit(*emitter);
+        emitter->end_fragment();
+      } else {
+        rewrite.dump(stderr);
+      }
+    } catch (std::exception& exc) {
+      fprintf(stderr, "Error rewriting '%s': %s\n", files[0].c_str(), exc.what());
+      exit(2);
+    }
+    show_stats(opts, start);
+    return 0;
+  }
+
+  // A single plain file keeps the original unadorned output.
+  std::error_code ec;
+  if (files.size() == 1 && paths.size() == 1 && !std::filesystem::is_directory(paths[0], ec)) {
+    ThreadPool pool(opts.jobs);
+    if (opts.format != nullptr) {
+      auto emitter = make_emitter(opts.format, stdout);
+      if (emit_report(files[0], opts, resolver, pool, *emitter)) {
+        exit(2);
+      }
+      emitter.reset();
+      show_stats(opts, start);
+      return 0;
+    }
+
+    bool failed = false;
+    try {
+      failed = report(files[0], opts, resolver, pool, stderr);
+    } catch (std::exception& exc) {
+      fprintf(stderr, "Error dissecting '%s': %s\n", files[0].c_str(), exc.what());
+      exit(2);
+    }
+    show_stats(opts, start);
+    return failed ? 2 : 0;
+  }
+
+  std::vector<std::string> reports(files.size());
+  std::vector<uint8_t> failed(files.size(), 0);
+
+  {
+    ThreadPool pool(opts.jobs);
+    TaskGroup group;
+    for (size_t i = 0; i < files.size(); i++) {
+      pool.submit(group, [&, i]() {
+        bool err = false;
+        reports[i] = dissect(files[i], opts, resolver, pool, err);
+        failed[i] = err;
+      });
+    }
+    pool.wait(group);
   }
-}
 
-int
-main(int argc, char* argv[])
-{
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s FRAGMENT_METADATA_FILE\n", argv[0]);
-    exit(1);
+  size_t num_failed = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    num_failed += failed[i];
   }
 
-  Reader reader(argv[1]);
-  FragmentMetadata fmd(reader, NUM_FIELDS);
-  fmd.dump();
+  if (opts.format != nullptr) {
+    // JSON reports are gathered into an array. The other formats are
+    // already self delimiting and are simply concatenated.
+    bool json = strcmp(opts.format, "json") == 0;
+    if (json) {
+      fputs("[\n", stdout);
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+      if (json && i > 0) {
+        fputs(",", stdout);
+      }
+      fwrite(reports[i].data(), 1, reports[i].size(), stdout);
+    }
+    if (json) {
+      fputs("]\n", stdout);
+    }
+  } else {
+    for (size_t i = 0; i < files.size(); i++) {
+      fprintf(stderr, "==> %s <==\n", files[i].c_str());
+      fwrite(reports[i].data(), 1, reports[i].size(), stderr);
+      fprintf(stderr, "\n");
+    }
+  }
 
-  reader.show_read_report();
+  fprintf(stderr, "Dissected %zu fragments, %zu failed.\n", files.size(), num_failed);
+  show_stats(opts, start);
+  return num_failed == 0 ? 0 : 2;
 }
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+
+#include "fragment_metadata.h"
+#include "instrument.h"
+#include "metadata_cache.h"
+#include "object_store.h"
+#include "reader.h"
+
+namespace {
+
+const uint32_t CACHE_MAGIC = 0x43444d46;  // "FMDC"
+
+struct FileHeader {
+  uint32_t magic_;
+  uint32_t version_;
+  uint64_t file_size_;
+  int64_t mtime_ns_;
+  uint64_t footer_hash_;
+  uint64_t num_entries_;
+  uint64_t path_size_;
+};
+
+uint64_t
+align(uint64_t val, uint64_t alignment) {
+  return (val + alignment - 1) / alignment * alignment;
+}
+
+// Fragments are keyed by absolute path so the same file reached through
+// different relative paths shares one entry.
+std::string
+absolute_path(const std::string& path) {
+  if (is_remote_path(path)) {
+    return path;
+  }
+
+  std::error_code ec;
+  auto ret = std::filesystem::absolute(path, ec);
+  return ec ? path : ret.lexically_normal().string();
+}
+
+std::string
+cache_file(const std::string& dir, const std::string& key) {
+  auto hash = hash_bytes(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.fmdc", (unsigned long long)hash);
+  return dir + "/" + name;
+}
+
+uint64_t
+entries_offset(uint64_t path_size) {
+  return align(sizeof(FileHeader) + path_size, alignof(MetadataCache::Entry));
+}
+
+}  // namespace
+
+uint64_t
+hash_bytes(const uint8_t* data, size_t nbytes, uint64_t seed) {
+  uint64_t hash = seed;
+  for (size_t i = 0; i < nbytes; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+MetadataCache::MetadataCache(const std::string& dir, Reader& reader, const Footer& footer)
+    : map_(nullptr)
+    , map_size_(0)
+    , entries_(nullptr)
+    , num_entries_(0) {
+  auto key = absolute_path(reader.filename_);
+  path_ = cache_file(dir, key);
+
+  int fd = ::open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(FileHeader)) {
+    ::close(fd);
+    return;
+  }
+
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return;
+  }
+
+  map_ = static_cast<const uint8_t*>(addr);
+  map_size_ = st.st_size;
+
+  // Anything that doesn't match exactly is treated as a miss and later
+  // overwritten, including truncated or otherwise corrupt files.
+  FileHeader header;
+  memcpy(&header, map_, sizeof(header));
+  if (header.magic_ != CACHE_MAGIC
+      || header.version_ != METADATA_CACHE_VERSION
+      || header.file_size_ != reader.file_size_
+      || header.mtime_ns_ != reader.mtime_ns_
+      || header.footer_hash_ != footer.footer_hash_
+      || header.path_size_ != key.size()
+      || sizeof(FileHeader) + header.path_size_ > map_size_
+      || memcmp(map_ + sizeof(FileHeader), key.data(), key.size()) != 0) {
+    return;
+  }
+
+  uint64_t table = entries_offset(header.path_size_);
+  if (table > map_size_ || header.num_entries_ > (map_size_ - table) / sizeof(Entry)) {
+    return;
+  }
+
+  auto entries = reinterpret_cast<const Entry*>(map_ + table);
+  for (uint64_t i = 0; i < header.num_entries_; i++) {
+    auto& entry = entries[i];
+    if (entry.data_offset_ > map_size_ || entry.data_size_ > map_size_ - entry.data_offset_) {
+      return;
+    }
+  }
+
+  entries_ = entries;
+  num_entries_ = header.num_entries_;
+}
+
+MetadataCache::~MetadataCache() {
+  if (map_ != nullptr) {
+    munmap(const_cast<uint8_t*>(map_), map_size_);
+  }
+}
+
+const MetadataCache::Entry*
+MetadataCache::find(uint64_t tile_offset) const {
+  if (entries_ == nullptr) {
+    return nullptr;
+  }
+
+  auto end = entries_ + num_entries_;
+  auto iter = std::lower_bound(entries_, end, tile_offset, [](const Entry& entry, uint64_t offset) {
+    return entry.tile_offset_ < offset;
+  });
+
+  if (iter == end || iter->tile_offset_ != tile_offset) {
+    return nullptr;
+  }
+
+  return iter;
+}
+
+Tile
+MetadataCache::load(const Entry& entry, std::pmr::memory_resource* mr) const {
+  // Nothing is copied, so this only counts the bytes. Their page faults
+  // land in whichever phase first reads them.
+  PhaseTimer timer(PHASE_CACHE);
+  timer.add_bytes(entry.data_size_, 0);
+
+  Tile tile(entry.version_, entry.datatype_, entry.cell_size_, 0, mr);
+  tile.disk_size_ = entry.disk_size_;
+  tile.view_ = map_ + entry.data_offset_;
+  tile.view_size_ = entry.data_size_;
+  return tile;
+}
+
+void
+MetadataCache::save(
+    const std::string& dir,
+    Reader& reader,
+    const Footer& footer,
+    const std::vector<std::pair<uint64_t, const Tile*>>& tiles) {
+  auto key = absolute_path(reader.filename_);
+  auto path = cache_file(dir, key);
+
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+
+  // A cache that can't be written only costs a slower next run, so
+  // failures here are reported but never fatal.
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Error creating cache file '%s': %s\n", tmp.c_str(), strerror(errno));
+    return;
+  }
+
+  // mkstemp creates the file private to its owner.
+  (void)fchmod(fd, 0644);
+
+  FILE* out = fdopen(fd, "w");
+  if (out == nullptr) {
+    ::close(fd);
+    unlink(tmp.c_str());
+    return;
+  }
+
+  auto sorted = tiles;
+  std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.first < b.first; });
+  sorted.erase(
+      std::unique(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.first == b.first; }),
+      sorted.end());
+
+  FileHeader header;
+  header.magic_ = CACHE_MAGIC;
+  header.version_ = METADATA_CACHE_VERSION;
+  header.file_size_ = reader.file_size_;
+  header.mtime_ns_ = reader.mtime_ns_;
+  header.footer_hash_ = footer.footer_hash_;
+  header.num_entries_ = sorted.size();
+  header.path_size_ = key.size();
+
+  uint64_t table = entries_offset(key.size());
+  uint64_t pos = table + sorted.size() * sizeof(Entry);
+
+  std::vector<Entry> entries(sorted.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    auto& tile = *sorted[i].second;
+    auto& entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    entry.tile_offset_ = sorted[i].first;
+    entry.disk_size_ = tile.disk_size_;
+    entry.data_offset_ = align(pos, METADATA_CACHE_ALIGNMENT);
+    entry.data_size_ = tile.size();
+    entry.cell_size_ = tile.cell_size_;
+    entry.version_ = tile.version_;
+    entry.datatype_ = tile.datatype_;
+    pos = entry.data_offset_ + entry.data_size_;
+  }
+
+  static const uint8_t zeros[METADATA_CACHE_ALIGNMENT] = {};
+  uint64_t written = 0;
+  auto write = [&](const void* data, uint64_t nbytes) {
+    fwrite(data, 1, nbytes, out);
+    written += nbytes;
+  };
+  auto pad_to = [&](uint64_t offset) {
+    while (written < offset) {
+      write(zeros, std::min<uint64_t>(offset - written, sizeof(zeros)));
+    }
+  };
+
+  write(&header, sizeof(header));
+  write(key.data(), key.size());
+  pad_to(table);
+  write(entries.data(), entries.size() * sizeof(Entry));
+  for (size_t i = 0; i < sorted.size(); i++) {
+    pad_to(entries[i].data_offset_);
+    write(sorted[i].second->data(), entries[i].data_size_);
+  }
+
+  bool failed = ferror(out) != 0;
+  if (fclose(out) != 0 || failed) {
+    fprintf(stderr, "Error writing cache file '%s'\n", tmp.c_str());
+    unlink(tmp.c_str());
+    return;
+  }
+
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Error renaming cache file to '%s': %s\n", path.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+  }
+}
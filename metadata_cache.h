@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "tile.h"
+
+struct Footer;
+struct Reader;
+
+// Bumped whenever the cache file layout changes. Files written with any
+// other version are ignored and rewritten.
+#define METADATA_CACHE_VERSION 1
+
+// Decoded tile data in a cache file starts on this boundary so it can be
+// viewed as any fixed size type straight from the mapping.
+#define METADATA_CACHE_ALIGNMENT 64
+
+// 64 bit FNV-1a.
+uint64_t hash_bytes(const uint8_t* data, size_t nbytes, uint64_t seed = 0xcbf29ce484222325ULL);
+
+// The decoded generic tiles of one fragment metadata file, saved under a
+// cache directory so later runs can skip reading and unfiltering them.
+// Fragments are immutable once written, so an entry stays valid for as
+// long as the file's path, size, modification time and footer hash all
+// match the ones it was written for.
+//
+// A cache file is a header, a table of entries sorted by tile offset and
+// then each tile's unfiltered bytes, uncompressed and aligned. Opening one
+// maps it read only, and cached tiles are served straight from the mapping.
+struct MetadataCache {
+  struct Entry {
+    uint64_t tile_offset_;
+    uint64_t disk_size_;
+    uint64_t data_offset_;
+    uint64_t data_size_;
+    uint64_t cell_size_;
+    uint32_t version_;
+    uint8_t datatype_;
+    uint8_t padding_[3];
+  };
+
+  // Map the cache file for the fragment read by reader, if there is a
+  // current one. valid() is false when it's missing or stale.
+  MetadataCache(const std::string& dir, Reader& reader, const Footer& footer);
+  ~MetadataCache();
+
+  MetadataCache(const MetadataCache&) = delete;
+  MetadataCache& operator=(const MetadataCache&) = delete;
+
+  bool valid() const {
+    return entries_ != nullptr;
+  }
+
+  // The cached tile at tile_offset in the fragment, or nullptr.
+  const Entry* find(uint64_t tile_offset) const;
+
+  // A tile that views the cached bytes in the mapping, so the cache must
+  // outlive it. mr is only used if the tile is later copied.
+  Tile load(const Entry& entry, std::pmr::memory_resource* mr) const;
+
+  // Write the cache file for the fragment read by reader. tiles are the
+  // decoded tiles keyed by their offset in the fragment. The file is
+  // written under a temporary name and renamed into place, so concurrent
+  // readers never see a partial file.
+  static void save(
+      const std::string& dir,
+      Reader& reader,
+      const Footer& footer,
+      const std::vector<std::pair<uint64_t, const Tile*>>& tiles);
+
+  std::string path_;
+
+ private:
+  const uint8_t* map_;
+  uint64_t map_size_;
+  const Entry* entries_;
+  uint64_t num_entries_;
+};
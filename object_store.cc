@@ -0,0 +1,902 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+#include "instrument.h"
+#include "object_store.h"
+#include "thread_pool.h"
+
+// Attempts at a request before a connection failure or a 5xx is an error.
+#define HTTP_MAX_ATTEMPTS 4
+
+// Delay before the first retry, doubled for each one after.
+#define HTTP_RETRY_DELAY_MS 100
+
+#define HTTP_TIMEOUT_SECONDS 30
+
+// Response heads larger than this are rejected.
+#define HTTP_MAX_HEAD (64 * 1024)
+
+namespace {
+
+std::atomic<uint32_t> mock_latency_ms{0};
+std::atomic<uint32_t> mock_fail_every{0};
+std::atomic<uint64_t> mock_requests{0};
+
+std::atomic<uint64_t> num_gets{0};
+std::atomic<uint64_t> num_bytes_fetched{0};
+std::atomic<uint64_t> num_hits{0};
+std::atomic<uint64_t> num_misses{0};
+std::atomic<uint64_t> num_evictions{0};
+
+bool
+starts_with(const std::string& str, const char* prefix) {
+  return str.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// The s3:// endpoint, following the AWS CLI's variables.
+std::string
+s3_endpoint() {
+  for (auto var : {"AWS_ENDPOINT_URL_S3", "AWS_ENDPOINT_URL"}) {
+    auto value = getenv(var);
+    if (value != nullptr && value[0] != '\0') {
+      std::string ret = value;
+      while (!ret.empty() && ret.back() == '/') {
+        ret.pop_back();
+      }
+      return ret;
+    }
+  }
+
+  return "http://s3.amazonaws.com";
+}
+
+// A connection and any bytes received past the response head.
+struct Connection {
+  int fd_ = -1;
+  std::string pending_;
+
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    fd_ = -1;
+    pending_.clear();
+  }
+};
+
+struct Response {
+  int status_ = 0;
+  bool has_length_ = false;
+  uint64_t content_length_ = 0;
+  bool close_ = false;
+  std::string last_modified_;
+};
+
+// Keep-alive connections not currently in use, by host and port, so
+// every object on an endpoint shares them.
+std::mutex idle_mtx;
+std::map<std::string, std::vector<int>> idle_connections;
+
+int
+connect_to(const std::string& host, const std::string& port) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addrs = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (auto addr = addrs; addr != nullptr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+
+    timeval timeout = {HTTP_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      break;
+    }
+
+    ::close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+bool
+send_all(int fd, const void* data, size_t nbytes) {
+  auto bytes = static_cast<const uint8_t*>(data);
+  size_t pos = 0;
+  while (pos < nbytes) {
+    auto nsent = send(fd, bytes + pos, nbytes - pos, MSG_NOSIGNAL);
+    if (nsent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nsent <= 0) {
+      return false;
+    }
+    pos += nsent;
+  }
+  return true;
+}
+
+bool
+recv_some(Connection& conn) {
+  char buf[16 * 1024];
+  while (true) {
+    auto nread = recv(conn.fd_, buf, sizeof(buf), 0);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      return false;
+    }
+    conn.pending_.append(buf, nread);
+    return true;
+  }
+}
+
+bool
+read_head(Connection& conn, Response& resp) {
+  size_t end;
+  while ((end = conn.pending_.find("\r\n\r\n")) == std::string::npos) {
+    if (conn.pending_.size() > HTTP_MAX_HEAD || !recv_some(conn)) {
+      return false;
+    }
+  }
+
+  std::string head = conn.pending_.substr(0, end + 2);
+  conn.pending_.erase(0, end + 4);
+
+  int minor = 0;
+  if (sscanf(head.c_str(), "HTTP/1.%d %d", &minor, &resp.status_) != 2) {
+    return false;
+  }
+  resp.close_ = minor == 0;
+
+  size_t pos = head.find("\r\n") + 2;
+  while (pos < head.size()) {
+    auto eol = head.find("\r\n", pos);
+    auto line = head.substr(pos, eol - pos);
+    pos = eol + 2;
+
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+
+    auto name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    auto start = line.find_first_not_of(" \t", colon + 1);
+    auto value = start == std::string::npos ? std::string() : line.substr(start);
+
+    if (name == "content-length") {
+      resp.has_length_ = true;
+      resp.content_length_ = strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "connection") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      resp.close_ = value.find("close") != std::string::npos;
+    } else if (name == "transfer-encoding") {
+      // Range responses carry a length; anything else can't be reused.
+      resp.has_length_ = false;
+      resp.close_ = true;
+    } else if (name == "last-modified") {
+      resp.last_modified_ = value;
+    }
+  }
+
+  return true;
+}
+
+bool
+read_body(Connection& conn, uint8_t* buf, size_t nbytes) {
+  size_t pos = std::min(nbytes, conn.pending_.size());
+  memcpy(buf, conn.pending_.data(), pos);
+  conn.pending_.erase(0, pos);
+
+  while (pos < nbytes) {
+    auto nread = recv(conn.fd_, buf + pos, nbytes - pos, 0);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      return false;
+    }
+    pos += nread;
+  }
+
+  return true;
+}
+
+int64_t
+parse_http_date(const std::string& value) {
+  struct tm tm = {};
+  if (strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm) == nullptr) {
+    return 0;
+  }
+  return (int64_t)timegm(&tm) * 1000000000;
+}
+
+// Ranged GETs over plain HTTP/1.1 with keep-alive connections. Requests
+// that fail to connect or get a 5xx or 429 are retried with backoff.
+struct HttpSource : public RangeSource {
+  HttpSource(const std::string& url)
+      : url_(url) {
+    auto rest = url.substr(strlen("http://"));
+    auto slash = rest.find('/');
+    auto authority = rest.substr(0, slash);
+    path_ = slash == std::string::npos ? "/" : rest.substr(slash);
+
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+      host_ = authority.substr(0, colon);
+      port_ = authority.substr(colon + 1);
+    } else {
+      host_ = authority;
+      port_ = "80";
+    }
+    if (host_.size() > 2 && host_.front() == '[' && host_.back() == ']') {
+      host_ = host_.substr(1, host_.size() - 2);
+    }
+
+    key_ = host_ + ":" + port_;
+    host_header_ = authority;
+  }
+
+  const char* name() const override {
+    return "http";
+  }
+
+  bool stat(uint64_t& size, int64_t& mtime_ns) override {
+    Response resp;
+    Connection conn;
+    if (!request("HEAD", "", conn, resp)) {
+      return false;
+    }
+
+    if (!resp.has_length_) {
+      conn.close();
+      throw std::runtime_error("Error opening '" + url_ + "': no Content-Length in HEAD response");
+    }
+
+    finish(conn, resp);
+    size = resp.content_length_;
+    mtime_ns = parse_http_date(resp.last_modified_);
+    return true;
+  }
+
+  void get(uint64_t offset, size_t nbytes, uint8_t* buf) override {
+    char range[64];
+    snprintf(range, sizeof(range), "Range: bytes=%llu-%llu\r\n",
+        (unsigned long long)offset, (unsigned long long)(offset + nbytes - 1));
+
+    for (int attempt = 1; ; attempt++) {
+      Response resp;
+      Connection conn;
+      if (!request("GET", range, conn, resp)) {
+        throw std::runtime_error("Error fetching '" + url_ + "': not found");
+      }
+
+      if (resp.status_ != 206 || !resp.has_length_ || resp.content_length_ != nbytes) {
+        conn.close();
+        throw std::runtime_error(
+            "Error fetching " + std::to_string(nbytes) + " bytes at " + std::to_string(offset)
+            + " of '" + url_ + "': HTTP " + std::to_string(resp.status_) + " with "
+            + std::to_string(resp.content_length_) + " bytes");
+      }
+
+      if (read_body(conn, buf, nbytes)) {
+        finish(conn, resp);
+        return;
+      }
+
+      conn.close();
+      backoff(attempt, "the connection was lost");
+    }
+  }
+
+ private:
+  // Send a request and read the response head, retrying transient
+  // failures. Returns false for 404 and 403, which S3 answers for missing
+  // keys without list permission, and throws for other errors.
+  bool request(const char* method, const char* headers, Connection& conn, Response& resp) {
+    std::string req = std::string(method) + " " + path_ + " HTTP/1.1\r\n"
+        + "Host: " + host_header_ + "\r\n"
+        + "User-Agent: fmd_dissector\r\n"
+        + headers + "\r\n";
+
+    for (int attempt = 1; ; attempt++) {
+      conn.fd_ = checkout();
+      if (conn.fd_ >= 0 && send_all(conn.fd_, req.data(), req.size()) && read_head(conn, resp)) {
+        if (resp.status_ == 404 || resp.status_ == 403) {
+          conn.close();
+          return false;
+        }
+
+        if (resp.status_ < 500 && resp.status_ != 429) {
+          if (resp.status_ >= 300) {
+            conn.close();
+            throw std::runtime_error(
+                "Error requesting '" + url_ + "': HTTP " + std::to_string(resp.status_));
+          }
+          return true;
+        }
+      }
+
+      auto status = resp.status_;
+      conn.close();
+      resp = Response();
+      backoff(attempt, status == 0 ? "connection failed" : "server busy");
+    }
+  }
+
+  void backoff(int attempt, const char* reason) {
+    if (attempt >= HTTP_MAX_ATTEMPTS) {
+      throw std::runtime_error(
+          "Error requesting '" + url_ + "': " + reason + " after " + std::to_string(attempt) + " attempts");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(HTTP_RETRY_DELAY_MS << (attempt - 1)));
+  }
+
+  int checkout() {
+    {
+      std::lock_guard<std::mutex> lock(idle_mtx);
+      auto& idle = idle_connections[key_];
+      if (!idle.empty()) {
+        auto fd = idle.back();
+        idle.pop_back();
+        return fd;
+      }
+    }
+    return connect_to(host_, port_);
+  }
+
+  // Return a connection whose response has been fully read to the pool.
+  void finish(Connection& conn, const Response& resp) {
+    if (resp.close_ || !conn.pending_.empty()) {
+      conn.close();
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(idle_mtx);
+    idle_connections[key_].push_back(conn.fd_);
+    conn.fd_ = -1;
+  }
+
+  std::string url_;
+  std::string host_;
+  std::string port_;
+  std::string host_header_;
+  std::string path_;
+  std::string key_;
+};
+
+// Percent encode everything in a path but unreserved characters and '/'.
+std::string
+url_encode(const std::string& path) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string ret;
+  for (unsigned char c : path) {
+    if (isalnum(c) || strchr("/-._~", c) != nullptr) {
+      ret += c;
+    } else {
+      ret += '%';
+      ret += hex[c >> 4];
+      ret += hex[c & 15];
+    }
+  }
+  return ret;
+}
+
+std::string
+url_decode(const std::string& path) {
+  std::string ret;
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] == '%' && i + 2 < path.size() && isxdigit(path[i + 1]) && isxdigit(path[i + 2])) {
+      ret += (char)strtol(path.substr(i + 1, 2).c_str(), nullptr, 16);
+      i += 2;
+    } else {
+      ret += path[i];
+    }
+  }
+  return ret;
+}
+
+std::string
+http_date(time_t sec) {
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  char buf[64];
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+// A loopback HTTP/1.1 server for mock:// URLs, so they're fetched by
+// HttpSource exactly like a remote object, keep-alive and retries
+// included. The URL path is the local file's absolute path. Each
+// connection gets its own thread. The server is started on first use and
+// runs until the process exits.
+struct MockServer {
+  MockServer() {
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd_ < 0
+        || bind(fd_, (sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(fd_, SOMAXCONN) != 0
+        || getsockname(fd_, (sockaddr*)&addr, &len) != 0) {
+      throw std::runtime_error(std::string("Error starting the mock object store: ") + strerror(errno));
+    }
+
+    endpoint_ = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    std::thread([this]() { accept_loop(); }).detach();
+  }
+
+  void accept_loop() {
+    while (true) {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+          continue;
+        }
+        return;
+      }
+
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      std::thread([fd]() {
+        Connection conn;
+        conn.fd_ = fd;
+        while (serve(conn)) {
+        }
+        conn.close();
+      }).detach();
+    }
+  }
+
+  // Answer one request. Returns false once the connection should close.
+  static bool serve(Connection& conn) {
+    size_t end;
+    while ((end = conn.pending_.find("\r\n\r\n")) == std::string::npos) {
+      if (conn.pending_.size() > HTTP_MAX_HEAD || !recv_some(conn)) {
+        return false;
+      }
+    }
+
+    std::string head = conn.pending_.substr(0, end + 2);
+    conn.pending_.erase(0, end + 4);
+
+    char method[16];
+    char target[4096];
+    if (sscanf(head.c_str(), "%15s %4095s HTTP/1.1", method, target) != 2) {
+      return false;
+    }
+
+    bool has_range = false;
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    auto range = head.find("\r\nRange: bytes=");
+    if (range != std::string::npos) {
+      has_range = sscanf(head.c_str() + range, "\r\nRange: bytes=%llu-%llu", &first, &last) == 2;
+    }
+
+    auto latency = mock_latency_ms.load();
+    if (latency > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+    }
+
+    // Every Nth request fails, alternately with a 503 and by dropping the
+    // connection partway through the response.
+    auto every = mock_fail_every.load();
+    auto nth = ++mock_requests;
+    bool fail = every > 0 && nth % every == 0;
+    if (fail && (nth / every) % 2 == 1) {
+      return respond(conn.fd_, "503 Service Unavailable", "", nullptr, 0);
+    }
+
+    bool head_only = strcmp(method, "HEAD") == 0;
+    if (!head_only && strcmp(method, "GET") != 0) {
+      respond(conn.fd_, "405 Method Not Allowed", "", nullptr, 0);
+      return false;
+    }
+
+    int fd = ::open(url_decode(target).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return respond(conn.fd_, "404 Not Found", "", nullptr, 0);
+    }
+
+    uint64_t size = st.st_size;
+    std::string headers = "Last-Modified: " + http_date(st.st_mtim.tv_sec) + "\r\n";
+    const char* status = "200 OK";
+    if (has_range) {
+      if (first > last || first >= size) {
+        ::close(fd);
+        return respond(conn.fd_, "416 Range Not Satisfiable", "", nullptr, 0);
+      }
+      last = std::min<uint64_t>(last, size - 1);
+      status = "206 Partial Content";
+      headers += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last)
+          + "/" + std::to_string(size) + "\r\n";
+    } else {
+      first = 0;
+      last = size - 1;
+    }
+
+    uint64_t nbytes = size == 0 ? 0 : last - first + 1;
+    if (head_only) {
+      ::close(fd);
+      return respond(conn.fd_, status, headers, nullptr, 0, size);
+    }
+
+    std::vector<uint8_t> body(nbytes);
+    size_t pos = 0;
+    while (pos < nbytes) {
+      auto nread = pread(fd, body.data() + pos, nbytes - pos, first + pos);
+      if (nread < 0 && errno == EINTR) {
+        continue;
+      }
+      if (nread <= 0) {
+        break;
+      }
+      pos += nread;
+    }
+    ::close(fd);
+
+    if (pos < nbytes) {
+      respond(conn.fd_, "500 Internal Server Error", "", nullptr, 0);
+      return false;
+    }
+
+    if (fail) {
+      respond(conn.fd_, status, headers, body.data(), nbytes / 2, nbytes);
+      return false;
+    }
+
+    return respond(conn.fd_, status, headers, body.data(), nbytes, nbytes);
+  }
+
+  // Send a response head and nbytes of body. length is the Content-Length
+  // sent, which for HEAD or a dropped connection differs from nbytes.
+  static bool respond(
+      int fd, const char* status, const std::string& headers, const uint8_t* body, size_t nbytes,
+      uint64_t length = 0) {
+    std::string head = std::string("HTTP/1.1 ") + status + "\r\n"
+        + "Content-Length: " + std::to_string(length) + "\r\n"
+        + headers + "\r\n";
+    return send_all(fd, head.data(), head.size()) && send_all(fd, body, nbytes);
+  }
+
+  int fd_;
+  std::string endpoint_;
+};
+
+MockServer&
+mock_server() {
+  // Never destroyed, since its threads outlive static destructors.
+  static MockServer* server = new MockServer();
+  return *server;
+}
+
+typedef std::vector<uint8_t> Block;
+
+// Blocks of every remote object, least recently used first out. Objects
+// get an id per URL, size and modification time, so a changed object
+// never serves stale blocks.
+struct BlockCache {
+  typedef std::pair<uint64_t, uint64_t> Key;
+
+  struct Entry {
+    std::shared_ptr<const Block> block_;
+    std::list<Key>::iterator lru_;
+  };
+
+  uint64_t id(const std::string& url, uint64_t size, int64_t mtime_ns) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto key = std::make_tuple(url, size, mtime_ns);
+    auto iter = ids_.find(key);
+    if (iter == ids_.end()) {
+      iter = ids_.emplace(key, ids_.size()).first;
+    }
+    return iter->second;
+  }
+
+  std::shared_ptr<const Block> find(const Key& key) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = entries_.find(key);
+    if (iter == entries_.end()) {
+      num_misses++;
+      return nullptr;
+    }
+
+    num_hits++;
+    lru_.splice(lru_.end(), lru_, iter->second.lru_);
+    return iter->second.block_;
+  }
+
+  void insert(const Key& key, std::shared_ptr<const Block> block) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (block->size() > capacity_ || entries_.count(key) > 0) {
+      return;
+    }
+
+    size_ += block->size();
+    lru_.push_back(key);
+    entries_[key] = {std::move(block), std::prev(lru_.end())};
+
+    while (size_ > capacity_) {
+      auto victim = entries_.find(lru_.front());
+      size_ -= victim->second.block_->size();
+      entries_.erase(victim);
+      lru_.pop_front();
+      num_evictions++;
+    }
+  }
+
+  void resize(uint64_t capacity) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    capacity_ = capacity;
+  }
+
+  std::mutex mtx_;
+  uint64_t capacity_ = DEFAULT_BLOCK_CACHE_SIZE;
+  uint64_t size_ = 0;
+  std::map<std::tuple<std::string, uint64_t, int64_t>, uint64_t> ids_;
+  std::map<Key, Entry> entries_;
+  std::list<Key> lru_;
+};
+
+BlockCache&
+block_cache() {
+  static BlockCache cache;
+  return cache;
+}
+
+}  // namespace
+
+bool
+is_remote_path(const std::string& path) {
+  return starts_with(path, "http://")
+      || starts_with(path, "https://")
+      || starts_with(path, "s3://")
+      || starts_with(path, "mock://");
+}
+
+bool
+remote_exists(const std::string& url) {
+  // Walking up from an object can leave the URL's scheme and host behind.
+  if (!is_remote_path(url)) {
+    return false;
+  }
+
+  uint64_t size;
+  int64_t mtime_ns;
+  return make_range_source(url)->stat(size, mtime_ns);
+}
+
+std::unique_ptr<RangeSource>
+make_range_source(const std::string& url) {
+  auto http = url;
+  if (starts_with(url, "mock://")) {
+    std::error_code ec;
+    auto path = std::filesystem::absolute(url.substr(strlen("mock://")), ec).lexically_normal();
+    http = mock_server().endpoint_ + url_encode(path.string());
+  } else if (starts_with(url, "s3://")) {
+    http = s3_endpoint() + "/" + url.substr(strlen("s3://"));
+  }
+
+  if (!starts_with(http, "http://")) {
+    throw std::runtime_error("Error opening '" + url + "': only http:// endpoints are supported");
+  }
+
+  return std::make_unique<HttpSource>(http);
+}
+
+void
+set_mock_latency(uint32_t ms) {
+  mock_latency_ms = ms;
+}
+
+void
+set_mock_failures(uint32_t every) {
+  mock_fail_every = every;
+}
+
+void
+set_block_cache_size(uint64_t nbytes) {
+  block_cache().resize(nbytes);
+}
+
+BlockCacheStats
+block_cache_stats() {
+  BlockCacheStats stats;
+  stats.gets_ = num_gets;
+  stats.bytes_fetched_ = num_bytes_fetched;
+  stats.hits_ = num_hits;
+  stats.misses_ = num_misses;
+  stats.evictions_ = num_evictions;
+  return stats;
+}
+
+RemoteFile::RemoteFile(const std::string& url)
+    : url_(url)
+    , source_(make_range_source(url)) {
+  if (!source_->stat(size_, mtime_ns_)) {
+    throw std::runtime_error("Error opening '" + url + "': not found");
+  }
+
+  id_ = block_cache().id(url, size_, mtime_ns_);
+}
+
+void
+RemoteFile::read(uint8_t* buf, size_t nbytes, uint64_t offset) {
+  read({{offset, nbytes, buf}}, nullptr, [](size_t) {});
+}
+
+void
+RemoteFile::read(const std::vector<ReadRequest>& requests, ThreadPool* pool, const ReadCallback& done) {
+  auto& cache = block_cache();
+
+  // Blocks past the end would be fetched as negative lengths.
+  for (auto& request : requests) {
+    if (request.offset_ > size_ || request.nbytes_ > size_ - request.offset_) {
+      throw std::runtime_error(
+          "Error fetching '" + url_ + "': " + std::to_string(request.nbytes_) + " bytes at offset "
+          + std::to_string(request.offset_) + " is past the end of the object ("
+          + std::to_string(size_) + " bytes)");
+    }
+  }
+
+  // Every block the requests touch, filled from the cache where possible.
+  // The map isn't changed once the fetches start, so they can fill in
+  // their own blocks without a lock.
+  std::map<uint64_t, std::shared_ptr<const Block>> blocks;
+  for (auto& request : requests) {
+    if (request.nbytes_ == 0) {
+      continue;
+    }
+    auto last = (request.offset_ + request.nbytes_ - 1) / REMOTE_BLOCK_SIZE;
+    for (auto block = request.offset_ / REMOTE_BLOCK_SIZE; block <= last; block++) {
+      blocks.emplace(block, nullptr);
+    }
+  }
+
+  // Runs of adjacent missing blocks, as [first, last] block numbers.
+  std::vector<std::pair<uint64_t, uint64_t>> runs;
+  std::map<uint64_t, size_t> run_of;
+  uint64_t max_blocks = REMOTE_MAX_GET / REMOTE_BLOCK_SIZE;
+  for (auto& entry : blocks) {
+    entry.second = cache.find({id_, entry.first});
+    if (entry.second != nullptr) {
+      continue;
+    }
+
+    if (runs.empty() || runs.back().second + 1 != entry.first
+        || runs.back().second - runs.back().first + 1 >= max_blocks) {
+      runs.emplace_back(entry.first, entry.first);
+    } else {
+      runs.back().second = entry.first;
+    }
+    run_of[entry.first] = runs.size() - 1;
+  }
+
+  // Each request waits for the runs that cover its missing blocks.
+  std::vector<std::vector<size_t>> run_requests(runs.size());
+  std::unique_ptr<std::atomic<size_t>[]> waiting(new std::atomic<size_t>[requests.size()]);
+  for (size_t i = 0; i < requests.size(); i++) {
+    auto& request = requests[i];
+    size_t nruns = 0;
+    if (request.nbytes_ > 0) {
+      auto last = (request.offset_ + request.nbytes_ - 1) / REMOTE_BLOCK_SIZE;
+      size_t prev = SIZE_MAX;
+      for (auto block = request.offset_ / REMOTE_BLOCK_SIZE; block <= last; block++) {
+        auto iter = run_of.find(block);
+        if (iter != run_of.end() && iter->second != prev) {
+          prev = iter->second;
+          run_requests[prev].push_back(i);
+          nruns++;
+        }
+      }
+    }
+    waiting[i] = nruns;
+  }
+
+  auto finish = [&](size_t i) {
+    auto& request = requests[i];
+    uint64_t pos = 0;
+    while (pos < request.nbytes_) {
+      auto offset = request.offset_ + pos;
+      auto& block = blocks.at(offset / REMOTE_BLOCK_SIZE);
+      auto start = offset % REMOTE_BLOCK_SIZE;
+      auto nbytes = std::min<uint64_t>(request.nbytes_ - pos, block->size() - start);
+      memcpy(request.buf_ + pos, block->data() + start, nbytes);
+      pos += nbytes;
+    }
+    done(i);
+  };
+
+  for (size_t i = 0; i < requests.size(); i++) {
+    if (waiting[i] == 0) {
+      finish(i);
+    }
+  }
+
+  auto fetch = [&](size_t idx) {
+    auto& run = runs[idx];
+    auto offset = run.first * REMOTE_BLOCK_SIZE;
+    auto end = std::min<uint64_t>((run.second + 1) * REMOTE_BLOCK_SIZE, size_);
+    Block data(end - offset);
+    {
+      PhaseTimer timer(PHASE_READ);
+      timer.add_bytes(data.size(), 0);
+      timer.add_syscall();
+      source_->get(offset, data.size(), data.data());
+    }
+    num_gets++;
+    num_bytes_fetched += data.size();
+
+    for (auto block = run.first; block <= run.second; block++) {
+      auto start = (block - run.first) * REMOTE_BLOCK_SIZE;
+      auto nbytes = std::min<uint64_t>(REMOTE_BLOCK_SIZE, data.size() - start);
+      auto copy = std::make_shared<const Block>(data.begin() + start, data.begin() + start + nbytes);
+      cache.insert({id_, block}, copy);
+      blocks.at(block) = std::move(copy);
+    }
+
+    for (auto i : run_requests[idx]) {
+      if (waiting[i].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        finish(i);
+      }
+    }
+  };
+
+  if (pool == nullptr || runs.size() == 1) {
+    for (size_t i = 0; i < runs.size(); i++) {
+      fetch(i);
+    }
+    return;
+  }
+
+  TaskGroup group;
+  for (size_t i = 0; i < runs.size(); i++) {
+    pool->submit(group, [&, i]() { fetch(i); });
+  }
+  pool->wait(group);
+}
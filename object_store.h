@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "read_backend.h"
+
+struct ThreadPool;
+
+// Remote objects are fetched and cached in aligned blocks of this size, so
+// the footer of a small fragment metadata file and the tiles in front of
+// it usually arrive with a single GET.
+#define REMOTE_BLOCK_SIZE (1024 * 1024)
+
+// No GET spans more than this many bytes. Longer runs of missing blocks
+// are split so their pieces can be fetched in parallel.
+#define REMOTE_MAX_GET (8 * 1024 * 1024)
+
+// Bytes of blocks kept across all remote objects by default.
+#define DEFAULT_BLOCK_CACHE_SIZE (256 * 1024 * 1024)
+
+// True for paths that are read with ranged GETs rather than from the local
+// filesystem:
+//
+//   http://HOST[:PORT]/PATH  any server that honors Range requests
+//   s3://BUCKET/KEY          path style on $AWS_ENDPOINT_URL_S3,
+//                            $AWS_ENDPOINT_URL or s3.amazonaws.com
+//   mock://PATH              the local file PATH, served over HTTP from
+//                            a loopback server for testing
+bool is_remote_path(const std::string& path);
+
+// Whether a remote object exists, for probing schema locations.
+bool remote_exists(const std::string& url);
+
+// A store that serves byte ranges of one object.
+//
+// stat returns false if the object doesn't exist. get fills buf with
+// exactly nbytes at offset using a single request. Any other failure
+// throws std::runtime_error, as a failed pread does for local files. Both
+// may be called from several threads at once.
+struct RangeSource {
+  virtual ~RangeSource() {}
+
+  virtual const char* name() const = 0;
+  virtual bool stat(uint64_t& size, int64_t& mtime_ns) = 0;
+  virtual void get(uint64_t offset, size_t nbytes, uint8_t* buf) = 0;
+};
+
+std::unique_ptr<RangeSource> make_range_source(const std::string& url);
+
+// Have the mock:// server sleep this long before serving each request, to
+// stand in for an object store's latency.
+void set_mock_latency(uint32_t ms);
+
+// Have the mock:// server fail every Nth request, alternately with a 503
+// and by dropping the connection partway through the body, to exercise
+// retries. 0 disables failures.
+void set_mock_failures(uint32_t every);
+
+// Bytes of blocks the shared block cache keeps before evicting the least
+// recently used ones. 0 disables caching between reads.
+void set_block_cache_size(uint64_t nbytes);
+
+struct BlockCacheStats {
+  uint64_t gets_;
+  uint64_t bytes_fetched_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+};
+
+BlockCacheStats block_cache_stats();
+
+// A remote object read through the shared block cache.
+//
+// Each read is split into blocks. Cached blocks are copied out and the
+// missing ones are coalesced into runs of adjacent blocks, each fetched
+// with one GET. Blocks are cached per URL, size and modification time, so
+// several readers of the same object share them.
+struct RemoteFile {
+  explicit RemoteFile(const std::string& url);
+
+  RemoteFile(const RemoteFile&) = delete;
+  RemoteFile& operator=(const RemoteFile&) = delete;
+
+  void read(uint8_t* buf, size_t nbytes, uint64_t offset);
+
+  // Fill every request like ReadBackend::read. The runs missing from the
+  // cache are fetched in parallel on pool when given, and each request is
+  // done as soon as the runs it needs have arrived.
+  void read(const std::vector<ReadRequest>& requests, ThreadPool* pool, const ReadCallback& done);
+
+  std::string url_;
+  uint64_t size_;
+  int64_t mtime_ns_;
+
+ private:
+  std::unique_ptr<RangeSource> source_;
+  uint64_t id_;
+};
@@ -0,0 +1,424 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "instrument.h"
+#include "read_backend.h"
+#include "thread_pool.h"
+
+namespace {
+
+std::atomic<ReadBackend*> selected_read_backend{nullptr};
+
+// Read one request in full with as many preads as it takes.
+void
+pread_request(int fd, const ReadRequest& request) {
+  PhaseTimer timer(PHASE_READ);
+  timer.add_bytes(request.nbytes_, 0);
+
+  size_t pos = 0;
+  while (pos < request.nbytes_) {
+    auto nread = pread(fd, request.buf_ + pos, request.nbytes_ - pos, request.offset_ + pos);
+    timer.add_syscall();
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (nread < 0) {
+      throw std::runtime_error(std::string("Error in pread: ") + strerror(errno));
+    }
+
+    if (nread == 0) {
+      throw std::runtime_error(
+          "Read failed: Expected " + std::to_string(request.nbytes_) + " bytes, "
+          "but read " + std::to_string(pos) + " bytes");
+    }
+
+    pos += nread;
+  }
+}
+
+// One pread after another on the calling thread.
+struct PreadBackend : public ReadBackend {
+  const char* name() const override {
+    return "pread";
+  }
+
+  void read(int fd, const std::vector<ReadRequest>& requests, ThreadPool*, const ReadCallback& done) override {
+    for (size_t i = 0; i < requests.size(); i++) {
+      pread_request(fd, requests[i]);
+      done(i);
+    }
+  }
+};
+
+// Each request is a blocking pread on the pool, so the pool's size bounds
+// the reads in flight. Without a pool this is PreadBackend.
+struct ThreadsBackend : public ReadBackend {
+  const char* name() const override {
+    return "threads";
+  }
+
+  void read(int fd, const std::vector<ReadRequest>& requests, ThreadPool* pool, const ReadCallback& done) override {
+    if (pool == nullptr || requests.size() < 2) {
+      PreadBackend().read(fd, requests, pool, done);
+      return;
+    }
+
+    TaskGroup group;
+    for (size_t i = 0; i < requests.size(); i++) {
+      pool->submit(group, [&, i]() {
+        pread_request(fd, requests[i]);
+        done(i);
+      });
+    }
+    pool->wait(group);
+  }
+};
+
+#ifdef HAVE_IO_URING
+// A submission and completion queue pair driven with the raw io_uring
+// system calls. Only the thread that owns a ring touches it.
+struct Ring {
+  explicit Ring(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      return;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+    if (sq_ring_ == nullptr || cq_ring_ == nullptr || sqes_ == nullptr) {
+      release();
+      return;
+    }
+
+    entries_ = params.sq_entries;
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+  }
+
+  ~Ring() {
+    release();
+  }
+
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  bool valid() const {
+    return fd_ >= 0;
+  }
+
+  // True if the kernel implements IORING_OP_READ, which arrived after
+  // io_uring itself.
+  bool supports_read() const {
+    size_t nbytes = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<uint8_t> buf(nbytes);
+    auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+      return false;
+    }
+    return probe->ops_len > IORING_OP_READ
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  // Queue a read. The caller keeps at most entries_ reads in flight, so
+  // there is always room.
+  void queue_read(int fd, uint8_t* buf, size_t nbytes, uint64_t offset, uint64_t user_data) {
+    unsigned tail = *sq_tail_;
+    unsigned idx = tail & *sq_mask_;
+    auto& sqe = sqes_[idx];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<uint64_t>(buf);
+    sqe.len = nbytes;
+    sqe.user_data = user_data;
+    sq_array_[idx] = idx;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  // Submit to_submit queued reads and wait for at least one completion.
+  // Returns how many were submitted, or -1 with errno set on failure.
+  long enter(unsigned to_submit) {
+    while (true) {
+      auto rc = syscall(__NR_io_uring_enter, fd_, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (rc >= 0 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) {
+        return rc;
+      }
+    }
+  }
+
+  // Pop the next completion, if there is one.
+  bool reap(io_uring_cqe& cqe) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    cqe = cqes_[head & *cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  int fd_ = -1;
+  unsigned entries_ = 0;
+
+ private:
+  uint8_t* map(size_t nbytes, off_t offset) {
+    void* addr = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return addr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(addr);
+  }
+
+  void release() {
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    sqes_ = nullptr;
+    cq_ring_ = nullptr;
+    sq_ring_ = nullptr;
+    fd_ = -1;
+  }
+
+  uint8_t* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  uint8_t* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+// Keeps up to IO_URING_QUEUE_DEPTH reads in flight from a single thread
+// with one system call per batch of submissions and completions. Each
+// thread gets its own ring on first use, so concurrent files don't share
+// a queue. Threads whose ring can't be created fall back to pread.
+struct IoUringBackend : public ReadBackend {
+  const char* name() const override {
+    return "io_uring";
+  }
+
+  static bool supported() {
+    static const bool ret = []() {
+      Ring ring(1);
+      return ring.valid() && ring.supports_read();
+    }();
+    return ret;
+  }
+
+  void read(int fd, const std::vector<ReadRequest>& requests, ThreadPool* pool, const ReadCallback& done) override {
+    thread_local std::unique_ptr<Ring> ring;
+    if (!ring) {
+      ring = std::make_unique<Ring>(IO_URING_QUEUE_DEPTH);
+    }
+
+    if (!ring->valid()) {
+      PreadBackend().read(fd, requests, pool, done);
+      return;
+    }
+
+    // Short reads are resubmitted for their remaining bytes. After the
+    // first error nothing more is queued, but the reads the kernel already
+    // has are still reaped before it's rethrown since they write into
+    // requests' buffers. If io_uring_enter itself fails, completions are
+    // still posted to the ring, so they're polled for instead, and the
+    // ring is then dropped along with any reads it never submitted.
+    std::exception_ptr error;
+    bool broken = false;
+    std::vector<size_t> progress(requests.size(), 0);
+    std::vector<size_t> pending;
+    std::vector<size_t> completed;
+    size_t next = 0;
+    size_t num_done = 0;
+    unsigned in_flight = 0;
+    unsigned unsubmitted = 0;
+
+    auto queue = [&](size_t idx) {
+      auto& request = requests[idx];
+      auto pos = progress[idx];
+      ring->queue_read(fd, request.buf_ + pos, request.nbytes_ - pos, request.offset_ + pos, idx);
+      in_flight++;
+      unsubmitted++;
+    };
+
+    while ((broken ? in_flight - unsubmitted : in_flight) > 0 || (!error && num_done < requests.size())) {
+      while (!error && !pending.empty() && in_flight < ring->entries_) {
+        queue(pending.back());
+        pending.pop_back();
+      }
+      while (!error && next < requests.size() && in_flight < ring->entries_) {
+        queue(next++);
+      }
+
+      completed.clear();
+      {
+        PhaseTimer timer(PHASE_READ);
+        if (!broken) {
+          auto rc = ring->enter(unsubmitted);
+          timer.add_syscall();
+          if (rc >= 0) {
+            unsubmitted -= rc;
+          } else {
+            broken = true;
+            if (!error) {
+              error = std::make_exception_ptr(std::runtime_error(
+                  std::string("Error in io_uring_enter: ") + strerror(errno)));
+            }
+          }
+        } else {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        io_uring_cqe cqe;
+        while (ring->reap(cqe)) {
+          in_flight--;
+          size_t idx = cqe.user_data;
+          if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            pending.push_back(idx);
+            continue;
+          }
+
+          if (cqe.res < 0) {
+            if (!error) {
+              error = std::make_exception_ptr(std::runtime_error(
+                  std::string("Error in io_uring read: ") + strerror(-cqe.res)));
+            }
+            continue;
+          }
+
+          if (cqe.res == 0) {
+            if (!error) {
+              error = std::make_exception_ptr(std::runtime_error(
+                  "Read failed: Expected " + std::to_string(requests[idx].nbytes_) + " bytes, "
+                  "but read " + std::to_string(progress[idx]) + " bytes"));
+            }
+            continue;
+          }
+
+          timer.add_bytes(cqe.res, 0);
+          progress[idx] += cqe.res;
+          if (progress[idx] < requests[idx].nbytes_) {
+            pending.push_back(idx);
+          } else {
+            completed.push_back(idx);
+          }
+        }
+      }
+
+      for (auto idx : completed) {
+        if (error) {
+          break;
+        }
+
+        try {
+          done(idx);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        num_done++;
+      }
+    }
+
+    if (broken) {
+      ring.reset();
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+#endif
+
+}  // namespace
+
+std::vector<ReadBackend*>
+available_read_backends() {
+#ifdef HAVE_IO_URING
+  static IoUringBackend io_uring;
+#endif
+  static ThreadsBackend threads;
+  static PreadBackend pread_backend;
+
+  std::vector<ReadBackend*> ret;
+#ifdef HAVE_IO_URING
+  if (IoUringBackend::supported()) {
+    ret.push_back(&io_uring);
+  }
+#endif
+  ret.push_back(&threads);
+  ret.push_back(&pread_backend);
+  return ret;
+}
+
+bool
+set_read_backend(const char* name) {
+  for (auto backend : available_read_backends()) {
+    if (strcmp(backend->name(), name) == 0) {
+      selected_read_backend = backend;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+ReadBackend&
+current_read_backend() {
+  auto backend = selected_read_backend.load();
+  if (backend == nullptr) {
+    backend = available_read_backends()[0];
+    selected_read_backend = backend;
+  }
+
+  return *backend;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct ThreadPool;
+
+// Reads io_uring keeps in flight per thread.
+#define IO_URING_QUEUE_DEPTH 64
+
+// One read of nbytes at offset into buf.
+struct ReadRequest {
+  uint64_t offset_;
+  size_t nbytes_;
+  uint8_t* buf_;
+};
+
+// Called with a request's index once all of its bytes are in its buffer.
+typedef std::function<void(size_t idx)> ReadCallback;
+
+// A way of issuing a batch of reads against a file.
+//
+// Backends are stateless singletons. read fills every request, calling
+// done for each as soon as it completes, and returns once they all have.
+// done runs outside the read phase timing, so work it does inline is not
+// charged to reads, and it may be called from pool workers. A failed
+// read throws std::runtime_error, as Reader::read does, and an exception
+// from done is passed on. Either way read only returns or throws once no
+// read is still writing into a request's buffer.
+struct ReadBackend {
+  virtual ~ReadBackend() {}
+
+  virtual const char* name() const = 0;
+
+  virtual void read(
+      int fd,
+      const std::vector<ReadRequest>& requests,
+      ThreadPool* pool,
+      const ReadCallback& done) = 0;
+};
+
+// The backends usable in this build on this kernel, preferred first. The
+// first entry is the default.
+std::vector<ReadBackend*> available_read_backends();
+
+// Select the backend used for prefetched reads. Returns false if no usable
+// backend has that name.
+bool set_read_backend(const char* name);
+
+ReadBackend& current_read_backend();
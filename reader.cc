@@ -1,22 +1,91 @@
-
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "emitter.h"
+#include "instrument.h"
+#include "object_store.h"
+#include "read_backend.h"
 #include "reader.h"
 
-Reader::Reader(const char* filename) {
+namespace {
+
+std::atomic<uint64_t> tail_read_bytes{DEFAULT_TAIL_READ};
+
+}  // namespace
+
+void
+set_tail_read_size(uint64_t nbytes) {
+  tail_read_bytes = nbytes;
+}
+
+uint64_t
+tail_read_size() {
+  return tail_read_bytes;
+}
+
+Reader::Reader(const char* filename, bool use_mmap)
+    : filename_(filename)
+    , fd_(-1)
+    , map_(nullptr) {
+  // Remote objects are never mapped; --mmap only applies to local files.
+  if (is_remote_path(filename_)) {
+    remote_ = std::make_unique<RemoteFile>(filename_);
+    file_size_ = remote_->size_;
+    mtime_ns_ = remote_->mtime_ns_;
+    tail_offset_ = file_size_;
+    return;
+  }
+
   fd_ = ::open(filename, O_RDONLY);
   if (fd_ < 0) {
-    fprintf(stderr, "Error opening '%s': %s", filename, strerror(errno));
-    exit(2);
+    throw std::runtime_error("Error opening '" + filename_ + "': " + strerror(errno));
   }
 
   file_size_ = lseek(fd_, 0, SEEK_END);
-  read_map_.resize(file_size_, 0);
+  tail_offset_ = file_size_;
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    std::string msg = "Error in fstat of '" + filename_ + "': " + strerror(errno);
+    ::close(fd_);
+    throw std::runtime_error(msg);
+  }
+  mtime_ns_ = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  if (use_mmap && file_size_ > 0) {
+    void* addr = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED) {
+      std::string msg = "Error mapping '" + filename_ + "': " + strerror(errno);
+      ::close(fd_);
+      throw std::runtime_error(msg);
+    }
+
+    // Metadata files are consumed front to back in a handful of large
+    // sections so let the kernel read ahead aggressively.
+    (void)madvise(addr, file_size_, MADV_WILLNEED);
+    map_ = static_cast<const uint8_t*>(addr);
+  }
+}
+
+Reader::~Reader() {
+  if (map_ != nullptr) {
+    munmap(const_cast<uint8_t*>(map_), file_size_);
+  }
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
 }
 
 void
@@ -24,47 +93,346 @@ Reader::read(void* buf, size_t nbytes, size_t offset)
 {
   //fprintf(stderr, "Reading %lu bytes at %zu offset.\n", nbytes, offset);
 
+  auto prefetched = find_prefetched(nbytes, offset);
+  if (prefetched != nullptr) {
+    memcpy(buf, prefetched, nbytes);
+    return;
+  }
+
+  fill(buf, nbytes, offset);
+  mark_read(nbytes, offset);
+}
+
+// Read without recording coverage, for read and read_tail.
+void
+Reader::fill(void* buf, size_t nbytes, size_t offset)
+{
+  // Remote reads are timed per GET, so cached blocks cost no read time.
+  if (remote_ != nullptr) {
+    check_range(nbytes, offset);
+    remote_->read(static_cast<uint8_t*>(buf), nbytes, offset);
+    return;
+  }
+
+  PhaseTimer timer(PHASE_READ);
+  timer.add_bytes(nbytes, 0);
+
+  if (map_ != nullptr) {
+    check_range(nbytes, offset);
+    memcpy(buf, map_ + offset, nbytes);
+    return;
+  }
+
   auto nread = pread(fd_, buf, nbytes, offset);
+  timer.add_syscall();
   if (nread < 0) {
-    fprintf(stderr, "Error in pread: %s\n", strerror(errno));
-    exit(2);
+    throw std::runtime_error(std::string("Error in pread: ") + strerror(errno));
   }
 
-  if (nread != nbytes) {
-    auto fmt = "Read failed: Expected %ld bytes, "
-      "but read %ld bytes\n";
-    fprintf(stderr, fmt, nbytes, nread);
-    exit(2);
+  if ((size_t)nread != nbytes) {
+    throw std::runtime_error(
+        "Read failed: Expected " + std::to_string(nbytes) + " bytes, "
+        "but read " + std::to_string(nread) + " bytes");
   }
+}
+
+const uint8_t*
+Reader::view(size_t nbytes, size_t offset, std::pmr::vector<uint8_t>& scratch)
+{
+  if (map_ == nullptr) {
+    auto prefetched = find_prefetched(nbytes, offset);
+    if (prefetched != nullptr) {
+      return prefetched;
+    }
 
-  for (size_t i = offset; i < offset + nbytes; i++) {
-    read_map_[i] += 1;
+    // A corrupt length fails here rather than after allocating it.
+    check_range(nbytes, offset);
+    scratch.resize(nbytes);
+    read(scratch.data(), nbytes, offset);
+    return scratch.data();
   }
+
+  // Mapped bytes are only faulted in when they're decoded, so this counts
+  // them without any time of its own.
+  PhaseTimer timer(PHASE_READ);
+  timer.add_bytes(nbytes, 0);
+
+  check_range(nbytes, offset);
+  mark_read(nbytes, offset);
+  return map_ + offset;
 }
 
 void
-Reader::show_read_report() {
-  bool found_hole = false;
-  for (size_t i = 0; i < read_map_.size(); i++) {
-    if (read_map_[i] > 0) {
+Reader::prefetch(
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    ThreadPool* pool,
+    const std::function<void(size_t)>& ready)
+{
+  if (map_ != nullptr) {
+    for (size_t i = 0; ready && i < ranges.size(); i++) {
+      ready(i);
+    }
+    return;
+  }
+
+  prefetched_ = std::vector<Prefetched>(ranges.size());
+  std::vector<ReadRequest> requests(ranges.size());
+  for (size_t i = 0; i < ranges.size(); i++) {
+    auto& range = prefetched_[i];
+    range.offset_ = ranges[i].first;
+    range.data_.resize(ranges[i].second - ranges[i].first);
+    requests[i] = {range.offset_, range.data_.size(), range.data_.data()};
+  }
+
+  auto arrived = [&](size_t i) {
+    auto& range = prefetched_[i];
+    range.arrived_.store(true, std::memory_order_release);
+    if (ready) {
+      ready(i);
+    }
+  };
+
+  if (remote_ != nullptr) {
+    remote_->read(requests, pool, arrived);
+  } else {
+    current_read_backend().read(fd_, requests, pool, arrived);
+  }
+}
+
+void
+Reader::read_tail(uint64_t nbytes)
+{
+  if (map_ != nullptr || nbytes == 0 || !tail_.empty()) {
+    return;
+  }
+
+  nbytes = std::min(nbytes, file_size_);
+  tail_.resize(nbytes);
+  fill(tail_.data(), nbytes, file_size_ - nbytes);
+  tail_offset_ = file_size_ - nbytes;
+}
+
+void
+Reader::clear_prefetch()
+{
+  prefetched_.clear();
+}
+
+// Bytes served from the tail or a prefetched range are recorded as read
+// here rather than when they arrive, since neither is read for just the
+// sections that end up used.
+const uint8_t*
+Reader::find_prefetched(size_t nbytes, size_t offset)
+{
+  if (!tail_.empty() && offset >= tail_offset_ && offset <= file_size_ && nbytes <= file_size_ - offset) {
+    mark_read(nbytes, offset);
+    return tail_.data() + (offset - tail_offset_);
+  }
+
+  auto iter = std::upper_bound(prefetched_.begin(), prefetched_.end(), offset,
+      [](uint64_t offset, const Prefetched& range) { return offset < range.offset_; });
+  if (iter == prefetched_.begin()) {
+    return nullptr;
+  }
+
+  auto& range = *std::prev(iter);
+  if (!range.arrived_.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+
+  uint64_t start = offset - range.offset_;
+  if (start > range.data_.size() || nbytes > range.data_.size() - start) {
+    return nullptr;
+  }
+
+  mark_read(nbytes, offset);
+  return range.data_.data() + start;
+}
+
+void
+Reader::check_range(size_t nbytes, size_t offset)
+{
+  if (offset > file_size_ || nbytes > file_size_ - offset) {
+    throw std::runtime_error(
+        "Read failed: " + std::to_string(nbytes) + " bytes at offset " + std::to_string(offset)
+        + " is past the end of the file (" + std::to_string(file_size_) + " bytes)");
+  }
+}
+
+void
+Reader::mark_read(size_t nbytes, size_t offset)
+{
+  std::lock_guard<std::mutex> lock(coverage_mtx_);
+  coverage_.add(offset, nbytes);
+}
+
+void
+Reader::show_read_report(FILE* out) {
+  auto holes = coverage_.holes(file_size_);
+  if (holes.empty()) {
+    fprintf(out, "Metadata file was read completely.\n");
+  } else {
+    fprintf(out, "Found unread bytes in metadata file:\n");
+    for (auto& hole : holes) {
+      fprintf(out, "    %llu - %llu\n", (unsigned long long)hole.first, (unsigned long long)hole.second);
+    }
+  }
+
+  auto overlaps = coverage_.overlaps();
+  if (!overlaps.empty()) {
+    fprintf(out, "Found overlapping reads in metadata file:\n");
+    for (auto& overlap : overlaps) {
+      auto& range = overlap.first;
+      fprintf(out, "    %llu - %llu: read %llu times\n",
+          (unsigned long long)range.first, (unsigned long long)range.second,
+          (unsigned long long)overlap.second);
+    }
+  }
+}
+
+void
+Reader::emit_read_report(Emitter& out) {
+  auto holes = coverage_.holes(file_size_);
+  auto overlaps = coverage_.overlaps();
+
+  out.begin_record("read_report");
+  out.boolean("complete", holes.empty());
+
+  out.begin_array("holes");
+  for (auto& hole : holes) {
+    out.begin_object(nullptr);
+    out.u64("start", hole.first);
+    out.u64("end", hole.second);
+    out.end_object();
+  }
+  out.end_array();
+
+  out.begin_array("overlaps");
+  for (auto& overlap : overlaps) {
+    out.begin_object(nullptr);
+    out.u64("start", overlap.first.first);
+    out.u64("end", overlap.first.second);
+    out.u64("reads", overlap.second);
+    out.end_object();
+  }
+  out.end_array();
+  out.end_record();
+}
+
+std::vector<std::pair<uint64_t, uint64_t>>
+coalesce_ranges(std::vector<std::pair<uint64_t, uint64_t>> ranges, uint64_t max_gap, uint64_t max_read)
+{
+  std::sort(ranges.begin(), ranges.end());
+
+  std::vector<std::pair<uint64_t, uint64_t>> ret;
+  for (auto& range : ranges) {
+    if (range.first >= range.second) {
       continue;
     }
 
-    if (found_hole == false) {
-      fprintf(stderr, "Found unread bytes in metadata file:\n");
+    if (!ret.empty()) {
+      auto& last = ret.back();
+      uint64_t end = std::max(last.second, range.second);
+      if (range.first < last.second
+          || (range.first - last.second <= max_gap && end - last.first <= max_read)) {
+        last.second = end;
+        continue;
+      }
     }
-    found_hole = true;
 
-    size_t j = i;
-    while (j < read_map_.size() && read_map_[j] == 0) {
-      j++;
+    ret.push_back(range);
+  }
+
+  return ret;
+}
+
+void
+ReadCoverage::add(uint64_t offset, uint64_t nbytes)
+{
+  if (nbytes == 0) {
+    return;
+  }
+
+  uint64_t start = offset;
+  uint64_t end = offset + nbytes;
+  reads_[{start, end}]++;
+
+  // Merge with an interval that starts before and touches this one.
+  auto iter = covered_.upper_bound(start);
+  if (iter != covered_.begin()) {
+    auto prev = std::prev(iter);
+    if (prev->second >= start) {
+      start = prev->first;
+      end = std::max(end, prev->second);
+      iter = covered_.erase(prev);
+    }
+  }
+
+  // Absorb every interval that starts inside or right after this one.
+  while (iter != covered_.end() && iter->first <= end) {
+    end = std::max(end, iter->second);
+    iter = covered_.erase(iter);
+  }
+
+  covered_.emplace_hint(iter, start, end);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>>
+ReadCoverage::holes(uint64_t file_size) const
+{
+  std::vector<std::pair<uint64_t, uint64_t>> ret;
+  uint64_t pos = 0;
+  for (auto& range : covered_) {
+    if (range.first > pos) {
+      ret.emplace_back(pos, range.first);
+    }
+    pos = std::max(pos, range.second);
+  }
+
+  if (pos < file_size) {
+    ret.emplace_back(pos, file_size);
+  }
+
+  return ret;
+}
+
+std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>>
+ReadCoverage::overlaps() const
+{
+  // reads_ is ordered by start, so a range overlaps an earlier one iff it
+  // starts before the furthest end seen so far. The earlier range that
+  // reached that end overlaps it too.
+  std::vector<bool> flagged(reads_.size(), false);
+  std::vector<decltype(reads_)::const_iterator> iters;
+
+  uint64_t max_end = 0;
+  size_t max_idx = 0;
+  for (auto iter = reads_.begin(); iter != reads_.end(); ++iter) {
+    size_t idx = iters.size();
+    iters.push_back(iter);
+
+    auto& range = iter->first;
+    if (iter->second > 1) {
+      flagged[idx] = true;
+    }
+
+    if (idx > 0 && range.first < max_end) {
+      flagged[idx] = true;
+      flagged[max_idx] = true;
     }
 
-    fprintf(stderr, "    %zu - %zu\n", i, j);
-    i = j;
+    if (range.second > max_end) {
+      max_end = range.second;
+      max_idx = idx;
+    }
   }
 
-  if (!found_hole) {
-    fprintf(stderr, "Metadata file was read completely.\n");
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> ret;
+  for (size_t i = 0; i < iters.size(); i++) {
+    if (flagged[i]) {
+      ret.emplace_back(iters[i]->first, iters[i]->second);
+    }
   }
+
+  return ret;
 }
@@ -1,16 +1,165 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
+// Tracks which byte ranges of a file have been read. Coverage is kept as
+// a set of disjoint, merged intervals so each read costs O(log n) in the
+// number of intervals rather than O(bytes). Each distinct read range also
+// keeps a count so that repeated and overlapping reads can be reported.
+// Map nodes come from a pool owned by the ReadCoverage, so nodes freed by
+// interval merges are reused and the whole map is released in one go.
+struct ReadCoverage {
+  ReadCoverage()
+      : covered_(&pool_)
+      , reads_(&pool_) {
+  }
+
+  void add(uint64_t offset, uint64_t nbytes);
+
+  // Unread [start, end) ranges of a file of the given size.
+  std::vector<std::pair<uint64_t, uint64_t>> holes(uint64_t file_size) const;
+
+  // Distinct read ranges that were read more than once or that overlap
+  // another read range, with their read counts.
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> overlaps() const;
+
+  std::pmr::unsynchronized_pool_resource pool_;
+
+  // Merged start -> end of every byte that has been read.
+  std::pmr::map<uint64_t, uint64_t> covered_;
+
+  // [start, end) of every distinct read -> number of times it was read.
+  std::pmr::map<std::pair<uint64_t, uint64_t>, uint64_t> reads_;
+};
+
+struct Emitter;
+struct RemoteFile;
+struct ThreadPool;
+
+// Ranges at most this many bytes apart are read together when coalescing,
+// since on a network filesystem a read syscall costs far more than the
+// bytes between two nearby ranges.
+#define COALESCE_MAX_GAP (128 * 1024)
+
+// Coalescing never merges ranges into a read larger than this.
+#define COALESCE_MAX_READ (16 * 1024 * 1024)
+
+// Sort [start, end) ranges and merge those that overlap or are at most
+// max_gap bytes apart, as long as the merged range stays within max_read
+// bytes. Overlapping ranges are always merged, so the result is sorted and
+// disjoint.
+std::vector<std::pair<uint64_t, uint64_t>> coalesce_ranges(
+    std::vector<std::pair<uint64_t, uint64_t>> ranges,
+    uint64_t max_gap = COALESCE_MAX_GAP,
+    uint64_t max_read = COALESCE_MAX_READ);
+
+// Bytes at the end of a file read along with the footer by default. Most
+// footers fit, and small files are read whole.
+#define DEFAULT_TAIL_READ (64 * 1024)
+
+// How much Footer reads from the end of each file in one go. 0 reads just
+// the footer size and then the footer.
+void set_tail_read_size(uint64_t nbytes);
+uint64_t tail_read_size();
+
+// Reader is safe to share between threads: pread and the mapping need no
+// coordination and coverage updates are serialized internally.
+//
+// Paths for which is_remote_path is true are read with ranged GETs through
+// a RemoteFile instead, with fd_ left at -1.
 struct Reader {
-  Reader(const char* filename);
+  Reader(const char* filename, bool use_mmap = false);
+  ~Reader();
+
+  Reader(const Reader&) = delete;
+  Reader& operator=(const Reader&) = delete;
 
   void read(void* buf, size_t nbytes, size_t offset);
-  void show_read_report();
 
+  // Return a pointer to nbytes of the file starting at offset. When the
+  // file is memory mapped this points directly into the mapping and
+  // scratch is left untouched. Otherwise the bytes are read into scratch
+  // and scratch.data() is returned. The pointer is valid as long as the
+  // Reader (and scratch) are.
+  const uint8_t* view(size_t nbytes, size_t offset, std::pmr::vector<uint8_t>& scratch);
+
+  // Record nbytes at offset as read without reading them, for data that
+  // was served from elsewhere such as a cache of this file.
+  void mark_read(size_t nbytes, size_t offset);
+
+  // Read each of the sorted, disjoint [start, end) ranges into memory
+  // with the current ReadBackend, using pool when given. Once a range has
+  // arrived, read and view calls that fall entirely inside it are served
+  // from there without a syscall. ready, if given, is called with each
+  // range's index as soon as it has arrived, possibly from a pool worker
+  // and while other ranges are still being read. Returns when every range
+  // has arrived. Only the bytes later served from a range count as read,
+  // so gaps that were read just to coalesce reads still show up as holes
+  // in the read report. For a mapped file nothing is read and ready is
+  // called for every range at once.
+  void prefetch(
+      const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+      ThreadPool* pool = nullptr,
+      const std::function<void(size_t)>& ready = nullptr);
+
+  // Read the last nbytes of the file, or all of it if it's smaller, with a
+  // single read and keep them for the Reader's lifetime. Like a prefetched
+  // range, later reads and views that fall inside are served from memory,
+  // and only the bytes served count as read.
+  // Does nothing for a mapped file or when nbytes is 0. Must be called
+  // before the Reader is shared.
+  void read_tail(uint64_t nbytes);
+
+  // Where the bytes kept by read_tail start, or the file size if none are.
+  uint64_t tail_offset() const {
+    return tail_offset_;
+  }
+
+  // Drop the prefetched ranges. Pointers view returned into them are no
+  // longer valid. Must not run concurrently with reads or prefetch.
+  void clear_prefetch();
+
+  void show_read_report(FILE* out = stderr);
+  void emit_read_report(Emitter& out);
+
+  std::string filename_;
   int fd_;
   uint64_t file_size_;
-  std::vector<uint8_t> read_map_;
+  int64_t mtime_ns_;
+  const uint8_t* map_;
+  ReadCoverage coverage_;
+  std::unique_ptr<RemoteFile> remote_;
+
+ private:
+  struct Prefetched {
+    uint64_t offset_;
+    std::vector<uint8_t> data_;
+    std::atomic<bool> arrived_{false};
+  };
+
+  std::mutex coverage_mtx_;
+
+  // Sorted by offset. Set up before any range is read and otherwise only
+  // changed by clear_prefetch, so lookups need no lock. Ranges that
+  // haven't arrived are skipped.
+  std::vector<Prefetched> prefetched_;
+
+  uint64_t tail_offset_;
+  std::vector<uint8_t> tail_;
+
+  void fill(void* buf, size_t nbytes, size_t offset);
+  void check_range(size_t nbytes, size_t offset);
+  const uint8_t* find_prefetched(size_t nbytes, size_t offset);
 };
@@ -0,0 +1,497 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+
+#include "datatype.h"
+#include "deserializer.h"
+#include "emitter.h"
+#include "fragment_metadata.h"
+#include "reader.h"
+#include "rollup.h"
+#include "schema.h"
+#include "thread_pool.h"
+
+namespace {
+
+// Values of single value numeric fields compare by value. Everything else
+// holds strings, which compare bytewise.
+bool
+less_than(uint8_t datatype, bool numeric, const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+  if (!numeric) {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  bool ret = false;
+  with_numeric_type(datatype, [&](auto zero) {
+    decltype(zero) x, y;
+    memcpy(&x, a.data(), sizeof(x));
+    memcpy(&y, b.data(), sizeof(y));
+    ret = x < y;
+  });
+  return ret;
+}
+
+// Sums that would overflow stick at the limit in the direction they
+// overflowed, as TileDB's per-fragment sums do.
+uint64_t
+add_sums(uint8_t datatype, uint64_t a, uint64_t b) {
+  if (datatype == DATATYPE_FLOAT32 || datatype == DATATYPE_FLOAT64) {
+    double x, y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    double sum;
+    if ((x < 0.0) == (y < 0.0) && fabs(x) > std::numeric_limits<double>::max() - fabs(y)) {
+      sum = x < 0.0 ? std::numeric_limits<double>::lowest() : std::numeric_limits<double>::max();
+    } else {
+      sum = x + y;
+    }
+    uint64_t ret;
+    memcpy(&ret, &sum, sizeof(ret));
+    return ret;
+  }
+
+  bool is_signed = false;
+  with_integer_type(datatype, [&](auto zero) {
+    is_signed = std::is_signed<decltype(zero)>::value;
+  });
+
+  if (is_signed) {
+    int64_t sum;
+    if (__builtin_add_overflow((int64_t)a, (int64_t)b, &sum)) {
+      sum = (int64_t)b < 0 ? INT64_MIN : INT64_MAX;
+    }
+    return (uint64_t)sum;
+  }
+
+  uint64_t sum;
+  if (__builtin_add_overflow(a, b, &sum)) {
+    sum = UINT64_MAX;
+  }
+  return sum;
+}
+
+bool
+is_numeric_field(const FieldRollup& field) {
+  return field.cell_val_num_ == 1 && is_numeric(field.datatype_);
+}
+
+std::string
+format_value(uint8_t datatype, bool numeric, const std::vector<uint8_t>& val) {
+  if (numeric) {
+    return format_number(datatype, val.data());
+  }
+  return format_string(std::string_view((const char*)val.data(), val.size()));
+}
+
+std::string
+format_domain(const DomainRollup& dim) {
+  bool numeric = !dim.var_sized_ && is_numeric(dim.datatype_);
+  return dim.name_ + ": [" + format_value(dim.datatype_, numeric, dim.start_) + ", "
+      + format_value(dim.datatype_, numeric, dim.end_) + "]";
+}
+
+void
+merge_field(FieldRollup& dst, const FieldRollup& src) {
+  dst.fragments_ += src.fragments_;
+  if (!dst.conflict_.empty()) {
+    return;
+  }
+
+  if (!src.conflict_.empty()) {
+    dst.conflict_ = src.conflict_;
+  } else if (src.datatype_ != dst.datatype_ || src.cell_val_num_ != dst.cell_val_num_) {
+    dst.conflict_ = "type differs between fragments";
+  }
+
+  if (!dst.conflict_.empty()) {
+    dst.has_min_max_ = false;
+    dst.has_sum_ = false;
+    dst.min_.clear();
+    dst.max_.clear();
+    return;
+  }
+
+  // A fragment without statistics leaves the array-wide value unknown.
+  if (dst.has_min_max_ && src.has_min_max_) {
+    bool numeric = is_numeric_field(dst);
+    if (less_than(dst.datatype_, numeric, src.min_, dst.min_)) {
+      dst.min_ = src.min_;
+    }
+    if (less_than(dst.datatype_, numeric, dst.max_, src.max_)) {
+      dst.max_ = src.max_;
+    }
+  } else {
+    dst.has_min_max_ = false;
+    dst.min_.clear();
+    dst.max_.clear();
+  }
+
+  if (dst.has_sum_ && src.has_sum_) {
+    dst.sum_ = add_sums(dst.datatype_, dst.sum_, src.sum_);
+  } else {
+    dst.has_sum_ = false;
+  }
+
+  dst.nullable_ = dst.nullable_ || src.nullable_;
+  dst.null_count_ += src.null_count_;
+}
+
+void
+merge_domain(DomainRollup& dst, const DomainRollup& src) {
+  if (!src.set_) {
+    return;
+  }
+
+  if (!dst.set_) {
+    dst = src;
+    return;
+  }
+
+  bool numeric = !dst.var_sized_ && is_numeric(dst.datatype_);
+  if (less_than(dst.datatype_, numeric, src.start_, dst.start_)) {
+    dst.start_ = src.start_;
+  }
+  if (less_than(dst.datatype_, numeric, dst.end_, src.end_)) {
+    dst.end_ = src.end_;
+  }
+}
+
+// Fixed size dimensions store [start, end]. Var sized dimensions store
+// the range size and start size followed by the range.
+void
+decode_domain(const Footer& footer, RollupPartial& part) {
+  if (footer.null_non_empty_domain_ != 0) {
+    return;
+  }
+
+  Deserializer dser(footer.non_empty_domain_.data(), footer.non_empty_domain_.size());
+  for (auto& info : footer.schema_->dims_) {
+    DomainRollup dim;
+    dim.name_ = info.name_;
+    dim.datatype_ = info.datatype_;
+    dim.var_sized_ = info.var_sized();
+    dim.set_ = true;
+
+    if (dim.var_sized_) {
+      auto range_size = dser.read<uint64_t>();
+      auto start_size = dser.read<uint64_t>();
+      if (start_size > range_size) {
+        throw std::logic_error("Invalid non-empty domain of dimension " + info.name_);
+      }
+      auto range = dser.get_ptr<uint8_t>(range_size);
+      dim.start_.assign(range, range + start_size);
+      dim.end_.assign(range + start_size, range + range_size);
+    } else {
+      auto size = info.cell_size();
+      auto range = dser.get_ptr<uint8_t>(2 * size);
+      dim.start_.assign(range, range + size);
+      dim.end_.assign(range + size, range + 2 * size);
+    }
+
+    part.domain_.push_back(std::move(dim));
+  }
+}
+
+void
+summarize(
+    const std::string& path,
+    SchemaResolver& resolver,
+    ThreadPool& pool,
+    bool use_mmap,
+    const char* cache_dir,
+    FragmentSummary& row,
+    RollupPartial& part) {
+  Reader reader(path.c_str(), use_mmap);
+  FragmentMetadata fmd(reader, resolver, &pool, true, DEFAULT_TILE_BUDGET, cache_dir);
+  auto& footer = fmd.footer_;
+
+  row.version_ = footer.version_;
+  row.schema_ = footer.array_schema_;
+  row.tiles_ = footer.sparse_tile_num_;
+  row.file_size_ = reader.file_size_;
+
+  if (!footer.schema_) {
+    throw std::logic_error("Schema " + footer.array_schema_ + " not found, field types are unknown.");
+  }
+
+  decode_domain(footer, part);
+  for (auto& dim : part.domain_) {
+    row.domain_.push_back(format_domain(dim));
+  }
+
+  for (size_t i = 0; i < fmd.nfields_; i++) {
+    auto& info = footer.fields_[i];
+    FieldRollup field;
+    field.name_ = info.name_;
+    field.datatype_ = info.datatype_;
+    field.cell_val_num_ = info.cell_val_num_;
+    field.nullable_ = info.nullable_;
+    field.fragments_ = 1;
+
+    // Fields TileDB keeps no statistics for have empty mins and maxes.
+    // The min of a string field may be the empty string.
+    auto min = fmd.fragment_min(i);
+    auto max = fmd.fragment_max(i);
+    if (!max.empty()) {
+      if (is_numeric_field(field) && (min.size() != info.cell_size() || max.size() != info.cell_size())) {
+        throw std::logic_error(
+            "Fragment min or max of field " + info.name_ + " is not "
+            + std::to_string(info.cell_size()) + " bytes.");
+      }
+      field.has_min_max_ = true;
+      field.min_.assign(min.begin(), min.end());
+      field.max_.assign(max.begin(), max.end());
+      field.has_sum_ = is_numeric_field(field);
+    }
+
+    field.sum_ = fmd.fragment_sum(i);
+    field.null_count_ = fmd.fragment_null_count(i);
+    part.fields_.push_back(std::move(field));
+  }
+
+  part.fragments_ = 1;
+  for (auto& [start, end] : reader.coverage_.covered_) {
+    row.bytes_read_ += end - start;
+  }
+}
+
+}  // namespace
+
+void
+RollupPartial::merge(const RollupPartial& other) {
+  if (other.fragments_ == 0) {
+    return;
+  }
+
+  if (fragments_ == 0) {
+    *this = other;
+    return;
+  }
+
+  fragments_ += other.fragments_;
+
+  for (auto& src : other.fields_) {
+    auto it = std::find_if(fields_.begin(), fields_.end(), [&](const FieldRollup& field) {
+      return field.name_ == src.name_;
+    });
+    if (it == fields_.end()) {
+      fields_.push_back(src);
+    } else {
+      merge_field(*it, src);
+    }
+  }
+
+  // Dimensions can't change between schema versions, so they line up.
+  if (domain_.empty()) {
+    domain_ = other.domain_;
+  } else {
+    for (size_t i = 0; i < std::min(domain_.size(), other.domain_.size()); i++) {
+      merge_domain(domain_[i], other.domain_[i]);
+    }
+  }
+}
+
+Rollup::Rollup(
+    const std::vector<std::string>& paths,
+    SchemaResolver& resolver,
+    ThreadPool& pool,
+    bool use_mmap,
+    const char* cache_dir)
+    : fragments_(paths.size()) {
+  std::vector<RollupPartial> partials(paths.size());
+
+  TaskGroup group;
+  for (size_t i = 0; i < paths.size(); i++) {
+    pool.submit(group, [&, i]() {
+      fragments_[i].path_ = paths[i];
+      try {
+        summarize(paths[i], resolver, pool, use_mmap, cache_dir, fragments_[i], partials[i]);
+      } catch (std::exception& exc) {
+        fragments_[i].error_ = exc.what();
+        partials[i] = RollupPartial();
+      }
+    });
+  }
+  pool.wait(group);
+
+  // Each level merges the right neighbour of every pair into the left so
+  // fields keep the order they first appear in.
+  for (size_t stride = 1; stride < partials.size(); stride *= 2) {
+    TaskGroup level;
+    for (size_t i = 0; i + stride < partials.size(); i += 2 * stride) {
+      pool.submit(level, [&, i, stride]() { partials[i].merge(partials[i + stride]); });
+    }
+    pool.wait(level);
+  }
+
+  if (!partials.empty()) {
+    total_ = std::move(partials[0]);
+  }
+}
+
+bool
+Rollup::failed() const {
+  for (auto& row : fragments_) {
+    if (!row.error_.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+Rollup::dump(FILE* out) {
+  uint64_t bytes_read = 0;
+  uint64_t file_size = 0;
+  size_t num_failed = 0;
+  for (auto& row : fragments_) {
+    bytes_read += row.bytes_read_;
+    file_size += row.file_size_;
+    num_failed += !row.error_.empty();
+  }
+
+  fprintf(out, "Rollup:\n");
+  fprintf(out, "    Fragments: %zu, %zu failed\n", fragments_.size(), num_failed);
+  fprintf(out, "    Metadata Read: %llu of %llu bytes\n",
+      (unsigned long long)bytes_read, (unsigned long long)file_size);
+
+  fprintf(out, "    Fragment Summary:\n");
+  fprintf(out, "        %6s %8s %10s %12s %12s  %s\n", "", "Version", "Tiles", "Read", "Size", "Path");
+  for (size_t i = 0; i < fragments_.size(); i++) {
+    auto& row = fragments_[i];
+    if (!row.error_.empty()) {
+      fprintf(out, "        %6zu %8s %10s %12s %12s  %s\n", i, "-", "-", "-", "-", row.path_.c_str());
+      fprintf(out, "               error, %s\n", row.error_.c_str());
+      continue;
+    }
+
+    fprintf(out, "        %6zu %8u %10llu %12llu %12llu  %s\n",
+        i, row.version_, (unsigned long long)row.tiles_, (unsigned long long)row.bytes_read_,
+        (unsigned long long)row.file_size_, row.path_.c_str());
+    for (auto& dim : row.domain_) {
+      fprintf(out, "               %s\n", dim.c_str());
+    }
+  }
+
+  fprintf(out, "    Non-Empty Domain:\n");
+  bool any = false;
+  for (auto& dim : total_.domain_) {
+    if (dim.set_) {
+      fprintf(out, "        %s\n", format_domain(dim).c_str());
+      any = true;
+    }
+  }
+  if (!any) {
+    fprintf(out, "        (null)\n");
+  }
+
+  fprintf(out, "    Fields:\n");
+  for (size_t i = 0; i < total_.fields_.size(); i++) {
+    auto& field = total_.fields_[i];
+    fprintf(out, "        %zu: %s: %llu fragments", i, field.name_.c_str(),
+        (unsigned long long)field.fragments_);
+    if (!field.conflict_.empty()) {
+      fprintf(out, ", %s\n", field.conflict_.c_str());
+      continue;
+    }
+
+    if (field.has_min_max_) {
+      bool numeric = is_numeric_field(field);
+      fprintf(out, ", min %s, max %s",
+          format_value(field.datatype_, numeric, field.min_).c_str(),
+          format_value(field.datatype_, numeric, field.max_).c_str());
+    }
+    if (field.has_sum_) {
+      fprintf(out, ", sum %s", format_sum(field.datatype_, (const uint8_t*)&field.sum_).c_str());
+    }
+    if (field.nullable_) {
+      fprintf(out, ", null count %llu", (unsigned long long)field.null_count_);
+    }
+    if (!field.has_min_max_ && !field.nullable_) {
+      fprintf(out, ", no statistics");
+    }
+    fprintf(out, "\n");
+  }
+}
+
+void
+Rollup::emit(Emitter& out) {
+  for (size_t i = 0; i < fragments_.size(); i++) {
+    auto& row = fragments_[i];
+    out.begin_record("rollup_fragment", i);
+    out.str("fragment", row.path_);
+    if (!row.error_.empty()) {
+      out.str("error", row.error_);
+      out.end_record();
+      continue;
+    }
+
+    out.u64("version", row.version_);
+    out.str("schema", row.schema_);
+    out.u64("tiles", row.tiles_);
+    out.u64("bytes_read", row.bytes_read_);
+    out.u64("file_size", row.file_size_);
+    out.begin_array("non_empty_domain");
+    for (auto& dim : row.domain_) {
+      out.str(nullptr, dim);
+    }
+    out.end_array();
+    out.end_record();
+  }
+
+  out.begin_record("rollup_domain");
+  out.begin_array("dims");
+  for (auto& dim : total_.domain_) {
+    if (!dim.set_) {
+      continue;
+    }
+    bool numeric = !dim.var_sized_ && is_numeric(dim.datatype_);
+    out.begin_object(nullptr);
+    out.str("name", dim.name_);
+    out.str("start", format_value(dim.datatype_, numeric, dim.start_));
+    out.str("end", format_value(dim.datatype_, numeric, dim.end_));
+    out.end_object();
+  }
+  out.end_array();
+  out.end_record();
+
+  for (size_t i = 0; i < total_.fields_.size(); i++) {
+    auto& field = total_.fields_[i];
+    out.begin_record("rollup_field", i);
+    out.str("name", field.name_);
+    out.u64("datatype", field.datatype_);
+    out.u64("cell_val_num", field.cell_val_num_);
+    out.u64("fragments", field.fragments_);
+    if (!field.conflict_.empty()) {
+      out.str("conflict", field.conflict_);
+      out.end_record();
+      continue;
+    }
+
+    bool numeric = is_numeric_field(field);
+    if (field.has_min_max_) {
+      out.str("min", format_value(field.datatype_, numeric, field.min_));
+      out.str("max", format_value(field.datatype_, numeric, field.max_));
+    } else {
+      out.null("min");
+      out.null("max");
+    }
+    if (field.has_sum_) {
+      out.str("sum", format_sum(field.datatype_, (const uint8_t*)&field.sum_));
+    } else {
+      out.null("sum");
+    }
+    if (field.nullable_) {
+      out.u64("null_count", field.null_count_);
+    } else {
+      out.null("null_count");
+    }
+    out.end_record();
+  }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Emitter;
+struct SchemaResolver;
+struct ThreadPool;
+
+// One row of the per-fragment summary table.
+struct FragmentSummary {
+  std::string path_;
+  std::string error_;
+  uint32_t version_ = 0;
+  std::string schema_;
+  uint64_t tiles_ = 0;
+  uint64_t file_size_ = 0;
+  uint64_t bytes_read_ = 0;
+
+  // Each dimension's [start, end] formatted for display, or empty when
+  // the domain is null or can't be decoded without a schema.
+  std::vector<std::string> domain_;
+};
+
+// A field's statistics merged over every fragment that has it. Fields
+// are matched by name so fragments written with different schema
+// versions merge their common fields.
+struct FieldRollup {
+  std::string name_;
+  uint8_t datatype_ = 0;
+  uint32_t cell_val_num_ = 0;
+  bool nullable_ = false;
+  uint64_t fragments_ = 0;
+
+  // Set when fragments disagree on the field's type. Its statistics are
+  // no longer merged from then on.
+  std::string conflict_;
+
+  // min_ and max_ are kept as TileDB stores them: one value of the
+  // field's datatype, or the string for var sized and char fields.
+  bool has_min_max_ = false;
+  std::vector<uint8_t> min_;
+  std::vector<uint8_t> max_;
+
+  // An int64, uint64 or double, saturated the way TileDB sums are.
+  bool has_sum_ = false;
+  uint64_t sum_ = 0;
+
+  uint64_t null_count_ = 0;
+};
+
+// A dimension's non-empty domain merged over all fragments. start_ and
+// end_ hold a value of the dimension's type, or the string for var sized
+// dimensions.
+struct DomainRollup {
+  std::string name_;
+  uint8_t datatype_ = 0;
+  bool var_sized_ = false;
+  bool set_ = false;
+  std::vector<uint8_t> start_;
+  std::vector<uint8_t> end_;
+};
+
+// The partial result of one subtree of the reduction.
+struct RollupPartial {
+  void merge(const RollupPartial& other);
+
+  uint64_t fragments_ = 0;
+  std::vector<FieldRollup> fields_;
+  std::vector<DomainRollup> domain_;
+};
+
+// Array-wide statistics from the footer and the fragment min, max, sum
+// and null count section of each fragment, without reading any other
+// section. Fragments are summarized in parallel on pool and their
+// partial results merged pairwise, a level of the tree at a time.
+struct Rollup {
+  Rollup(
+      const std::vector<std::string>& paths,
+      SchemaResolver& resolver,
+      ThreadPool& pool,
+      bool use_mmap,
+      const char* cache_dir = nullptr);
+
+  // True if any fragment couldn't be read.
+  bool failed() const;
+
+  void dump(FILE* out = stderr);
+  void emit(Emitter& out);
+
+  std::vector<FragmentSummary> fragments_;
+  RollupPartial total_;
+};
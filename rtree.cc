@@ -0,0 +1,507 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#include "datatype.h"
+#include "deserializer.h"
+#include "emitter.h"
+#include "rtree.h"
+#include "tile.h"
+
+namespace {
+
+// Keys compare as signed 64-bit integers in the same order as the
+// coordinates they came from. Floats are widened to double, whose sign
+// magnitude bit patterns order correctly once negative values have their
+// other bits flipped.
+int64_t
+float_key(double val) {
+  if (val == 0.0) {
+    val = 0.0;
+  }
+
+  int64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  return bits < 0 ? bits ^ INT64_MAX : bits;
+}
+
+int64_t
+order_key(uint8_t datatype, const uint8_t* buf) {
+  if (datatype == DATATYPE_FLOAT32) {
+    float val;
+    memcpy(&val, buf, sizeof(val));
+    return float_key(val);
+  }
+
+  if (datatype == DATATYPE_FLOAT64) {
+    double val;
+    memcpy(&val, buf, sizeof(val));
+    return float_key(val);
+  }
+
+  int64_t ret = 0;
+  with_integer_type(datatype, [&](auto zero) {
+    decltype(zero) val;
+    memcpy(&val, buf, sizeof(val));
+    if constexpr (std::is_same<decltype(zero), uint64_t>::value) {
+      ret = (int64_t)(val ^ (1ULL << 63));
+    } else {
+      ret = (int64_t)val;
+    }
+  });
+  return ret;
+}
+
+// The inverse of order_key, formatted.
+std::string
+format_key(uint8_t datatype, int64_t key) {
+  uint8_t buf[8];
+  if (datatype == DATATYPE_FLOAT32 || datatype == DATATYPE_FLOAT64) {
+    int64_t bits = key < 0 ? key ^ INT64_MAX : key;
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    if (datatype == DATATYPE_FLOAT32) {
+      float narrow = (float)val;
+      memcpy(buf, &narrow, sizeof(narrow));
+    } else {
+      memcpy(buf, &val, sizeof(val));
+    }
+    return format_number(datatype, buf);
+  }
+
+  with_integer_type(datatype, [&](auto zero) {
+    decltype(zero) val;
+    if constexpr (std::is_same<decltype(zero), uint64_t>::value) {
+      val = (uint64_t)key ^ (1ULL << 63);
+    } else {
+      val = (decltype(zero))key;
+    }
+    memcpy(buf, &val, sizeof(val));
+  });
+  return format_number(datatype, buf);
+}
+
+int64_t
+parse_key(const FieldInfo& dim, const std::string& text) {
+  auto fail = [&]() {
+    throw std::logic_error("Invalid value '" + text + "' for dimension " + dim.name_);
+  };
+
+  const char* str = text.c_str();
+  char* end = nullptr;
+  errno = 0;
+
+  if (dim.datatype_ == DATATYPE_FLOAT32 || dim.datatype_ == DATATYPE_FLOAT64) {
+    // Parse at the dimension's precision so bounds equal to a stored
+    // float coordinate match it exactly.
+    double val = dim.datatype_ == DATATYPE_FLOAT32 ? strtof(str, &end) : strtod(str, &end);
+    if (end == str || *end != '\0' || errno != 0) {
+      fail();
+    }
+    return float_key(val);
+  }
+
+  int64_t ret = 0;
+  with_integer_type(dim.datatype_, [&](auto zero) {
+    typedef decltype(zero) T;
+    T val;
+    if (std::is_signed<T>::value) {
+      long long parsed = strtoll(str, &end, 10);
+      if (parsed < std::numeric_limits<T>::lowest() || parsed > (long long)std::numeric_limits<T>::max()) {
+        fail();
+      }
+      val = (T)parsed;
+    } else {
+      if (text.find('-') != std::string::npos) {
+        fail();
+      }
+      unsigned long long parsed = strtoull(str, &end, 10);
+      if (parsed > std::numeric_limits<T>::max()) {
+        fail();
+      }
+      val = (T)parsed;
+    }
+    if (end == str || *end != '\0' || errno != 0) {
+      fail();
+    }
+    ret = order_key(dim.datatype_, (const uint8_t*)&val);
+  });
+  return ret;
+}
+
+typedef int64_t Keys __attribute__((vector_size(32)));
+typedef int64_t UnalignedKeys __attribute__((vector_size(32), aligned(8), may_alias));
+
+const size_t KEYS_PER_VECTOR = sizeof(Keys) / sizeof(int64_t);
+
+// Set hits[i - begin] to whether node i's box intersects [qlo, qhi] on
+// every fixed size dimension. lower and upper point at the first node of
+// a level and hold ndims arrays stride keys apart.
+inline __attribute__((always_inline)) void
+intersect_keys(
+    const int64_t* lower,
+    const int64_t* upper,
+    uint64_t stride,
+    size_t ndims,
+    const int64_t* qlo,
+    const int64_t* qhi,
+    uint64_t begin,
+    uint64_t end,
+    uint8_t* hits) {
+  uint64_t i = begin;
+  for (; i + KEYS_PER_VECTOR <= end; i += KEYS_PER_VECTOR) {
+    Keys hit = Keys{} - 1;
+    for (size_t d = 0; d < ndims; d++) {
+      Keys lo = *reinterpret_cast<const UnalignedKeys*>(lower + d * stride + i);
+      Keys hi = *reinterpret_cast<const UnalignedKeys*>(upper + d * stride + i);
+      hit &= (lo <= qhi[d]) & (hi >= qlo[d]);
+    }
+    for (size_t lane = 0; lane < KEYS_PER_VECTOR; lane++) {
+      hits[i - begin + lane] = hit[lane] != 0;
+    }
+  }
+
+  for (; i < end; i++) {
+    bool hit = true;
+    for (size_t d = 0; d < ndims; d++) {
+      hit = hit && lower[d * stride + i] <= qhi[d] && upper[d * stride + i] >= qlo[d];
+    }
+    hits[i - begin] = hit;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void
+intersect_avx2(
+    const int64_t* lower,
+    const int64_t* upper,
+    uint64_t stride,
+    size_t ndims,
+    const int64_t* qlo,
+    const int64_t* qhi,
+    uint64_t begin,
+    uint64_t end,
+    uint8_t* hits) {
+  intersect_keys(lower, upper, stride, ndims, qlo, qhi, begin, end, hits);
+}
+#endif
+
+// Dispatched on the CPU like the stats kernels rather than with
+// target_clones, whose ifunc resolver runs before sanitizer runtimes are
+// initialized.
+void
+intersect(
+    const int64_t* lower,
+    const int64_t* upper,
+    uint64_t stride,
+    size_t ndims,
+    const int64_t* qlo,
+    const int64_t* qhi,
+    uint64_t begin,
+    uint64_t end,
+    uint8_t* hits) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) {
+    intersect_avx2(lower, upper, stride, ndims, qlo, qhi, begin, end, hits);
+    return;
+  }
+#endif
+  intersect_keys(lower, upper, stride, ndims, qlo, qhi, begin, end, hits);
+}
+
+}  // namespace
+
+// Each level is a u64 MBR count followed by the MBRs. An MBR is a
+// [low, high] pair per dimension: two values for fixed size dimensions,
+// or the range size, the start size and the range for var sized ones.
+RTree::RTree(const Tile& tile, const std::vector<FieldInfo>& dims)
+    : dims_(dims) {
+  for (size_t d = 0; d < dims_.size(); d++) {
+    auto& dim = dims_[d];
+    if (dim.var_sized()) {
+      var_dims_.push_back(d);
+    } else if (dim.cell_val_num_ == 1 && is_numeric(dim.datatype_)) {
+      fixed_dims_.push_back(d);
+    } else {
+      throw std::logic_error("Unsupported type for R-tree dimension " + dim.name_);
+    }
+  }
+
+  if (tile.empty()) {
+    return;
+  }
+
+  // The first pass finds each level's size so the node arrays can be
+  // allocated once, the second fills them.
+  Deserializer sizes(tile.data(), tile.size());
+  fanout_ = sizes.read<uint32_t>();
+  auto num_levels = sizes.read<uint32_t>();
+  if (fanout_ == 0 && num_levels > 0) {
+    throw std::logic_error("R-tree has a fanout of 0.");
+  }
+
+  for (uint32_t l = 0; l < num_levels; l++) {
+    auto count = sizes.read<uint64_t>();
+    levels_.push_back({num_nodes_, count});
+    num_nodes_ += count;
+    for (uint64_t m = 0; m < count; m++) {
+      for (auto& dim : dims_) {
+        if (dim.var_sized()) {
+          auto range_size = sizes.read<uint64_t>();
+          sizes.read<uint64_t>();
+          sizes.get_ptr<uint8_t>(range_size);
+        } else {
+          sizes.get_ptr<uint8_t>(2 * dim.cell_size());
+        }
+      }
+    }
+  }
+
+  if (sizes.remaining_bytes() != 0) {
+    throw std::logic_error("R-tree tile has " + std::to_string(sizes.remaining_bytes()) + " trailing bytes.");
+  }
+
+  for (size_t l = 0; l + 1 < levels_.size(); l++) {
+    auto children = levels_[l + 1].count_;
+    if (levels_[l].count_ != (children + fanout_ - 1) / fanout_) {
+      throw std::logic_error("R-tree level " + std::to_string(l) + " doesn't match its fanout.");
+    }
+  }
+
+  lower_.resize(fixed_dims_.size() * num_nodes_);
+  upper_.resize(fixed_dims_.size() * num_nodes_);
+  var_lower_.resize(var_dims_.size() * num_nodes_);
+  var_upper_.resize(var_dims_.size() * num_nodes_);
+
+  Deserializer dser(tile.data(), tile.size());
+  dser.read<uint32_t>();
+  dser.read<uint32_t>();
+  uint64_t node = 0;
+  for (auto& level : levels_) {
+    dser.read<uint64_t>();
+    for (uint64_t m = 0; m < level.count_; m++, node++) {
+      size_t fixed = 0;
+      size_t var = 0;
+      for (auto& dim : dims_) {
+        if (dim.var_sized()) {
+          auto range_size = dser.read<uint64_t>();
+          auto start_size = dser.read<uint64_t>();
+          if (start_size > range_size) {
+            throw std::logic_error("Invalid R-tree range of dimension " + dim.name_);
+          }
+          auto range = dser.get_ptr<char>(range_size);
+          var_lower_[var * num_nodes_ + node].assign(range, start_size);
+          var_upper_[var * num_nodes_ + node].assign(range + start_size, range_size - start_size);
+          var++;
+        } else {
+          auto range = dser.get_ptr<uint8_t>(2 * dim.cell_size());
+          lower_[fixed * num_nodes_ + node] = order_key(dim.datatype_, range);
+          upper_[fixed * num_nodes_ + node] = order_key(dim.datatype_, range + dim.cell_size());
+          fixed++;
+        }
+      }
+    }
+  }
+}
+
+std::vector<DimRange>
+RTree::parse_query(const std::string& query) const {
+  std::vector<DimRange> ret(dims_.size());
+
+  size_t pos = 0;
+  while (pos <= query.size()) {
+    auto comma = std::min(query.find(',', pos), query.size());
+    auto term = query.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    auto eq = term.find('=');
+    auto colon = term.find(':', eq == std::string::npos ? 0 : eq);
+    if (eq == std::string::npos || colon == std::string::npos) {
+      throw std::logic_error("Invalid query term '" + term + "', expected NAME=START:END.");
+    }
+
+    auto name = term.substr(0, eq);
+    auto it = std::find_if(dims_.begin(), dims_.end(), [&](const FieldInfo& dim) {
+      return dim.name_ == name;
+    });
+    if (it == dims_.end()) {
+      throw std::logic_error("Unknown dimension '" + name + "' in query.");
+    }
+
+    auto& dim = *it;
+    auto& range = ret[it - dims_.begin()];
+    auto start = term.substr(eq + 1, colon - eq - 1);
+    auto end = term.substr(colon + 1);
+
+    // An empty bound leaves that side of the range open.
+    if (dim.var_sized()) {
+      range.has_var_start_ = !start.empty();
+      range.has_var_end_ = !end.empty();
+      range.var_start_ = start;
+      range.var_end_ = end;
+    } else {
+      if (!start.empty()) {
+        range.start_ = parse_key(dim, start);
+      }
+      if (!end.empty()) {
+        range.end_ = parse_key(dim, end);
+      }
+    }
+  }
+
+  return ret;
+}
+
+std::vector<uint64_t>
+RTree::query(const std::vector<DimRange>& range) const {
+  std::vector<uint64_t> ret;
+  if (levels_.empty()) {
+    return ret;
+  }
+
+  std::vector<int64_t> qlo;
+  std::vector<int64_t> qhi;
+  for (auto d : fixed_dims_) {
+    qlo.push_back(range[d].start_);
+    qhi.push_back(range[d].end_);
+  }
+
+  auto var_hit = [&](uint64_t node) {
+    for (size_t v = 0; v < var_dims_.size(); v++) {
+      auto& dim_range = range[var_dims_[v]];
+      if (dim_range.has_var_end_ && var_lower_[v * num_nodes_ + node] > dim_range.var_end_) {
+        return false;
+      }
+      if (dim_range.has_var_start_ && var_upper_[v * num_nodes_ + node] < dim_range.var_start_) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Candidates are kept as runs of consecutive nodes within a level,
+  // which is what the children of neighbouring hits are.
+  std::vector<std::pair<uint64_t, uint64_t>> runs = {{0, levels_[0].count_}};
+  std::vector<std::pair<uint64_t, uint64_t>> next;
+  std::vector<uint8_t> hits;
+
+  for (size_t l = 0; l < levels_.size(); l++) {
+    auto& level = levels_[l];
+    bool leaf = l + 1 == levels_.size();
+    next.clear();
+
+    for (auto [begin, end] : runs) {
+      hits.resize(end - begin);
+      intersect(lower_.data() + level.offset_, upper_.data() + level.offset_, num_nodes_,
+          fixed_dims_.size(), qlo.data(), qhi.data(), begin, end, hits.data());
+
+      for (uint64_t i = begin; i < end; i++) {
+        if (!hits[i - begin] || !var_hit(level.offset_ + i)) {
+          continue;
+        }
+
+        if (leaf) {
+          ret.push_back(i);
+          continue;
+        }
+
+        uint64_t child_begin = i * fanout_;
+        uint64_t child_end = std::min(child_begin + fanout_, levels_[l + 1].count_);
+        if (!next.empty() && next.back().second == child_begin) {
+          next.back().second = child_end;
+        } else {
+          next.emplace_back(child_begin, child_end);
+        }
+      }
+    }
+
+    runs.swap(next);
+  }
+
+  return ret;
+}
+
+void
+RTree::dump(FILE* out) const {
+  fprintf(out, "RTree:\n");
+  fprintf(out, "    Fanout: %u\n", fanout_);
+  fprintf(out, "    Levels: %zu\n", levels_.size());
+  for (size_t l = 0; l < levels_.size(); l++) {
+    fprintf(out, "        %zu: %llu nodes\n", l, (unsigned long long)levels_[l].count_);
+  }
+
+  fprintf(out, "    Tile MBRs: %llu\n", (unsigned long long)num_tiles());
+  if (levels_.empty()) {
+    return;
+  }
+
+  auto& leaves = levels_.back();
+  for (uint64_t t = 0; t < leaves.count_; t++) {
+    auto node = leaves.offset_ + t;
+    fprintf(out, "        %llu:", (unsigned long long)t);
+    const char* sep = " ";
+    size_t fixed = 0;
+    size_t var = 0;
+    for (auto& dim : dims_) {
+      std::string lo;
+      std::string hi;
+      if (dim.var_sized()) {
+        lo = format_string(var_lower_[var * num_nodes_ + node]);
+        hi = format_string(var_upper_[var * num_nodes_ + node]);
+        var++;
+      } else {
+        lo = format_key(dim.datatype_, lower_[fixed * num_nodes_ + node]);
+        hi = format_key(dim.datatype_, upper_[fixed * num_nodes_ + node]);
+        fixed++;
+      }
+      fprintf(out, "%s%s: [%s, %s]", sep, dim.name_.c_str(), lo.c_str(), hi.c_str());
+      sep = ", ";
+    }
+    fprintf(out, "\n");
+  }
+}
+
+void
+RTree::emit(Emitter& out) const {
+  out.begin_record("rtree_index");
+  out.u64("fanout", fanout_);
+  std::vector<uint64_t> counts;
+  for (auto& level : levels_) {
+    counts.push_back(level.count_);
+  }
+  out.u64s("level_nodes", counts.data(), counts.size());
+
+  out.begin_array("tile_mbrs");
+  if (!levels_.empty()) {
+    auto& leaves = levels_.back();
+    for (uint64_t t = 0; t < leaves.count_; t++) {
+      auto node = leaves.offset_ + t;
+      out.begin_object(nullptr);
+      size_t fixed = 0;
+      size_t var = 0;
+      for (auto& dim : dims_) {
+        out.begin_array(dim.name_.c_str());
+        if (dim.var_sized()) {
+          out.str(nullptr, var_lower_[var * num_nodes_ + node]);
+          out.str(nullptr, var_upper_[var * num_nodes_ + node]);
+          var++;
+        } else {
+          out.str(nullptr, format_key(dim.datatype_, lower_[fixed * num_nodes_ + node]));
+          out.str(nullptr, format_key(dim.datatype_, upper_[fixed * num_nodes_ + node]));
+          fixed++;
+        }
+        out.end_array();
+      }
+      out.end_object();
+    }
+  }
+  out.end_array();
+  out.end_record();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "schema.h"
+
+struct Emitter;
+struct Tile;
+
+// An inclusive [start, end] range per dimension. start_ and end_ are
+// order keys (see RTree) for fixed size dimensions and the strings
+// themselves for var sized ones.
+struct DimRange {
+  int64_t start_ = INT64_MIN;
+  int64_t end_ = INT64_MAX;
+  bool has_var_start_ = false;
+  bool has_var_end_ = false;
+  std::string var_start_;
+  std::string var_end_;
+};
+
+// A sparse fragment's R-tree, decoded from its rtree generic tile.
+//
+// TileDB bulk loads the tree bottom up: the leaf level holds one MBR per
+// data tile and node i of each level above bounds nodes [i * fanout,
+// (i + 1) * fanout) of the level below. The levels are flattened root
+// first into one node array. Each fixed size dimension's lower and upper
+// bounds are kept in their own contiguous arrays, converted to int64 keys
+// that sort the same way as the coordinates, so a box test against every
+// dimension is a run of vector compares whatever the dimension types.
+// Var sized dimensions keep their bounds as strings and are tested after.
+struct RTree {
+  RTree(const Tile& tile, const std::vector<FieldInfo>& dims);
+
+  // Parse a query of comma separated NAME=START:END terms, one per
+  // dimension to restrict. Dimensions not named are unrestricted.
+  std::vector<DimRange> parse_query(const std::string& query) const;
+
+  // Indices of the data tiles whose MBR intersects range, ascending.
+  std::vector<uint64_t> query(const std::vector<DimRange>& range) const;
+
+  uint64_t num_tiles() const {
+    return levels_.empty() ? 0 : levels_.back().count_;
+  }
+
+  void dump(FILE* out = stderr) const;
+  void emit(Emitter& out) const;
+
+  struct Level {
+    uint64_t offset_;
+    uint64_t count_;
+  };
+
+  uint32_t fanout_ = 0;
+  std::vector<FieldInfo> dims_;
+  std::vector<Level> levels_;
+  uint64_t num_nodes_ = 0;
+
+  // Bounds of fixed size dimension d of node n are at
+  // [d * num_nodes_ + n]. Var sized dimensions use the same layout.
+  std::vector<size_t> fixed_dims_;
+  std::vector<int64_t> lower_;
+  std::vector<int64_t> upper_;
+  std::vector<size_t> var_dims_;
+  std::vector<std::string> var_lower_;
+  std::vector<std::string> var_upper_;
+};
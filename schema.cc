@@ -0,0 +1,235 @@
+#include <filesystem>
+
+#include "datatype.h"
+#include "deserializer.h"
+#include "filter_pipeline.h"
+#include "object_store.h"
+#include "reader.h"
+#include "schema.h"
+#include "tile.h"
+
+namespace {
+
+std::shared_ptr<const FilterPipeline>
+read_filter_pipeline(Deserializer& dser) {
+  auto start = dser.remaining_bytes();
+  auto buf = dser.get_ptr<uint8_t>(0);
+  dser.read<uint32_t>();
+  auto num_filters = dser.read<uint32_t>();
+  for (uint32_t i = 0; i < num_filters; i++) {
+    dser.read<uint8_t>();
+    auto opts_size = dser.read<uint32_t>();
+    dser.get_ptr<uint8_t>(opts_size);
+  }
+
+  return std::make_shared<const FilterPipeline>(buf, start - dser.remaining_bytes());
+}
+
+std::string
+read_name(Deserializer& dser) {
+  auto size = dser.read<uint32_t>();
+  return std::string(dser.get_ptr<char>(size), size);
+}
+
+}  // namespace
+
+bool
+FieldInfo::var_sized() const {
+  return cell_val_num_ == VAR_NUM;
+}
+
+uint64_t
+FieldInfo::cell_size() const {
+  return var_sized() ? 0 : datatype_size(datatype_) * cell_val_num_;
+}
+
+ArraySchema::ArraySchema(const char* filename)
+    : filename_(filename) {
+  Reader reader(filename);
+  Tile tile = read_tile(reader, 0);
+  Deserializer dser(tile.data_.data(), tile.data_.size());
+
+  version_ = dser.read<uint32_t>();
+  if (version_ >= 5) {
+    dser.read<uint8_t>();  // allows_dups
+  }
+
+  array_type_ = dser.read<uint8_t>();
+  dser.read<uint8_t>();  // tile_order
+  dser.read<uint8_t>();  // cell_order
+  dser.read<uint64_t>();  // capacity
+
+  coords_filters_ = read_filter_pipeline(dser);
+  offsets_filters_ = read_filter_pipeline(dser);
+  if (version_ >= 7) {
+    validity_filters_ = read_filter_pipeline(dser);
+  } else {
+    validity_filters_ = std::make_shared<const FilterPipeline>();
+  }
+
+  // Before version 5 every dimension shared the domain's datatype.
+  uint8_t domain_type = 0;
+  if (version_ < 5) {
+    domain_type = dser.read<uint8_t>();
+  }
+
+  auto dim_num = dser.read<uint32_t>();
+  for (uint32_t i = 0; i < dim_num; i++) {
+    auto name = read_name(dser);
+    uint8_t type = domain_type;
+    uint32_t cell_val_num = 1;
+    auto filters = coords_filters_;
+    if (version_ >= 5) {
+      type = dser.read<uint8_t>();
+      cell_val_num = dser.read<uint32_t>();
+      filters = read_filter_pipeline(dser);
+      if (filters->filters_.empty()) {
+        filters = coords_filters_;
+      }
+    }
+
+    // Before version 5 the domain is always [low, high] of the type, with
+    // no size in front.
+    uint64_t domain_size = 2 * datatype_size(type);
+    if (version_ >= 5) {
+      domain_size = dser.read<uint64_t>();
+    }
+    dser.get_ptr<uint8_t>(domain_size);
+
+    auto null_tile_extent = dser.read<uint8_t>();
+    if (null_tile_extent == 0) {
+      dser.get_ptr<uint8_t>(datatype_size(type));
+    }
+
+    dims_.emplace_back(name, type, cell_val_num, false);
+    dims_.back().file_name_ = "d" + std::to_string(i);
+    dims_.back().filters_ = filters;
+  }
+
+  auto attribute_num = dser.read<uint32_t>();
+  for (uint32_t i = 0; i < attribute_num; i++) {
+    auto name = read_name(dser);
+    auto type = dser.read<uint8_t>();
+    auto cell_val_num = dser.read<uint32_t>();
+    auto filters = read_filter_pipeline(dser);
+
+    if (version_ >= 6) {
+      auto fill_value_size = dser.read<uint64_t>();
+      dser.get_ptr<uint8_t>(fill_value_size);
+    }
+
+    bool nullable = false;
+    if (version_ >= 7) {
+      nullable = dser.read<uint8_t>() != 0;
+      dser.read<uint8_t>();  // fill_value_validity
+    }
+
+    if (version_ >= 17) {
+      dser.read<uint8_t>();  // order
+    }
+
+    if (version_ >= 20) {
+      read_name(dser);  // enumeration name
+    }
+
+    attrs_.emplace_back(name, type, cell_val_num, nullable);
+    attrs_.back().file_name_ = "a" + std::to_string(i);
+    attrs_.back().filters_ = filters;
+  }
+
+  // Dimension labels, enumerations and the rest of the schema don't
+  // affect fragment metadata and are left unparsed.
+}
+
+std::vector<FieldInfo>
+ArraySchema::fields(bool has_timestamps, bool has_delete_meta) const {
+  std::vector<FieldInfo> ret = attrs_;
+
+  // Fragments still reserve a slot for the pre-version 5 zipped coords.
+  uint8_t coords_type = dims_.empty() ? DATATYPE_UINT64 : dims_[0].datatype_;
+  ret.emplace_back("__coords", coords_type, (uint32_t)dims_.size(), false);
+  ret.back().file_name_ = "__coords";
+
+  ret.insert(ret.end(), dims_.begin(), dims_.end());
+
+  if (has_timestamps) {
+    ret.emplace_back("__timestamps", DATATYPE_UINT64, 1, false);
+    ret.back().file_name_ = "t";
+  }
+
+  if (has_delete_meta) {
+    ret.emplace_back("__delete_timestamps", DATATYPE_UINT64, 1, false);
+    ret.back().file_name_ = "dt";
+    ret.emplace_back("__delete_condition_index", DATATYPE_UINT64, 1, false);
+    ret.back().file_name_ = "dci";
+  }
+
+  // Internal fields are written with the coords filters.
+  for (size_t i = attrs_.size(); i < ret.size(); i++) {
+    if (!ret[i].filters_) {
+      ret[i].filters_ = coords_filters_;
+    }
+  }
+
+  return ret;
+}
+
+void
+ArraySchema::dump(FILE* out) const {
+  fprintf(out, "Array Schema: %s\n", filename_.c_str());
+  fprintf(out, "    Version: %u\n", version_);
+  fprintf(out, "    Array Type: %u\n", array_type_);
+  fprintf(out, "    Dimensions: %zu\n", dims_.size());
+  fprintf(out, "    Attributes: %zu\n", attrs_.size());
+}
+
+std::shared_ptr<const ArraySchema>
+SchemaResolver::resolve(const std::string& fragment_path, const std::string& schema_name) {
+  if (!schema_path_.empty()) {
+    return load(schema_path_);
+  }
+
+  if (nfields_ > 0) {
+    return nullptr;
+  }
+
+  // Fragments live in ARRAY/__fragments/NAME/ (format version 12 and
+  // later) or ARRAY/NAME/. Schemas live in ARRAY/__schema/ or, for old
+  // arrays, in ARRAY/__array_schema.tdb.
+  namespace fs = std::filesystem;
+  auto fragment_dir = fs::path(fragment_path).parent_path();
+  auto array_dir = fragment_dir.parent_path();
+  std::vector<fs::path> candidates = {
+    array_dir.parent_path() / "__schema" / schema_name,
+    array_dir / "__schema" / schema_name,
+    array_dir.parent_path() / "__array_schema.tdb",
+    array_dir / "__array_schema.tdb",
+  };
+
+  // Remote arrays can't be listed, so each candidate is probed in turn.
+  bool remote = is_remote_path(fragment_path);
+  std::error_code ec;
+  for (auto& candidate : candidates) {
+    if (remote ? remote_exists(candidate.string()) : fs::is_regular_file(candidate, ec)) {
+      return load(candidate.string());
+    }
+  }
+
+  return nullptr;
+}
+
+std::shared_ptr<const ArraySchema>
+SchemaResolver::load(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = cache_.find(path);
+    if (iter != cache_.end()) {
+      return iter->second;
+    }
+  }
+
+  auto schema = std::make_shared<const ArraySchema>(path.c_str());
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  return cache_.emplace(path, schema).first->second;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FilterPipeline;
+
+// A dimension, attribute or internal field of a fragment.
+struct FieldInfo {
+  FieldInfo(const std::string& name, uint8_t datatype, uint32_t cell_val_num, bool nullable)
+      : name_(name)
+      , datatype_(datatype)
+      , cell_val_num_(cell_val_num)
+      , nullable_(nullable) {
+  }
+
+  bool var_sized() const;
+
+  // Size of one cell in bytes, or 0 for var sized fields.
+  uint64_t cell_size() const;
+
+  std::string name_;
+  uint8_t datatype_;
+  uint32_t cell_val_num_;
+  bool nullable_;
+
+  // Set only for fields that come from a schema. file_name_ is the name
+  // of the field's data files in a fragment directory, without the
+  // .tdb, _var.tdb or _validity.tdb suffix. filters_ is the pipeline its
+  // data tiles are written with.
+  std::string file_name_;
+  std::shared_ptr<const FilterPipeline> filters_;
+};
+
+// The parts of a TileDB array schema that determine the layout of its
+// fragment metadata. The schema is stored as a generic tile at offset 0
+// of its file.
+struct ArraySchema {
+  ArraySchema(const char* filename);
+
+  // The fields of a fragment in the order fragment metadata stores them:
+  // attributes, the legacy zipped coordinates, dimensions, then the
+  // timestamp and delete metadata fields when the fragment has them.
+  std::vector<FieldInfo> fields(bool has_timestamps, bool has_delete_meta) const;
+
+  void dump(FILE* out = stderr) const;
+
+  std::string filename_;
+  uint32_t version_;
+  uint8_t array_type_;
+  std::vector<FieldInfo> dims_;
+  std::vector<FieldInfo> attrs_;
+
+  // Var sized fields' offsets tiles and nullable fields' validity tiles
+  // use these rather than the field's own pipeline. Coords filters are
+  // used by internal fields and by dimensions with no filters of their own.
+  std::shared_ptr<const FilterPipeline> coords_filters_;
+  std::shared_ptr<const FilterPipeline> offsets_filters_;
+  std::shared_ptr<const FilterPipeline> validity_filters_;
+};
+
+// Decides which schema (if any) describes a fragment. An explicit schema
+// file wins, then an explicit field count. Otherwise the schema named in
+// the fragment footer is looked up next to the fragment. Parsed schemas
+// are cached so batch runs over one array parse each schema once.
+struct SchemaResolver {
+  SchemaResolver()
+      : nfields_(0) {
+  }
+
+  std::shared_ptr<const ArraySchema> resolve(
+      const std::string& fragment_path, const std::string& schema_name);
+
+  std::shared_ptr<const ArraySchema> load(const std::string& path);
+
+  std::string schema_path_;
+  size_t nfields_;
+
+ private:
+  std::mutex mtx_;
+  std::map<std::string, std::shared_ptr<const ArraySchema>> cache_;
+};
@@ -0,0 +1,390 @@
+#include <math.h>
+#include <string.h>
+
+#include <atomic>
+#include <limits>
+#include <type_traits>
+
+#include "datatype.h"
+#include "stats_kernels.h"
+
+// The vector kernels are written once with GCC vector extensions and
+// compiled for each instruction set through target attributes, so the
+// binary runs on any x86-64 and picks the widest kernel the CPU has.
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+// TileDB sums signed integers as int64, unsigned integers as uint64 and
+// floating point values as double.
+template <class T>
+using Sum = std::conditional_t<
+    std::is_floating_point<T>::value,
+    double,
+    std::conditional_t<std::is_signed<T>::value, int64_t, uint64_t>>;
+
+// Integer sums are accumulated with wrapping unsigned arithmetic and
+// checked afterwards (see sum_is_exact).
+template <class T>
+using LaneSum = std::conditional_t<std::is_floating_point<T>::value, double, uint64_t>;
+
+// The signed integer type comparisons of T produce.
+template <size_t Size>
+struct MaskOf;
+template <> struct MaskOf<1> { typedef int8_t type; };
+template <> struct MaskOf<2> { typedef int16_t type; };
+template <> struct MaskOf<4> { typedef int32_t type; };
+template <> struct MaskOf<8> { typedef int64_t type; };
+
+template <class T>
+using Mask = typename MaskOf<sizeof(T)>::type;
+
+// N lanes of T. The unaligned variant is used to load straight from tile
+// buffers.
+template <class T, size_t N>
+struct Vector {
+  typedef T type __attribute__((vector_size(N * sizeof(T))));
+  typedef T unaligned __attribute__((vector_size(N * sizeof(T)), aligned(1), may_alias));
+};
+
+// Tile buffers aren't guaranteed to be aligned for T.
+template <class T>
+ALWAYS_INLINE T
+load(const uint8_t* data, uint64_t idx) {
+  T val;
+  memcpy(&val, data + idx * sizeof(T), sizeof(T));
+  return val;
+}
+
+template <class T>
+struct Accumulator {
+  T min_ = std::numeric_limits<T>::max();
+  T max_ = std::numeric_limits<T>::lowest();
+  Sum<T> sum_ = 0;
+  bool saturated_ = false;
+  uint64_t nulls_ = 0;
+
+  // Add one non-null value. Comparisons are false for NaN so NaNs never
+  // become the min or max.
+  void add(T val) {
+    if (val < min_) {
+      min_ = val;
+    }
+    if (val > max_) {
+      max_ = val;
+    }
+    if (!saturated_) {
+      add_saturating(val);
+    }
+  }
+
+  // TileDB stops summing a tile at the first value that would overflow
+  // and stores the limit instead.
+  void add_saturating(T val) {
+    typedef Sum<T> S;
+    S value = static_cast<S>(val);
+    if constexpr (std::is_floating_point<T>::value) {
+      if ((sum_ < 0.0) == (value < 0.0)
+          && fabs(sum_) > std::numeric_limits<double>::max() - fabs(value)) {
+        sum_ = sum_ < 0.0 ? std::numeric_limits<double>::lowest() : std::numeric_limits<double>::max();
+        saturated_ = true;
+        return;
+      }
+    } else if constexpr (std::is_signed<S>::value) {
+      if (sum_ > 0 && value > 0 && sum_ > std::numeric_limits<S>::max() - value) {
+        sum_ = std::numeric_limits<S>::max();
+        saturated_ = true;
+        return;
+      }
+      if (sum_ < 0 && value < 0 && sum_ < std::numeric_limits<S>::lowest() - value) {
+        sum_ = std::numeric_limits<S>::lowest();
+        saturated_ = true;
+        return;
+      }
+    } else {
+      if (sum_ > std::numeric_limits<S>::max() - value) {
+        sum_ = std::numeric_limits<S>::max();
+        saturated_ = true;
+        return;
+      }
+    }
+
+    sum_ += value;
+  }
+
+  void finish(uint64_t count, TileStats& stats) const {
+    memset(&stats, 0, sizeof(stats));
+    stats.null_count_ = nulls_;
+    stats.value_count_ = count - nulls_;
+    memcpy(stats.min_, &min_, sizeof(T));
+    memcpy(stats.max_, &max_, sizeof(T));
+    memcpy(stats.sum_, &sum_, sizeof(sum_));
+  }
+};
+
+// The reference implementation, value by value in TileDB's order.
+template <bool Nullable, class T>
+ALWAYS_INLINE void
+scalar_stats(const uint8_t* data, uint64_t count, const uint8_t* validity, Accumulator<T>& acc) {
+  for (uint64_t i = 0; i < count; i++) {
+    if (Nullable && validity[i] == 0) {
+      acc.nulls_++;
+      continue;
+    }
+    acc.add(load<T>(data, i));
+  }
+}
+
+// Whether a sum accumulated in lanes and in wrapping arithmetic equals
+// the saturating sequential one. It does whenever no partial sum in any
+// order can overflow, which the magnitude of the min and max bounds.
+template <class T>
+bool
+sum_is_exact(const Accumulator<T>& acc, uint64_t values) {
+  if constexpr (std::is_floating_point<T>::value) {
+    return !isinf(acc.sum_);
+  }
+
+  if (values == 0) {
+    return true;
+  }
+
+  if constexpr (sizeof(T) < sizeof(uint64_t)) {
+    return values < (1ULL << 31);
+  }
+
+  auto magnitude = [](T val) -> uint64_t {
+    if (std::is_signed<T>::value && val < 0) {
+      return 0 - static_cast<uint64_t>(val);
+    }
+    return static_cast<uint64_t>(val);
+  };
+
+  uint64_t limit = std::is_signed<T>::value ? (uint64_t)INT64_MAX : UINT64_MAX;
+  uint64_t mag = std::max(magnitude(acc.min_), magnitude(acc.max_));
+  return mag <= limit / values;
+}
+
+// Nulls are counted over bytes rather than in the stats loop, where a
+// counter per lane of T would be wider than the vector registers for
+// narrow types. Byte lanes are flushed before they can wrap.
+template <size_t N>
+ALWAYS_INLINE uint64_t
+vector_null_count(const uint8_t* validity, uint64_t count) {
+  typedef typename Vector<uint8_t, N>::type B;
+  typedef typename Vector<uint8_t, N>::unaligned UB;
+
+  uint64_t nulls = 0;
+  uint64_t i = 0;
+  while (i + N <= count) {
+    B vnulls = {};
+    for (int round = 0; round < 255 && i + N <= count; round++, i += N) {
+      B bytes = *reinterpret_cast<const UB*>(validity + i);
+      vnulls -= reinterpret_cast<B>(bytes == 0);
+    }
+    for (size_t lane = 0; lane < N; lane++) {
+      nulls += vnulls[lane];
+    }
+  }
+
+  for (; i < count; i++) {
+    nulls += validity[i] == 0;
+  }
+  return nulls;
+}
+
+// Min, max and sum over N lanes at a time. Null cells are replaced with
+// values that can't change the result, so the loop has no branches.
+// Tiles whose sum could have saturated are redone by scalar_stats.
+template <bool Nullable, class T, size_t N>
+ALWAYS_INLINE void
+vector_stats(const uint8_t* data, uint64_t count, const uint8_t* validity, Accumulator<T>& acc) {
+  typedef typename Vector<T, N>::type V;
+  typedef typename Vector<T, N>::unaligned UV;
+  typedef typename Vector<Mask<T>, N>::type M;
+  typedef typename Vector<LaneSum<T>, N>::type S;
+  typedef typename Vector<uint8_t, N>::unaligned UB;
+
+  const V max_ident = V{} + std::numeric_limits<T>::max();
+  const V min_ident = V{} + std::numeric_limits<T>::lowest();
+  V vmin = max_ident;
+  V vmax = min_ident;
+  S vsum = {};
+
+  uint64_t i = 0;
+  for (; i + N <= count; i += N) {
+    V val = *reinterpret_cast<const UV*>(data + i * sizeof(T));
+    V lo = val;
+    V hi = val;
+    V add = val;
+    if (Nullable) {
+      M valid = __builtin_convertvector(*reinterpret_cast<const UB*>(validity + i), M) != 0;
+      lo = valid ? val : max_ident;
+      hi = valid ? val : min_ident;
+      add = valid ? val : V{};
+    }
+    vmin = lo < vmin ? lo : vmin;
+    vmax = hi > vmax ? hi : vmax;
+    vsum += __builtin_convertvector(add, S);
+  }
+
+  LaneSum<T> sum = 0;
+  for (size_t lane = 0; lane < N; lane++) {
+    acc.min_ = vmin[lane] < acc.min_ ? vmin[lane] : acc.min_;
+    acc.max_ = vmax[lane] > acc.max_ ? vmax[lane] : acc.max_;
+    sum += vsum[lane];
+  }
+
+  for (; i < count; i++) {
+    if (Nullable && validity[i] == 0) {
+      continue;
+    }
+    T val = load<T>(data, i);
+    acc.min_ = val < acc.min_ ? val : acc.min_;
+    acc.max_ = val > acc.max_ ? val : acc.max_;
+    sum += static_cast<LaneSum<T>>(val);
+  }
+
+  if (Nullable) {
+    acc.nulls_ = vector_null_count<N * sizeof(T)>(validity, count);
+  }
+
+  acc.sum_ = static_cast<Sum<T>>(sum);
+  if (!sum_is_exact(acc, count - acc.nulls_)) {
+    acc = Accumulator<T>();
+    scalar_stats<Nullable, T>(data, count, validity, acc);
+  }
+}
+
+struct ScalarIsa {
+  static const char* name() {
+    return "scalar";
+  }
+
+  static bool supported() {
+    return true;
+  }
+
+  template <class T>
+  static void run(const uint8_t* data, uint64_t count, const uint8_t* validity, Accumulator<T>& acc) {
+    if (validity != nullptr) {
+      scalar_stats<true, T>(data, count, validity, acc);
+    } else {
+      scalar_stats<false, T>(data, count, validity, acc);
+    }
+  }
+};
+
+#ifdef HAVE_X86_KERNELS
+struct Avx2Isa {
+  static const char* name() {
+    return "avx2";
+  }
+
+  static bool supported() {
+    return __builtin_cpu_supports("avx2");
+  }
+
+  template <class T>
+  __attribute__((target("avx2")))
+  static void run(const uint8_t* data, uint64_t count, const uint8_t* validity, Accumulator<T>& acc) {
+    if (validity != nullptr) {
+      vector_stats<true, T, 32 / sizeof(T)>(data, count, validity, acc);
+    } else {
+      vector_stats<false, T, 32 / sizeof(T)>(data, count, validity, acc);
+    }
+  }
+};
+
+struct Avx512Isa {
+  static const char* name() {
+    return "avx512";
+  }
+
+  static bool supported() {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+  }
+
+  template <class T>
+  __attribute__((target("avx512f,avx512bw")))
+  static void run(const uint8_t* data, uint64_t count, const uint8_t* validity, Accumulator<T>& acc) {
+    if (validity != nullptr) {
+      vector_stats<true, T, 64 / sizeof(T)>(data, count, validity, acc);
+    } else {
+      vector_stats<false, T, 64 / sizeof(T)>(data, count, validity, acc);
+    }
+  }
+};
+#endif
+
+template <class Isa>
+struct IsaStatsKernel : public StatsKernel {
+  const char* name() const override {
+    return Isa::name();
+  }
+
+  bool compute(
+      uint8_t datatype,
+      const uint8_t* data,
+      uint64_t count,
+      const uint8_t* validity,
+      TileStats& stats) const override {
+    return with_numeric_type(datatype, [&](auto zero) {
+      typedef decltype(zero) T;
+      Accumulator<T> acc;
+      Isa::run(data, count, validity, acc);
+      acc.finish(count, stats);
+    });
+  }
+};
+
+std::atomic<StatsKernel*> selected_kernel{nullptr};
+
+}  // namespace
+
+std::vector<StatsKernel*>
+available_stats_kernels() {
+  static IsaStatsKernel<ScalarIsa> scalar;
+  std::vector<StatsKernel*> ret;
+
+#ifdef HAVE_X86_KERNELS
+  static IsaStatsKernel<Avx512Isa> avx512;
+  static IsaStatsKernel<Avx2Isa> avx2;
+  if (Avx512Isa::supported()) {
+    ret.push_back(&avx512);
+  }
+  if (Avx2Isa::supported()) {
+    ret.push_back(&avx2);
+  }
+#endif
+
+  ret.push_back(&scalar);
+  return ret;
+}
+
+bool
+set_stats_kernel(const char* name) {
+  for (auto kernel : available_stats_kernels()) {
+    if (strcmp(kernel->name(), name) == 0) {
+      selected_kernel = kernel;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+StatsKernel&
+current_stats_kernel() {
+  auto kernel = selected_kernel.load();
+  if (kernel == nullptr) {
+    kernel = available_stats_kernels()[0];
+    selected_kernel = kernel;
+  }
+
+  return *kernel;
+}
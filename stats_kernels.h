@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// The statistics TileDB stores for one tile of a fixed size, single value
+// numeric field, recomputed from the tile's values. min_, max_ and sum_
+// hold the values exactly as the tile_min, tile_max and tile_sum sections
+// store them: min and max in the field's datatype and the sum as an
+// int64, uint64 or double for signed, unsigned and floating point types.
+//
+// Null cells and NaNs are left out of the min and max, and nulls out of
+// the sum. Integer sums saturate at the first value that would overflow,
+// as TileDB's do.
+struct TileStats {
+  uint64_t null_count_;
+  uint64_t value_count_;
+  uint8_t min_[8];
+  uint8_t max_[8];
+  uint8_t sum_[8];
+};
+
+// A backend that computes TileStats. Backends are stateless singletons
+// and may be called concurrently.
+struct StatsKernel {
+  virtual ~StatsKernel() {}
+
+  virtual const char* name() const = 0;
+
+  // Compute the stats of count values of datatype at data. validity is
+  // either nullptr or count bytes that are zero for null cells. Returns
+  // false for datatypes TileDB keeps no sums for.
+  virtual bool compute(
+      uint8_t datatype,
+      const uint8_t* data,
+      uint64_t count,
+      const uint8_t* validity,
+      TileStats& stats) const = 0;
+};
+
+// The backends this build and CPU support, widest vectors first. The
+// first entry is the default.
+std::vector<StatsKernel*> available_stats_kernels();
+
+// Select the backend used by current_stats_kernel. Returns false if no
+// supported backend has that name.
+bool set_stats_kernel(const char* name);
+
+StatsKernel& current_stats_kernel();
@@ -0,0 +1,164 @@
+#include "thread_pool.h"
+
+namespace {
+
+// The pool and queue index of the worker running on this thread, if any.
+thread_local const ThreadPool* tl_pool = nullptr;
+thread_local size_t tl_index = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t nthreads)
+    : queued_(0)
+    , next_queue_(0)
+    , stop_(false) {
+  if (nthreads == 0) {
+    nthreads = std::thread::hardware_concurrency();
+  }
+
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+
+  for (size_t i = 0; i < nthreads; i++) {
+    queues_.emplace_back(new Queue());
+  }
+
+  for (size_t i = 0; i < nthreads; i++) {
+    workers_.emplace_back([this, i]() { worker_main(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mtx_);
+    stop_ = true;
+  }
+  sleep_cv_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void
+ThreadPool::submit(TaskGroup& group, std::function<void()> task) {
+  group.pending_++;
+
+  auto wrapped = [this, &group, task = std::move(task)]() {
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(group.error_mtx_);
+      if (!group.error_) {
+        group.error_ = std::current_exception();
+      }
+    }
+
+    if (--group.pending_ == 0) {
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+      sleep_cv_.notify_all();
+    }
+  };
+
+  size_t idx;
+  if (tl_pool == this) {
+    idx = tl_index;
+  } else {
+    idx = next_queue_++ % queues_.size();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queues_[idx]->mtx_);
+    queues_[idx]->tasks_.push_back(std::move(wrapped));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sleep_mtx_);
+    queued_++;
+  }
+  sleep_cv_.notify_all();
+}
+
+void
+ThreadPool::wait(TaskGroup& group) {
+  while (group.pending_ > 0) {
+    if (run_one()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mtx_);
+    sleep_cv_.wait(lock, [&]() {
+      return group.pending_ == 0 || queued_ > 0;
+    });
+  }
+
+  if (group.error_) {
+    std::rethrow_exception(group.error_);
+  }
+}
+
+bool
+ThreadPool::pop(size_t idx, std::function<void()>& task) {
+  auto& queue = *queues_[idx];
+  std::lock_guard<std::mutex> lock(queue.mtx_);
+  if (queue.tasks_.empty()) {
+    return false;
+  }
+
+  task = std::move(queue.tasks_.back());
+  queue.tasks_.pop_back();
+  queued_--;
+  return true;
+}
+
+bool
+ThreadPool::steal(size_t idx, std::function<void()>& task) {
+  auto& queue = *queues_[idx];
+  std::lock_guard<std::mutex> lock(queue.mtx_);
+  if (queue.tasks_.empty()) {
+    return false;
+  }
+
+  task = std::move(queue.tasks_.front());
+  queue.tasks_.pop_front();
+  queued_--;
+  return true;
+}
+
+bool
+ThreadPool::run_one() {
+  std::function<void()> task;
+
+  size_t self = (tl_pool == this) ? tl_index : 0;
+  bool found = (tl_pool == this) && pop(self, task);
+
+  for (size_t i = 0; !found && i < queues_.size(); i++) {
+    found = steal((self + i) % queues_.size(), task);
+  }
+
+  if (!found) {
+    return false;
+  }
+
+  task();
+  return true;
+}
+
+void
+ThreadPool::worker_main(size_t idx) {
+  tl_pool = this;
+  tl_index = idx;
+
+  while (true) {
+    if (run_one()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mtx_);
+    sleep_cv_.wait(lock, [&]() { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0) {
+      return;
+    }
+  }
+}
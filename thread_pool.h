@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tracks the number of outstanding tasks submitted against it so that a
+// caller can wait for just its own work to finish. The first exception
+// thrown by any task in the group is rethrown from ThreadPool::wait.
+struct TaskGroup {
+  std::atomic<size_t> pending_{0};
+  std::mutex error_mtx_;
+  std::exception_ptr error_;
+};
+
+// A fixed size work-stealing thread pool. Each worker owns a deque of tasks
+// that it pops from the back while idle workers steal from the front of
+// their peers. Tasks submitted from inside a worker land on that worker's
+// own deque which keeps nested fan-out (files -> tiles -> chunks) local.
+//
+// ThreadPool::wait runs queued tasks while it waits, so it is safe to call
+// from inside a task without starving the pool.
+struct ThreadPool {
+  ThreadPool(size_t nthreads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(TaskGroup& group, std::function<void()> task);
+  void wait(TaskGroup& group);
+
+  size_t size() const {
+    return workers_.size();
+  }
+
+ private:
+  struct Queue {
+    std::mutex mtx_;
+    std::deque<std::function<void()>> tasks_;
+  };
+
+  bool pop(size_t idx, std::function<void()>& task);
+  bool steal(size_t idx, std::function<void()>& task);
+  bool run_one();
+  void worker_main(size_t idx);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex sleep_mtx_;
+  std::condition_variable sleep_cv_;
+  std::atomic<size_t> queued_;
+  std::atomic<size_t> next_queue_;
+  bool stop_;
+};
@@ -1,23 +1,20 @@
 #include <stdio.h>
+#include <string.h>
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include "arena.h"
 #include "decompressor.h"
 #include "deserializer.h"
+#include "filter_pipeline.h"
+#include "instrument.h"
 #include "reader.h"
+#include "thread_pool.h"
 #include "tile.h"
 
-struct ChunkData {
-  ChunkData(uint8_t* buf, size_t nbytes);
-
-  size_t size() {
-    return filtered_chunks_.size();
-  }
-
-  void dump();
-
-  std::vector<DiskLayout> filtered_chunks_;
-  uint64_t orig_size;
-};
-
 struct Header {
   static const uint64_t BASE_SIZE =
       3 * sizeof(uint64_t) + 2 * sizeof(char) + 2 * sizeof(uint32_t);
@@ -32,7 +29,7 @@ struct Header {
       , filter_pipeline_size(0) {
   }
 
-  void dump();
+  void dump(FILE* out = stderr);
 
   uint32_t version;
   uint64_t persisted_size;
@@ -41,6 +38,7 @@ struct Header {
   uint64_t cell_size;
   uint8_t encryption_type;
   uint32_t filter_pipeline_size;
+  std::shared_ptr<const FilterPipeline> pipeline;
 };
 
 DiskLayout::DiskLayout()
@@ -53,14 +51,18 @@ DiskLayout::DiskLayout()
 }
 
 void
-DiskLayout::dump() {
-  fprintf(stderr, "    DiskLayout\n");
-  fprintf(stderr, "        Unfiltered data: %u bytes at %llu offset\n", unfiltered_data_size_, unfiltered_data_offset_);
-  fprintf(stderr, "        Filtered Metadata: %u bytes\n", filtered_metadata_size_);
-  fprintf(stderr, "        Filtered Data: %u bytes\n", filtered_data_size_);
+DiskLayout::dump(FILE* out) {
+  fprintf(out, "    DiskLayout\n");
+  fprintf(out, "        Unfiltered data: %u bytes at %llu offset\n", unfiltered_data_size_, unfiltered_data_offset_);
+  fprintf(out, "        Filtered Metadata: %u bytes\n", filtered_metadata_size_);
+  fprintf(out, "        Filtered Data: %u bytes\n", filtered_data_size_);
 }
 
-ChunkData::ChunkData(uint8_t* buf, size_t nbytes) {
+ChunkData::ChunkData(const uint8_t* buf, size_t nbytes)
+    : filtered_chunks_(scratch_resource()) {
+  PhaseTimer timer(PHASE_CHUNK_LIST);
+  timer.add_bytes(nbytes, 0);
+
   Deserializer deserializer(buf, nbytes);
   uint64_t num_chunks = deserializer.read<uint64_t>();
 
@@ -76,42 +78,62 @@ ChunkData::ChunkData(uint8_t* buf, size_t nbytes) {
     chunk.filtered_data_size_ = deserializer.read<uint32_t>();
     chunk.filtered_metadata_size_ = deserializer.read<uint32_t>();
 
-    chunk.filtered_metadata_ = const_cast<uint8_t*>(
-        deserializer.get_ptr<uint8_t>(chunk.filtered_metadata_size_));
+    chunk.filtered_metadata_ =
+        deserializer.get_ptr<uint8_t>(chunk.filtered_metadata_size_);
 
-    chunk.filtered_data_ = const_cast<uint8_t*>(
-        deserializer.get_ptr<uint8_t>(chunk.filtered_data_size_));
+    chunk.filtered_data_ =
+        deserializer.get_ptr<uint8_t>(chunk.filtered_data_size_);
 
     orig_size += chunk.unfiltered_data_size_;
   }
 }
 
 void
-ChunkData::dump() {
-  fprintf(stderr, "ChunkData:\n");
-  fprintf(stderr, "    NumChunks: %zu\n", filtered_chunks_.size());
+ChunkData::dump(FILE* out) {
+  fprintf(out, "ChunkData:\n");
+  fprintf(out, "    NumChunks: %zu\n", filtered_chunks_.size());
   for (auto& chunk : filtered_chunks_) {
-    chunk.dump();
+    chunk.dump(out);
   }
 }
 
 void
-Header::dump() {
-  fprintf(stderr, "Tile Header:\n");
-  fprintf(stderr, "    Version: %u\n", version);
-  fprintf(stderr, "    Persisted Size: %llu\n", persisted_size);
-  fprintf(stderr, "    Tile Size: %llu\n", tile_size);
-  fprintf(stderr, "    Datatype: %u\n", datatype);
-  fprintf(stderr, "    Cell Size: %llu\n", cell_size);
-  fprintf(stderr, "    Encryption Type: %u\n", encryption_type);
-  fprintf(stderr, "    Filter Pipeline Size: %u\n", filter_pipeline_size);
+Header::dump(FILE* out) {
+  fprintf(out, "Tile Header:\n");
+  fprintf(out, "    Version: %u\n", version);
+  fprintf(out, "    Persisted Size: %llu\n", persisted_size);
+  fprintf(out, "    Tile Size: %llu\n", tile_size);
+  fprintf(out, "    Datatype: %u\n", datatype);
+  fprintf(out, "    Cell Size: %llu\n", cell_size);
+  fprintf(out, "    Encryption Type: %u\n", encryption_type);
+  fprintf(out, "    Filter Pipeline Size: %u\n", filter_pipeline_size);
+  if (pipeline) {
+    pipeline->dump(out);
+  }
+}
+
+// Every tile in a file normally carries the same pipeline, so the last one
+// parsed on each thread is shared by later tiles with identical bytes.
+static std::shared_ptr<const FilterPipeline>
+parse_pipeline(const uint8_t* buf, size_t nbytes) {
+  thread_local std::vector<uint8_t> last_bytes;
+  thread_local std::shared_ptr<const FilterPipeline> last;
+
+  if (last && last_bytes.size() == nbytes && memcmp(last_bytes.data(), buf, nbytes) == 0) {
+    return last;
+  }
+
+  last = std::make_shared<const FilterPipeline>(buf, nbytes);
+  last_bytes.assign(buf, buf + nbytes);
+  return last;
 }
 
 Header read_header(Reader& reader, uint64_t offset) {
+  PhaseTimer timer(PHASE_HEADER);
   Header header;
-  std::vector<uint8_t> buf(Header::BASE_SIZE);
-  reader.read(buf.data(), buf.size(), offset);
-  Deserializer dser(buf.data(), buf.size());
+  std::pmr::vector<uint8_t> scratch(scratch_resource());
+  auto buf = reader.view(Header::BASE_SIZE, offset, scratch);
+  Deserializer dser(buf, Header::BASE_SIZE);
 
   header.version = dser.read<uint32_t>();
   header.persisted_size = dser.read<uint64_t>();
@@ -121,51 +143,164 @@ Header read_header(Reader& reader, uint64_t offset) {
   header.encryption_type = dser.read<uint8_t>();
   header.filter_pipeline_size = dser.read<uint32_t>();
 
-  // We read the bytes that contain the filter pipeline settings but
-  // generic tiles have a single statically defined filter pipeline that
-  // I've implemented outside of TileDB core. This read just exists to show
-  // where the bytes are and to avoid the Reader::show_read_report from
-  // listing each filter pipeline as unread.
+  auto fp_buf = reader.view(
+      header.filter_pipeline_size, offset + Header::BASE_SIZE, scratch);
+  if (header.filter_pipeline_size > 0) {
+    header.pipeline = parse_pipeline(fp_buf, header.filter_pipeline_size);
+  }
 
-  std::vector<uint8_t> fp_buf(header.filter_pipeline_size);
-  reader.read(fp_buf.data(), fp_buf.size(), offset + Header::BASE_SIZE);
+  timer.add_bytes(Header::BASE_SIZE + header.filter_pipeline_size, 0);
 
   return header;
 }
 
-Tile read_tile(Reader& reader, uint64_t offset) {
-  //fprintf(stderr, "Reading tile at offset: %llu\n", offset);
+// Unfilter one chunk into dst using the tile's pipeline.
+static void
+decode_chunk(const Header& header, DiskLayout& chunk, uint8_t* dst) {
+  PhaseTimer timer(PHASE_DECOMPRESS);
+  timer.add_bytes(
+      (uint64_t)chunk.filtered_metadata_size_ + chunk.filtered_data_size_,
+      chunk.unfiltered_data_size_);
+
+  // Tiles without a stored pipeline use the historical gzip only one.
+  if (header.filter_pipeline_size == 0) {
+    tdb_decompress(chunk, dst, chunk.unfiltered_data_size_);
+  } else {
+    FilterTileInfo info = {header.datatype, header.cell_size};
+    header.pipeline->unfilter_chunk(info, chunk, dst, chunk.unfiltered_data_size_);
+  }
+}
 
-  auto header = read_header(reader, offset);
+static Tile
+decode_tile(Reader& reader, const Header& header, uint64_t offset, ThreadPool* pool, std::pmr::memory_resource* mr) {
   uint64_t data_offset = offset + Header::BASE_SIZE + header.filter_pipeline_size;
 
-  std::vector<uint8_t> raw_tile_data(header.persisted_size);
-  reader.read(raw_tile_data.data(), raw_tile_data.size(), data_offset);
+  // With a memory mapped reader raw_tile_data stays empty and the chunks
+  // point directly into the mapping.
+  std::pmr::vector<uint8_t> raw_tile_data(scratch_resource());
+  auto raw = reader.view(header.persisted_size, data_offset, raw_tile_data);
 
-  ChunkData chunks(raw_tile_data.data(), raw_tile_data.size());
+  ChunkData chunks(raw, header.persisted_size);
 
   if (chunks.orig_size != header.tile_size) {
-    fprintf(stderr, "Error deserializing tile, header size mismatch.");
-    exit(2);
+    throw std::runtime_error("Error deserializing tile, header size mismatch.");
   }
 
   Tile tile(
       header.version,
       header.datatype,
       header.cell_size,
-      header.tile_size);
+      header.tile_size,
+      mr);
 
-  for (size_t i = 0; i < chunks.size(); i++) {
+  // Each chunk's destination is fixed by its unfiltered offset so chunks
+  // can be decompressed independently into their slice of the tile.
+  auto decompress_chunk = [&](size_t i) {
     auto& chunk = chunks.filtered_chunks_[i];
-    tdb_decompress(chunk, tile.data_.data(), tile.data_.size());
+    decode_chunk(header, chunk, tile.data_.data() + chunk.unfiltered_data_offset_);
+  };
+
+  if (pool == nullptr || chunks.size() < 2 || header.tile_size < PARALLEL_DECOMPRESS_MIN_BYTES) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      decompress_chunk(i);
+    }
+    return tile;
+  }
+
+  TaskGroup group;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    pool->submit(group, [&, i]() { decompress_chunk(i); });
+  }
+  pool->wait(group);
+
+  return tile;
+}
+
+// Read a tile's chunks one at a time and hand each to fn. Each read fetches
+// one chunk's metadata and data plus the header of the chunk after it, so
+// every byte is read exactly once and only a single filtered chunk is held
+// at a time. The chunk's filtered pointers are only valid during fn.
+static void
+for_each_chunk(Reader& reader, const Header& header, uint64_t offset, const std::function<void(DiskLayout&)>& fn) {
+  const uint64_t CHUNK_HEADER_SIZE = 3 * sizeof(uint32_t);
+
+  uint64_t pos = offset + Header::BASE_SIZE + header.filter_pipeline_size;
+  uint64_t end = pos + header.persisted_size;
+
+  std::pmr::vector<uint8_t> raw(scratch_resource());
+  auto nbytes = std::min(sizeof(uint64_t) + CHUNK_HEADER_SIZE, header.persisted_size);
+  auto buf = reader.view(nbytes, pos, raw);
+  Deserializer dser(buf, nbytes);
+  uint64_t num_chunks = dser.read<uint64_t>();
+  pos += nbytes;
+
+  uint64_t unfiltered_offset = 0;
+  for (uint64_t i = 0; i < num_chunks; i++) {
+    DiskLayout chunk;
+    chunk.unfiltered_data_size_ = dser.read<uint32_t>();
+    chunk.unfiltered_data_offset_ = unfiltered_offset;
+    chunk.filtered_data_size_ = dser.read<uint32_t>();
+    chunk.filtered_metadata_size_ = dser.read<uint32_t>();
+
+    uint64_t payload = (uint64_t)chunk.filtered_metadata_size_ + chunk.filtered_data_size_;
+    uint64_t next_header = i + 1 < num_chunks ? CHUNK_HEADER_SIZE : 0;
+    if (pos + payload + next_header > end) {
+      throw std::runtime_error("Error deserializing tile, chunk extends past tile.");
+    }
+
+    if (unfiltered_offset + chunk.unfiltered_data_size_ > header.tile_size) {
+      throw std::runtime_error("Error deserializing tile, header size mismatch.");
+    }
+
+    buf = reader.view(payload + next_header, pos, raw);
+    pos += payload + next_header;
+
+    chunk.filtered_metadata_ = buf;
+    chunk.filtered_data_ = buf + chunk.filtered_metadata_size_;
+    dser = Deserializer(buf + payload, next_header);
+
+    fn(chunk);
+
+    unfiltered_offset += chunk.unfiltered_data_size_;
   }
 
+  if (unfiltered_offset != header.tile_size) {
+    throw std::runtime_error("Error deserializing tile, header size mismatch.");
+  }
+}
+
+Tile read_tile(Reader& reader, uint64_t offset, ThreadPool* pool, std::pmr::memory_resource* mr, uint64_t budget) {
+  //fprintf(stderr, "Reading tile at offset: %llu\n", offset);
+
+  auto header = read_header(reader, offset);
+  uint64_t disk_size = Header::BASE_SIZE + header.filter_pipeline_size + header.persisted_size;
+  if (header.persisted_size + header.tile_size <= budget) {
+    Tile tile = decode_tile(reader, header, offset, pool, mr);
+    tile.disk_size_ = disk_size;
+    return tile;
+  }
+
+  // Too big to hold filtered and unfiltered at once, so unfilter straight
+  // into the tile a chunk at a time.
+  Tile tile(
+      header.version,
+      header.datatype,
+      header.cell_size,
+      header.tile_size,
+      mr);
+
+  tile.disk_size_ = disk_size;
+
+  for_each_chunk(reader, header, offset, [&](DiskLayout& chunk) {
+    decode_chunk(header, chunk, tile.data_.data() + chunk.unfiltered_data_offset_);
+  });
+
   return tile;
 }
 
-void Tile::dump() {
-  fprintf(stderr, "    Version: %u\n", version_);
-  fprintf(stderr, "    Datatype: %u\n", datatype_);
-  fprintf(stderr, "    Cell Size: %llu\n", cell_size_);
-  fprintf(stderr, "    Data Size: %lu\n", data_.size());
+void Tile::dump(FILE* out) {
+  fprintf(out, "    Version: %u\n", version_);
+  fprintf(out, "    Datatype: %u\n", datatype_);
+  fprintf(out, "    Cell Size: %llu\n", cell_size_);
+  fprintf(out, "    Data Size: %lu\n", size());
 }
@@ -1,39 +1,211 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <string.h>
+
 #include <cstdint>
+#include <memory_resource>
+#include <stdexcept>
 #include <vector>
 
 #include "reader.h"
 
+struct ThreadPool;
+
 struct DiskLayout {
   DiskLayout();
-  void dump();
+  void dump(FILE* out = stderr);
 
   uint32_t unfiltered_data_size_;
   uint64_t unfiltered_data_offset_;
   uint32_t filtered_data_size_;
   uint32_t filtered_metadata_size_;
-  uint8_t* filtered_metadata_;
-  uint8_t* filtered_data_;
+  const uint8_t* filtered_metadata_;
+  const uint8_t* filtered_data_;
+};
+
+// The chunk list that follows a generic tile's header. Chunk pointers
+// point into the buffer it was parsed from.
+struct ChunkData {
+  ChunkData(const uint8_t* buf, size_t nbytes);
+
+  size_t size() {
+    return filtered_chunks_.size();
+  }
+
+  void dump(FILE* out = stderr);
+
+  std::pmr::vector<DiskLayout> filtered_chunks_;
+  uint64_t orig_size;
 };
 
+// A read only view of count values of type T.
+template <class T>
+struct Span {
+  Span()
+      : data_(nullptr)
+      , size_(0) {
+  }
+
+  Span(const T* data, size_t size)
+      : data_(data)
+      , size_(size) {
+  }
+
+  const T* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  const T& operator[](size_t idx) const {
+    return data_[idx];
+  }
+
+  const T* begin() const {
+    return data_;
+  }
+
+  const T* end() const {
+    return data_ + size_;
+  }
+
+  const T* data_;
+  size_t size_;
+};
+
+// A decoded tile. Its data is allocated from the memory resource it was
+// created with, which is kept across moves so tiles can be decoded
+// directly into their owner's arena. Tiles are allocator aware so a
+// std::pmr::vector<Tile> hands its resource down to each element.
+//
+// A tile may instead view bytes it doesn't own, such as a section in a
+// mapped cache file. Read the bytes through data() and size(), which
+// cover both cases.
 struct Tile {
-  Tile() {}
+  using allocator_type = std::pmr::polymorphic_allocator<uint8_t>;
 
-  Tile(uint32_t version, uint8_t datatype, uint64_t cell_size, size_t data_size)
+  explicit Tile(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+      : data_(mr) {
+  }
+
+  explicit Tile(const allocator_type& alloc)
+      : data_(alloc) {
+  }
+
+  Tile(const Tile& other, const allocator_type& alloc)
+      : version_(other.version_)
+      , datatype_(other.datatype_)
+      , cell_size_(other.cell_size_)
+      , disk_size_(other.disk_size_)
+      , data_(other.data_, alloc)
+      , view_(other.view_)
+      , view_size_(other.view_size_) {
+  }
+
+  Tile(Tile&& other, const allocator_type& alloc)
+      : version_(other.version_)
+      , datatype_(other.datatype_)
+      , cell_size_(other.cell_size_)
+      , disk_size_(other.disk_size_)
+      , data_(std::move(other.data_), alloc)
+      , view_(other.view_)
+      , view_size_(other.view_size_) {
+  }
+
+  Tile(const Tile&) = default;
+  Tile(Tile&&) = default;
+  Tile& operator=(const Tile&) = default;
+  Tile& operator=(Tile&&) = default;
+
+  Tile(uint32_t version, uint8_t datatype, uint64_t cell_size, size_t data_size,
+      std::pmr::memory_resource* mr = std::pmr::get_default_resource())
       : version_(version)
       , datatype_(datatype)
       , cell_size_(cell_size)
-      , data_(data_size) {
+      , disk_size_(0)
+      , data_(data_size, mr) {
+  }
+
+  void dump(FILE* out = stderr);
+
+  const uint8_t* data() const {
+    return view_ != nullptr ? view_ : data_.data();
+  }
+
+  size_t size() const {
+    return view_ != nullptr ? view_size_ : data_.size();
   }
 
-  void dump();
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // View count values of type T starting offset bytes into the data.
+  // Throws if the values run past the end of the tile.
+  template <class T>
+  Span<T> values(uint64_t offset, uint64_t count) const {
+    if (offset > size() || count > (size() - offset) / sizeof(T)) {
+      throw std::logic_error("Reading data past end of serialized data size.");
+    }
+
+    auto ptr = data() + offset;
+    if (reinterpret_cast<uintptr_t>(ptr) % alignof(T) != 0) {
+      throw std::logic_error("Misaligned values in tile data.");
+    }
+
+    return Span<T>(reinterpret_cast<const T*>(ptr), count);
+  }
+
+  // Read one value of type T at offset bytes into the data.
+  template <class T>
+  T value(uint64_t offset) const {
+    if (offset > size() || sizeof(T) > size() - offset) {
+      throw std::logic_error("Reading data past end of serialized data size.");
+    }
+
+    T ret;
+    memcpy(&ret, data() + offset, sizeof(T));
+    return ret;
+  }
 
   uint32_t version_;
   uint8_t datatype_;
   uint64_t cell_size_;
-  std::vector<uint8_t> data_;
+
+  // Bytes the tile occupies in its file, header included.
+  uint64_t disk_size_ = 0;
+
+  std::pmr::vector<uint8_t> data_;
+
+  // Set for a tile that views bytes it doesn't own, in which case data_ is
+  // empty. The owner of those bytes must outlive the tile.
+  const uint8_t* view_ = nullptr;
+  size_t view_size_ = 0;
 };
 
-Tile read_tile(Reader& reader, uint64_t offset);
+// Tiles at least this large with more than one chunk have their chunks
+// decompressed in parallel when read_tile is given a pool.
+#define PARALLEL_DECOMPRESS_MIN_BYTES (4 * 1024 * 1024)
+
+// Tiles whose filtered plus unfiltered size is above this many bytes are
+// read a chunk at a time rather than whole.
+#define DEFAULT_TILE_BUDGET (64 * 1024 * 1024)
+
+// Read and unfilter the tile at offset into memory from mr. Tiles whose
+// filtered plus unfiltered size is over budget are read a chunk at a time
+// and unfiltered straight into the result, so the filtered tile is never
+// held whole.
+Tile read_tile(
+    Reader& reader,
+    uint64_t offset,
+    ThreadPool* pool = nullptr,
+    std::pmr::memory_resource* mr = std::pmr::get_default_resource(),
+    uint64_t budget = DEFAULT_TILE_BUDGET);
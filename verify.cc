@@ -0,0 +1,471 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <memory_resource>
+#include <stdexcept>
+#include <string_view>
+
+#include "arena.h"
+#include "datatype.h"
+#include "emitter.h"
+#include "filter_pipeline.h"
+#include "fragment_metadata.h"
+#include "instrument.h"
+#include "reader.h"
+#include "stats_kernels.h"
+#include "thread_pool.h"
+#include "tile.h"
+#include "verify.h"
+
+namespace {
+
+// Min and max are compared by value so that 0.0 and -0.0, which TileDB
+// may pick either of depending on order, compare equal.
+bool
+same_value(uint8_t datatype, const uint8_t* a, const uint8_t* b, size_t nbytes) {
+  if (datatype == DATATYPE_FLOAT32) {
+    float x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return x == y || (isnan(x) && isnan(y));
+  }
+
+  if (datatype == DATATYPE_FLOAT64) {
+    double x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return x == y || (isnan(x) && isnan(y));
+  }
+
+  return memcmp(a, b, nbytes) == 0;
+}
+
+bool
+same_sum(uint8_t datatype, const uint8_t* a, const uint8_t* b) {
+  if (datatype != DATATYPE_FLOAT32 && datatype != DATATYPE_FLOAT64) {
+    return memcmp(a, b, sizeof(uint64_t)) == 0;
+  }
+
+  double x, y;
+  memcpy(&x, a, sizeof(x));
+  memcpy(&y, b, sizeof(y));
+  if (x == y || (isnan(x) && isnan(y))) {
+    return true;
+  }
+
+  return fabs(x - y) <= VERIFY_SUM_TOLERANCE * std::max(fabs(x), fabs(y));
+}
+
+// Data tiles are the filtered chunk list alone, without the generic tile
+// header, and run up to the next tile's offset or the end of the file.
+struct DataFile {
+  DataFile(const std::filesystem::path& path, bool use_mmap, Span<uint64_t> offsets, uint64_t file_size)
+      : reader_(path.c_str(), use_mmap)
+      , offsets_(offsets)
+      , file_size_(file_size)
+      , raw_(scratch_resource())
+      , data_(scratch_resource()) {
+  }
+
+  // Read and unfilter tile idx into data_.
+  void read(size_t idx, const FilterPipeline& filters, FilterTileInfo info, PhaseTimer& timer) {
+    uint64_t start = offsets_[idx];
+    uint64_t end = idx + 1 < offsets_.size() ? offsets_[idx + 1] : file_size_;
+    if (end < start) {
+      throw std::logic_error("Data tile offsets of '" + reader_.filename_ + "' are out of order.");
+    }
+
+    auto raw = reader_.view(end - start, start, raw_);
+    ChunkData chunks(raw, end - start);
+    data_.resize(chunks.orig_size);
+    for (auto& chunk : chunks.filtered_chunks_) {
+      filters.unfilter_chunk(
+          info, chunk, data_.data() + chunk.unfiltered_data_offset_, chunk.unfiltered_data_size_);
+    }
+
+    timer.add_bytes(end - start, data_.size());
+  }
+
+  Reader reader_;
+  Span<uint64_t> offsets_;
+  uint64_t file_size_;
+  std::pmr::vector<uint8_t> raw_;
+  std::pmr::vector<uint8_t> data_;
+};
+
+std::filesystem::path
+existing_file(const std::filesystem::path& dir, const std::string& name) {
+  auto path = dir / name;
+  std::error_code ec;
+  if (!std::filesystem::is_regular_file(path, ec)) {
+    throw std::logic_error("Missing data file '" + path.string() + "'.");
+  }
+  return path;
+}
+
+// Which stored stats a field has. Sections TileDB leaves empty for a
+// field aren't checked, while ones of the wrong size are an error.
+bool
+has_stat(const char* stat, uint64_t nbytes, uint64_t expected, bool applies) {
+  if (nbytes == 0 || !applies) {
+    return false;
+  }
+
+  if (nbytes != expected) {
+    throw std::logic_error(
+        std::string(stat) + " holds " + std::to_string(nbytes) + " bytes, expected "
+        + std::to_string(expected) + ".");
+  }
+
+  return true;
+}
+
+void
+verify_field(FragmentMetadata& fmd, bool use_mmap, FieldVerification& result) {
+  auto& footer = fmd.footer_;
+  auto& field = footer.fields_[result.field_];
+  auto idx = result.field_;
+  result.name_ = field.name_;
+
+  if (!footer.schema_ || !field.filters_) {
+    result.skipped_ = "no schema";
+    return;
+  }
+
+  auto offsets = fmd.tile_offsets(idx);
+  uint64_t ntiles = offsets.size();
+  if (ntiles == 0) {
+    result.skipped_ = "no data tiles";
+    return;
+  }
+
+  auto dir = std::filesystem::path(fmd.reader_.filename_).parent_path();
+  auto data_path = dir / (field.file_name_ + ".tdb");
+  std::error_code ec;
+  if (!std::filesystem::is_regular_file(data_path, ec)) {
+    result.skipped_ = "missing " + data_path.filename().string();
+    return;
+  }
+
+  bool var = field.var_sized();
+  bool numeric = !var && field.cell_val_num_ == 1 && is_numeric(field.datatype_);
+  uint64_t cell_size = var ? datatype_size(field.datatype_) : field.cell_size();
+  uint64_t value_size = var ? sizeof(uint64_t) : cell_size;
+
+  auto mins = fmd.tile_min(idx);
+  auto maxs = fmd.tile_max(idx);
+  auto sums = fmd.tile_sum(idx);
+  auto null_counts = fmd.tile_null_count(idx);
+  auto min_var = var ? fmd.tile_min_var(idx) : Span<uint8_t>();
+  auto max_var = var ? fmd.tile_max_var(idx) : Span<uint8_t>();
+
+  bool check_min = has_stat("tile_min", mins.size(), ntiles * value_size, true);
+  bool check_max = has_stat("tile_max", maxs.size(), ntiles * value_size, true);
+  bool check_sum = has_stat("tile_sum", sums.size(), ntiles * sizeof(uint64_t), numeric);
+  bool check_nulls = has_stat(
+      "tile_null_count", null_counts.size() * sizeof(uint64_t), ntiles * sizeof(uint64_t), true);
+
+  if (check_min) {
+    result.checked_.push_back("min");
+  }
+  if (check_max) {
+    result.checked_.push_back("max");
+  }
+  if (check_sum) {
+    result.checked_.push_back("sum");
+  }
+  if (check_nulls) {
+    result.checked_.push_back("null_count");
+  }
+
+  if (result.checked_.empty()) {
+    result.skipped_ = "no stored statistics";
+    return;
+  }
+
+  auto& schema = *footer.schema_;
+  PhaseTimer timer(PHASE_VERIFY);
+
+  DataFile data(data_path, use_mmap, offsets, footer.file_sizes_[idx]);
+
+  std::unique_ptr<DataFile> var_data;
+  if (var) {
+    auto var_offsets = fmd.tile_var_offsets(idx);
+    if (var_offsets.size() != ntiles) {
+      throw std::logic_error("Field has " + std::to_string(var_offsets.size()) + " var tiles for "
+          + std::to_string(ntiles) + " tiles.");
+    }
+    var_data.reset(new DataFile(
+        existing_file(dir, field.file_name_ + "_var.tdb"), use_mmap, var_offsets,
+        footer.file_var_sizes_[idx]));
+  }
+
+  std::unique_ptr<DataFile> validity;
+  if (field.nullable_) {
+    auto validity_offsets = fmd.tile_validity_offsets(idx);
+    if (validity_offsets.size() != ntiles) {
+      throw std::logic_error("Field has " + std::to_string(validity_offsets.size())
+          + " validity tiles for " + std::to_string(ntiles) + " tiles.");
+    }
+    validity.reset(new DataFile(
+        existing_file(dir, field.file_name_ + "_validity.tdb"), use_mmap, validity_offsets,
+        footer.file_validity_sizes_[idx]));
+  }
+
+  auto mismatch = [&](uint64_t tile, const char* stat, std::string stored, std::string computed) {
+    result.num_mismatches_++;
+    if (result.mismatches_.size() < VERIFY_MAX_MISMATCHES) {
+      result.mismatches_.push_back({tile, stat, std::move(stored), std::move(computed)});
+    }
+  };
+
+  // The stored min or max of tile t of a var sized field.
+  auto var_value = [&](Span<uint8_t> offsets_bytes, Span<uint8_t> values, uint64_t t) {
+    uint64_t start, end = values.size();
+    memcpy(&start, offsets_bytes.data() + t * sizeof(uint64_t), sizeof(uint64_t));
+    if (t + 1 < ntiles) {
+      memcpy(&end, offsets_bytes.data() + (t + 1) * sizeof(uint64_t), sizeof(uint64_t));
+    }
+    if (start > end || end > values.size()) {
+      throw std::logic_error("Var sized min or max of tile " + std::to_string(t) + " is out of bounds.");
+    }
+    return std::string_view(reinterpret_cast<const char*>(values.data()) + start, end - start);
+  };
+
+  auto& kernel = current_stats_kernel();
+  for (uint64_t t = 0; t < ntiles; t++) {
+    if (var) {
+      data.read(t, *schema.offsets_filters_, {DATATYPE_UINT64, sizeof(uint64_t)}, timer);
+    } else {
+      data.read(t, *field.filters_, {field.datatype_, cell_size}, timer);
+    }
+
+    uint64_t cells = var ? data.data_.size() / sizeof(uint64_t) : data.data_.size() / cell_size;
+    if (data.data_.size() != cells * (var ? sizeof(uint64_t) : cell_size)) {
+      throw std::logic_error("Tile " + std::to_string(t) + " is not a whole number of cells.");
+    }
+
+    if (var) {
+      var_data->read(t, *field.filters_, {field.datatype_, cell_size}, timer);
+    }
+
+    const uint8_t* valid = nullptr;
+    if (validity) {
+      validity->read(t, *schema.validity_filters_, {DATATYPE_UINT8, 1}, timer);
+      if (validity->data_.size() != cells) {
+        throw std::logic_error("Validity tile " + std::to_string(t) + " has "
+            + std::to_string(validity->data_.size()) + " values for " + std::to_string(cells) + " cells.");
+      }
+      valid = validity->data_.data();
+    }
+
+    result.tiles_++;
+    result.bytes_ += data.data_.size() + (var ? var_data->data_.size() : 0) + (valid ? cells : 0);
+
+    uint64_t null_count = 0;
+    uint64_t value_count = 0;
+
+    if (numeric) {
+      TileStats stats;
+      kernel.compute(field.datatype_, data.data_.data(), cells, valid, stats);
+      null_count = stats.null_count_;
+      value_count = stats.value_count_;
+
+      auto stored_min = mins.data() + t * cell_size;
+      auto stored_max = maxs.data() + t * cell_size;
+      auto stored_sum = sums.data() + t * sizeof(uint64_t);
+      if (check_min && value_count > 0 && !same_value(field.datatype_, stored_min, stats.min_, cell_size)) {
+        mismatch(t, "min", format_number(field.datatype_, stored_min), format_number(field.datatype_, stats.min_));
+      }
+      if (check_max && value_count > 0 && !same_value(field.datatype_, stored_max, stats.max_, cell_size)) {
+        mismatch(t, "max", format_number(field.datatype_, stored_max), format_number(field.datatype_, stats.max_));
+      }
+      if (check_sum && !same_sum(field.datatype_, stored_sum, stats.sum_)) {
+        mismatch(t, "sum", format_sum(field.datatype_, stored_sum), format_sum(field.datatype_, stats.sum_));
+      }
+    } else {
+      // Strings and multi-value cells order byte-wise, shorter first on a
+      // common prefix, as TileDB compares them.
+      std::string_view min, max;
+      auto cell_offset = [&](uint64_t c) {
+        uint64_t offset;
+        memcpy(&offset, data.data_.data() + c * sizeof(uint64_t), sizeof(offset));
+        return offset;
+      };
+      for (uint64_t c = 0; c < cells; c++) {
+        if (valid != nullptr && valid[c] == 0) {
+          null_count++;
+          continue;
+        }
+
+        std::string_view cell;
+        if (var) {
+          auto& values = var_data->data_;
+          uint64_t start = cell_offset(c);
+          uint64_t end = c + 1 < cells ? cell_offset(c + 1) : values.size();
+          if (start > end || end > values.size()) {
+            throw std::logic_error("Offsets of tile " + std::to_string(t) + " are out of bounds.");
+          }
+          cell = std::string_view(reinterpret_cast<const char*>(values.data()) + start, end - start);
+        } else {
+          cell = std::string_view(reinterpret_cast<const char*>(data.data_.data()) + c * cell_size, cell_size);
+        }
+
+        if (value_count == 0 || cell < min) {
+          min = cell;
+        }
+        if (value_count == 0 || cell > max) {
+          max = cell;
+        }
+        value_count++;
+      }
+
+      if (value_count > 0) {
+        auto stored_min = var
+            ? var_value(mins, min_var, t)
+            : std::string_view(reinterpret_cast<const char*>(mins.data()) + t * cell_size, cell_size);
+        auto stored_max = var
+            ? var_value(maxs, max_var, t)
+            : std::string_view(reinterpret_cast<const char*>(maxs.data()) + t * cell_size, cell_size);
+        if (check_min && stored_min != min) {
+          mismatch(t, "min", format_string(stored_min), format_string(min));
+        }
+        if (check_max && stored_max != max) {
+          mismatch(t, "max", format_string(stored_max), format_string(max));
+        }
+      }
+    }
+
+    if (check_nulls && null_counts[t] != null_count) {
+      mismatch(t, "null_count", std::to_string(null_counts[t]), std::to_string(null_count));
+    }
+  }
+}
+
+}  // namespace
+
+Verification::Verification(FragmentMetadata& fmd, ThreadPool* pool, bool use_mmap, int64_t field)
+    : kernel_(current_stats_kernel().name()) {
+  if (field >= 0) {
+    fields_.resize(1);
+    fields_[0].field_ = field;
+  } else {
+    fields_.resize(fmd.nfields_);
+    for (size_t i = 0; i < fields_.size(); i++) {
+      fields_[i].field_ = i;
+    }
+  }
+
+  auto verify = [&](FieldVerification& result) {
+    try {
+      verify_field(fmd, use_mmap, result);
+    } catch (std::exception& exc) {
+      result.error_ = exc.what();
+    }
+  };
+
+  if (pool == nullptr) {
+    for (auto& result : fields_) {
+      verify(result);
+    }
+    return;
+  }
+
+  TaskGroup group;
+  for (auto& result : fields_) {
+    pool->submit(group, [&]() { verify(result); });
+  }
+  pool->wait(group);
+}
+
+bool
+Verification::failed() const {
+  for (auto& field : fields_) {
+    if (field.num_mismatches_ > 0 || !field.error_.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+Verification::dump(FILE* out) {
+  uint64_t num_mismatches = 0;
+  fprintf(out, "Verification:\n");
+  fprintf(out, "    Kernel: %s\n", kernel_);
+  for (auto& field : fields_) {
+    fprintf(out, "    %zu: %s: ", field.field_, field.name_.c_str());
+    if (!field.skipped_.empty()) {
+      fprintf(out, "skipped, %s\n", field.skipped_.c_str());
+      continue;
+    }
+
+    fprintf(out, "%llu tiles, %llu bytes,", (unsigned long long)field.tiles_, (unsigned long long)field.bytes_);
+    for (auto stat : field.checked_) {
+      fprintf(out, " %s", stat);
+    }
+
+    if (!field.error_.empty()) {
+      fprintf(out, ": error, %s\n", field.error_.c_str());
+    } else if (field.num_mismatches_ == 0) {
+      fprintf(out, ": ok\n");
+    } else {
+      fprintf(out, ": %llu mismatches\n", (unsigned long long)field.num_mismatches_);
+    }
+
+    for (auto& mismatch : field.mismatches_) {
+      fprintf(out, "        Tile %llu %s: stored %s, computed %s\n",
+          (unsigned long long)mismatch.tile_, mismatch.stat_, mismatch.stored_.c_str(), mismatch.computed_.c_str());
+    }
+    if (field.num_mismatches_ > field.mismatches_.size()) {
+      fprintf(out, "        ... %llu more\n",
+          (unsigned long long)(field.num_mismatches_ - field.mismatches_.size()));
+    }
+
+    num_mismatches += field.num_mismatches_;
+  }
+  fprintf(out, "    Mismatches: %llu\n", (unsigned long long)num_mismatches);
+}
+
+void
+Verification::emit(Emitter& out) {
+  for (auto& field : fields_) {
+    out.begin_record("verification", field.field_);
+    out.str("name", field.name_);
+    out.str("kernel", kernel_);
+    if (!field.skipped_.empty()) {
+      out.str("skipped", field.skipped_);
+      out.end_record();
+      continue;
+    }
+
+    out.u64("tiles", field.tiles_);
+    out.u64("bytes", field.bytes_);
+    out.begin_array("checked");
+    for (auto stat : field.checked_) {
+      out.str(nullptr, stat);
+    }
+    out.end_array();
+
+    if (!field.error_.empty()) {
+      out.str("error", field.error_);
+    }
+
+    out.u64("num_mismatches", field.num_mismatches_);
+    out.begin_array("mismatches");
+    for (auto& mismatch : field.mismatches_) {
+      out.begin_object(nullptr);
+      out.u64("tile", mismatch.tile_);
+      out.str("stat", mismatch.stat_);
+      out.str("stored", mismatch.stored_);
+      out.str("computed", mismatch.computed_);
+      out.end_object();
+    }
+    out.end_array();
+    out.end_record();
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Emitter;
+struct FragmentMetadata;
+struct ThreadPool;
+
+// Only this many of a field's mismatches are kept for the report. The
+// rest are counted.
+#define VERIFY_MAX_MISMATCHES 16
+
+// Floating point sums are compared with this relative tolerance since
+// TileDB adds values in a different order than the vector kernels do.
+#define VERIFY_SUM_TOLERANCE 1e-6
+
+// A stored tile statistic that disagrees with the one recomputed from the
+// field's data tiles.
+struct StatMismatch {
+  uint64_t tile_;
+  const char* stat_;
+  std::string stored_;
+  std::string computed_;
+};
+
+struct FieldVerification {
+  size_t field_ = 0;
+  std::string name_;
+
+  // Why the field wasn't verified, or what stopped its verification
+  // partway through. At most one is set.
+  std::string skipped_;
+  std::string error_;
+
+  uint64_t tiles_ = 0;
+  uint64_t bytes_ = 0;
+  std::vector<const char*> checked_;
+  uint64_t num_mismatches_ = 0;
+  std::vector<StatMismatch> mismatches_;
+};
+
+// Reads a fragment's data tiles (the a0.tdb, a0_var.tdb, a0_validity.tdb,
+// d0.tdb, ... files next to its metadata) and recomputes each tile's min,
+// max, sum and null count, then compares them to the tile_min, tile_max,
+// tile_sum and tile_null_count sections. Needs the fragment's schema for
+// field types and filter pipelines. Fields are verified in parallel on
+// pool, or only field when it isn't -1.
+struct Verification {
+  Verification(FragmentMetadata& fmd, ThreadPool* pool, bool use_mmap, int64_t field = -1);
+
+  // True if any statistic mismatched or a field couldn't be read.
+  bool failed() const;
+
+  void dump(FILE* out = stderr);
+  void emit(Emitter& out);
+
+  const char* kernel_;
+  std::vector<FieldVerification> fields_;
+};
@@ -0,0 +1,446 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+
+#include "emitter.h"
+#include "fragment_metadata.h"
+#include "reader.h"
+#include "thread_pool.h"
+#include "tile.h"
+#include "writer.h"
+
+// Generic tiles written without encryption.
+#define NO_ENCRYPTION 0
+
+struct Codec {
+  const char* name_;
+  Compressor compressor_;
+};
+
+static const Codec codecs[] = {
+  {"gzip", Compressor::GZIP},
+#ifdef HAVE_ZSTD
+  {"zstd", Compressor::ZSTD},
+#endif
+#ifdef HAVE_LZ4
+  {"lz4", Compressor::LZ4},
+#endif
+#ifdef HAVE_BZIP2
+  {"bzip2", Compressor::BZIP2},
+#endif
+  {"none", Compressor::NONE},
+};
+
+static const char*
+codec_name(Compressor compressor) {
+  for (auto& codec : codecs) {
+    if (codec.compressor_ == compressor) {
+      return codec.name_;
+    }
+  }
+  return "unknown";
+}
+
+const char*
+available_codecs() {
+  static const std::string names = []() {
+    std::string ret;
+    for (auto& codec : codecs) {
+      ret += ret.empty() ? "" : " ";
+      ret += codec.name_;
+    }
+    return ret;
+  }();
+  return names.c_str();
+}
+
+bool
+parse_codec(const char* name, Compressor& compressor) {
+  for (auto& codec : codecs) {
+    if (strcmp(codec.name_, name) == 0) {
+      compressor = codec.compressor_;
+      return true;
+    }
+  }
+  return false;
+}
+
+int32_t
+default_level(Compressor compressor) {
+  switch (compressor) {
+#ifdef HAVE_ZSTD
+    case Compressor::ZSTD:
+      return ZSTD_CLEVEL_DEFAULT;
+#endif
+    case Compressor::BZIP2:
+      return 9;
+    case Compressor::GZIP:
+      return Z_DEFAULT_COMPRESSION;
+    default:
+      return 0;
+  }
+}
+
+template <class T>
+static void
+put(std::vector<uint8_t>& buf, T val) {
+  auto ptr = reinterpret_cast<const uint8_t*>(&val);
+  buf.insert(buf.end(), ptr, ptr + sizeof(T));
+}
+
+static void
+put_bytes(std::vector<uint8_t>& buf, const void* data, size_t nbytes) {
+  auto ptr = static_cast<const uint8_t*>(data);
+  buf.insert(buf.end(), ptr, ptr + nbytes);
+}
+
+// Compress src into dst, which is resized to fit the result.
+static void
+compress_part(const WriteOptions& opts, const uint8_t* src, size_t nbytes, std::vector<uint8_t>& dst) {
+  bool ok = false;
+  switch (opts.compressor_) {
+    case Compressor::GZIP: {
+      uLongf dst_nbytes = compressBound(nbytes);
+      dst.resize(dst_nbytes);
+      ok = compress2(dst.data(), &dst_nbytes, src, nbytes, opts.level_) == Z_OK;
+      dst.resize(dst_nbytes);
+      break;
+    }
+
+#ifdef HAVE_ZSTD
+    case Compressor::ZSTD: {
+      static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx(
+          ZSTD_createCCtx(), ZSTD_freeCCtx);
+      dst.resize(ZSTD_compressBound(nbytes));
+      auto rc = ZSTD_compressCCtx(ctx.get(), dst.data(), dst.size(), src, nbytes, opts.level_);
+      ok = !ZSTD_isError(rc);
+      dst.resize(ok ? rc : 0);
+      break;
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    case Compressor::LZ4: {
+      dst.resize(LZ4_compressBound(nbytes));
+      auto rc = LZ4_compress_default(
+          reinterpret_cast<const char*>(src),
+          reinterpret_cast<char*>(dst.data()),
+          nbytes,
+          dst.size());
+      ok = rc > 0;
+      dst.resize(ok ? rc : 0);
+      break;
+    }
+#endif
+
+#ifdef HAVE_BZIP2
+    case Compressor::BZIP2: {
+      // bzip2 can grow incompressible input by about 1%.
+      unsigned int dst_nbytes = nbytes + nbytes / 100 + 600;
+      dst.resize(dst_nbytes);
+      auto rc = BZ2_bzBuffToBuffCompress(
+          reinterpret_cast<char*>(dst.data()),
+          &dst_nbytes,
+          const_cast<char*>(reinterpret_cast<const char*>(src)),
+          nbytes,
+          opts.level_,
+          0,
+          0);
+      ok = rc == BZ_OK;
+      dst.resize(dst_nbytes);
+      break;
+    }
+#endif
+
+    default:
+      break;
+  }
+
+  if (!ok) {
+    throw std::runtime_error(
+        std::string("Failed to compress chunk with ") + codec_name(opts.compressor_)
+        + " at level " + std::to_string(opts.level_) + ".");
+  }
+}
+
+// Serialize one chunk as its chunk list entry: the unfiltered, filtered
+// and metadata sizes followed by the metadata and data. Compressed chunks
+// are a single part, so their metadata is no metadata parts, one data
+// part and that part's sizes.
+static void
+encode_chunk(const WriteOptions& opts, const uint8_t* data, size_t nbytes, std::vector<uint8_t>& out) {
+  if (opts.compressor_ == Compressor::NONE) {
+    put<uint32_t>(out, nbytes);
+    put<uint32_t>(out, nbytes);
+    put<uint32_t>(out, 0);
+    put_bytes(out, data, nbytes);
+    return;
+  }
+
+  std::vector<uint8_t> compressed;
+  compress_part(opts, data, nbytes, compressed);
+
+  put<uint32_t>(out, nbytes);
+  put<uint32_t>(out, compressed.size());
+  put<uint32_t>(out, 4 * sizeof(uint32_t));
+  put<uint32_t>(out, 0);
+  put<uint32_t>(out, 1);
+  put<uint32_t>(out, nbytes);
+  put<uint32_t>(out, compressed.size());
+  put_bytes(out, compressed.data(), compressed.size());
+}
+
+// The pipeline stored in every rewritten tile. NONE is stored as an
+// empty pipeline rather than a NONE filter.
+static std::vector<uint8_t>
+encode_pipeline(const WriteOptions& opts) {
+  std::vector<uint8_t> pipeline;
+  put<uint32_t>(pipeline, opts.chunk_size_);
+  if (opts.compressor_ == Compressor::NONE) {
+    put<uint32_t>(pipeline, 0);
+    return pipeline;
+  }
+
+  put<uint32_t>(pipeline, 1);
+  put<uint8_t>(pipeline, static_cast<uint8_t>(opts.compressor_));
+  put<uint32_t>(pipeline, sizeof(uint8_t) + sizeof(int32_t));
+  put<uint8_t>(pipeline, static_cast<uint8_t>(opts.compressor_));
+  put<int32_t>(pipeline, opts.level_);
+  return pipeline;
+}
+
+// The footer as Footer parses it, pointing at the new tile offsets.
+static std::vector<uint8_t>
+encode_footer(const Footer& footer, const std::map<uint64_t, uint64_t>& offsets) {
+  std::vector<uint8_t> buf;
+  auto put_offset = [&](uint64_t offset) {
+    put<uint64_t>(buf, offsets.at(offset));
+  };
+  auto put_offsets = [&](const std::vector<uint64_t>& values) {
+    for (auto offset : values) {
+      put_offset(offset);
+    }
+  };
+  auto put_values = [&](const std::vector<uint64_t>& values) {
+    put_bytes(buf, values.data(), values.size() * sizeof(uint64_t));
+  };
+
+  put<uint32_t>(buf, footer.version_);
+  put<uint64_t>(buf, footer.array_schema_.size());
+  put_bytes(buf, footer.array_schema_.data(), footer.array_schema_.size());
+  put<uint8_t>(buf, footer.fragment_type_);
+  put<uint8_t>(buf, footer.null_non_empty_domain_);
+  put_bytes(buf, footer.non_empty_domain_.data(), footer.non_empty_domain_.size());
+  put<uint64_t>(buf, footer.sparse_tile_num_);
+  put<uint64_t>(buf, footer.last_tile_cell_num_);
+  put<uint8_t>(buf, footer.has_timestamps_);
+  put<uint8_t>(buf, footer.has_delete_meta_);
+
+  put_values(footer.file_sizes_);
+  put_values(footer.file_var_sizes_);
+  put_values(footer.file_validity_sizes_);
+
+  auto& gt = footer.gt_offsets_;
+  put_offset(gt.rtree_);
+  put_offsets(gt.tile_offsets_);
+  put_offsets(gt.tile_var_offsets_);
+  put_offsets(gt.tile_var_sizes_);
+  put_offsets(gt.tile_validity_offsets_);
+  put_offsets(gt.tile_min_offsets_);
+  put_offsets(gt.tile_max_offsets_);
+  put_offsets(gt.tile_sum_offsets_);
+  put_offsets(gt.tile_null_count_offsets_);
+  put_offset(gt.fragment_min_max_sum_null_count_offset_);
+  put_offset(gt.processed_conditions_offsets_);
+  return buf;
+}
+
+// Compare a tile read back from the rewritten file with the section it
+// was written from.
+static void
+check_tile(Reader& reader, uint64_t offset, const Tile& expected) {
+  Tile tile = read_tile(reader, offset);
+  if (tile.version_ != expected.version_
+      || tile.datatype_ != expected.datatype_
+      || tile.cell_size_ != expected.cell_size_
+      || tile.size() != expected.size()
+      || (!tile.empty() && memcmp(tile.data(), expected.data(), tile.size()) != 0)) {
+    throw std::runtime_error(
+        "Rewritten tile at offset " + std::to_string(offset) + " does not match the original.");
+  }
+}
+
+Rewrite::Rewrite(FragmentMetadata& fmd, const std::string& path, const WriteOptions& opts, ThreadPool* pool)
+    : path_(path)
+    , opts_(opts) {
+  if (opts_.chunk_size_ == 0) {
+    throw std::invalid_argument("The chunk size must be greater than zero.");
+  }
+
+  fmd.load_all();
+  bytes_in_ = fmd.reader_.file_size_;
+
+  // Tiles keep their order in the original file so sections that are
+  // read together stay together.
+  std::map<uint64_t, uint64_t> offsets;
+  std::vector<std::pair<uint64_t, const Tile*>> tiles;
+  for (auto& section : fmd.sections()) {
+    if (offsets.emplace(section.first, 0).second) {
+      tiles.push_back(section);
+    } else {
+      shared_++;
+    }
+  }
+  std::sort(tiles.begin(), tiles.end(), [](auto& a, auto& b) { return a.first < b.first; });
+  tiles_ = tiles.size();
+
+  // Every chunk of every tile is compressed as its own task.
+  std::vector<std::vector<std::vector<uint8_t>>> chunks(tiles.size());
+  TaskGroup group;
+  for (size_t i = 0; i < tiles.size(); i++) {
+    auto& tile = *tiles[i].second;
+    chunks[i].resize((tile.size() + opts_.chunk_size_ - 1) / opts_.chunk_size_);
+    chunks_ += chunks[i].size();
+    data_bytes_ += tile.size();
+
+    for (size_t j = 0; j < chunks[i].size(); j++) {
+      auto task = [&, i, j]() {
+        auto& tile = *tiles[i].second;
+        size_t start = j * opts_.chunk_size_;
+        size_t nbytes = std::min<size_t>(opts_.chunk_size_, tile.size() - start);
+        encode_chunk(opts_, tile.data() + start, nbytes, chunks[i][j]);
+      };
+
+      if (pool == nullptr) {
+        task();
+      } else {
+        pool->submit(group, task);
+      }
+    }
+  }
+
+  if (pool != nullptr) {
+    pool->wait(group);
+  }
+
+  auto pipeline = encode_pipeline(opts_);
+  std::vector<uint8_t> file;
+  for (size_t i = 0; i < tiles.size(); i++) {
+    auto& tile = *tiles[i].second;
+    offsets[tiles[i].first] = file.size();
+
+    uint64_t persisted_size = sizeof(uint64_t);
+    for (auto& chunk : chunks[i]) {
+      persisted_size += chunk.size();
+    }
+
+    put<uint32_t>(file, tile.version_);
+    put<uint64_t>(file, persisted_size);
+    put<uint64_t>(file, tile.size());
+    put<uint8_t>(file, tile.datatype_);
+    put<uint64_t>(file, tile.cell_size_);
+    put<uint8_t>(file, NO_ENCRYPTION);
+    put<uint32_t>(file, pipeline.size());
+    put_bytes(file, pipeline.data(), pipeline.size());
+    put<uint64_t>(file, chunks[i].size());
+    for (auto& chunk : chunks[i]) {
+      put_bytes(file, chunk.data(), chunk.size());
+    }
+    chunks[i] = {};
+  }
+
+  auto footer = encode_footer(fmd.footer_, offsets);
+  put_bytes(file, footer.data(), footer.size());
+  put<uint64_t>(file, footer.size());
+  bytes_out_ = file.size();
+
+  // Written next to path so the rename stays on one filesystem.
+  std::string tmp = path_ + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) {
+    throw std::runtime_error("Error creating '" + tmp + "': " + strerror(errno));
+  }
+
+  // mkstemp creates the file private to its owner.
+  (void)fchmod(fd, 0644);
+
+  FILE* out = fdopen(fd, "w");
+  if (out == nullptr) {
+    ::close(fd);
+    unlink(tmp.c_str());
+    throw std::runtime_error("Error opening '" + tmp + "': " + strerror(errno));
+  }
+
+  fwrite(file.data(), 1, file.size(), out);
+  bool failed = ferror(out) != 0;
+  if (fclose(out) != 0 || failed) {
+    unlink(tmp.c_str());
+    throw std::runtime_error("Error writing '" + tmp + "'");
+  }
+
+  try {
+    Reader reader(tmp.c_str());
+    for (auto& tile : tiles) {
+      check_tile(reader, offsets[tile.first], *tile.second);
+    }
+  } catch (...) {
+    unlink(tmp.c_str());
+    throw;
+  }
+
+  if (rename(tmp.c_str(), path_.c_str()) != 0) {
+    int err = errno;
+    unlink(tmp.c_str());
+    throw std::runtime_error("Error renaming '" + tmp + "' to '" + path_ + "': " + strerror(err));
+  }
+}
+
+void
+Rewrite::dump(FILE* out) {
+  fprintf(out, "Rewrite:\n");
+  fprintf(out, "    Path: %s\n", path_.c_str());
+  fprintf(out, "    Codec: %s, level %d, %u byte chunks\n",
+      codec_name(opts_.compressor_), opts_.level_, opts_.chunk_size_);
+  fprintf(out, "    Tiles: %llu (%llu shared), %llu chunks, %llu bytes decoded\n",
+      (unsigned long long)tiles_, (unsigned long long)shared_, (unsigned long long)chunks_,
+      (unsigned long long)data_bytes_);
+  fprintf(out, "    Size: %llu -> %llu bytes (%.1f%%)\n",
+      (unsigned long long)bytes_in_, (unsigned long long)bytes_out_, bytes_in_ == 0 ? 0.0 : 100.0 * bytes_out_ / bytes_in_);
+}
+
+void
+Rewrite::emit(Emitter& out) {
+  out.begin_record("rewrite");
+  out.str("output", path_);
+  out.str("codec", codec_name(opts_.compressor_));
+  out.str("level", std::to_string(opts_.level_));
+  out.u64("chunk_size", opts_.chunk_size_);
+  out.u64("tiles", tiles_);
+  out.u64("shared", shared_);
+  out.u64("chunks", chunks_);
+  out.u64("data_bytes", data_bytes_);
+  out.u64("bytes_in", bytes_in_);
+  out.u64("bytes_out", bytes_out_);
+  out.end_record();
+}
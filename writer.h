@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "filter_pipeline.h"
+
+struct Emitter;
+struct FragmentMetadata;
+struct ThreadPool;
+
+// TileDB's default maximum generic tile chunk size.
+#define DEFAULT_WRITE_CHUNK_SIZE (64 * 1024)
+
+// How a rewrite filters and chunks each generic tile. level_ is passed to
+// the codec as is; default_level picks the codec's usual one.
+struct WriteOptions {
+  Compressor compressor_ = Compressor::GZIP;
+  int32_t level_ = -1;
+  uint32_t chunk_size_ = DEFAULT_WRITE_CHUNK_SIZE;
+};
+
+// The codecs a rewrite can compress with in this build, as a space
+// separated list for usage text.
+const char* available_codecs();
+
+// Look up a codec by name. Returns false when it's unknown or not built in.
+bool parse_codec(const char* name, Compressor& compressor);
+
+int32_t default_level(Compressor compressor);
+
+// Writes a loaded FragmentMetadata back out as a fragment metadata file.
+//
+// Each section is written as a generic tile, in its original order, with
+// the same header and chunk layout read_tile parses but with a freshly
+// serialized pipeline holding just the chosen compression filter, so
+// legacy pipelines and any option bytes they carry are not copied.
+// Sections that share an offset are written once. Chunks of every tile
+// are compressed in parallel on pool. The footer is rewritten with the
+// new offsets.
+//
+// The file is written under a temporary name next to path, each tile is
+// read back and compared against its section, and only then is it
+// renamed into place, so path may be the fragment being rewritten.
+// Throws if the file can't be written or doesn't read back identically.
+struct Rewrite {
+  Rewrite(FragmentMetadata& fmd, const std::string& path, const WriteOptions& opts, ThreadPool* pool);
+
+  void dump(FILE* out = stderr);
+  void emit(Emitter& out);
+
+  std::string path_;
+  WriteOptions opts_;
+  uint64_t tiles_ = 0;
+  uint64_t shared_ = 0;
+  uint64_t chunks_ = 0;
+  uint64_t data_bytes_ = 0;
+  uint64_t bytes_in_ = 0;
+  uint64_t bytes_out_ = 0;
+};